@@ -492,20 +492,26 @@ static void wifiAccessPoint() {
   delay(100);
   }
 
-/** Update a single field from the JSON buffer
+/** Calculate the CRC of the configuration block
  */
-static bool updateField(JsonParser &parser, const char *cszName, char *buffer, int size) {
-  int field = parser.find(0, cszName);
-  if((field>0)&&(parser.str(field)!=NULL)) {
-    if(parser.len(field)>=size)
-      return false;
-    // Update the value
-    memset(buffer, 0, size);
-    strncpy(buffer, parser.str(field), parser.len(field));
-    }
-  return true;
+static uint16_t configCrc() {
+  Crc16 crc;
+  crc.update(&Config, sizeof(WIFI_CONFIG) - sizeof(uint16_t));
+  return crc.finalize();
   }
 
+//---------------------------------------------------------------------------
+// JSON representation of the configuration
+//---------------------------------------------------------------------------
+
+BEGIN_JSON_SCHEMA(CONFIG_SCHEMA)
+  JSON_STRING(WIFI_CONFIG, m_szSSID, "ssid", NoJsonModifier)
+  JSON_STRING(WIFI_CONFIG, m_szPass, "password", JsonFieldWriteOnly)
+  JSON_STRING(WIFI_CONFIG, m_szNode, "node", NoJsonModifier)
+  JSON_STRING(WIFI_CONFIG, m_szMqtt, "mqtt", NoJsonModifier)
+  JSON_STRING(WIFI_CONFIG, m_szTopic, "topic", NoJsonModifier)
+END_JSON_SCHEMA
+
 //---------------------------------------------------------------------------
 // Web server
 //---------------------------------------------------------------------------
@@ -514,6 +520,24 @@ ESP8266WebServer httpServer(80);
 DNSServer dnsServer;
 WIFI_CONFIG Config;
 
+/** Stream JSON output as the content of the current response
+ *
+ * The server decides on the framing, it uses chunked encoding for HTTP/1.1
+ * clients and closes the connection after the content for HTTP/1.0.
+ */
+class ServerOutput : public JsonStreamOutput {
+  protected:
+    virtual bool send(const char *pData, size_t length) {
+      // memcpy_P reads RAM as well as flash on the ESP8266
+      httpServer.sendContent_P(pData, length);
+      return true;
+      }
+
+  public:
+    ServerOutput(char *buffer, size_t size) : JsonStreamOutput(buffer, size) {
+      }
+  };
+
 void handleNotFound() {
   httpServer.send(404, "text/plain", "Resource not found.");
   }
@@ -526,19 +550,16 @@ void handleConfig() {
       JsonToken tokens[16];
       JsonParser parser(tokens, 16);
       String json = httpServer.arg("plain");
-      int count = parser.parse(json.c_str());
+      int count = parser.parse(json.c_str(), json.length());
       if(count > 0) {
-        // Extract the settings
-        status |= updateField(parser, "ssid", Config.m_szSSID, MAX_SSID_LENGTH);
-        status |= updateField(parser, "password", Config.m_szPass, MAX_PASSWORD_LENGTH);
-        status |= updateField(parser, "node", Config.m_szNode, MAX_NODEID_LENGTH);
-        status |= updateField(parser, "mqtt", Config.m_szMqtt, MAX_SERVER_NAME_LENGTH);
-        status |= updateField(parser, "topic", Config.m_szTopic, MAX_TOPIC_NAME_LENGTH);
-        // Recalculate the CRC
-        Crc16 crc;
-        Config.m_crc16 = crc.XModemCrc((uint8_t *)&Config, 0, sizeof(WIFI_CONFIG) - sizeof(uint16_t));
-        // Save to EEPROM
+        // Extract the settings into a copy, a bad field leaves the current
+        // configuration unchanged
+        WIFI_CONFIG update = Config;
+        status = (parser.bind(0, CONFIG_SCHEMA, &update) >= 0);
         if(status) {
+          // Recalculate the CRC and save to EEPROM
+          Config = update;
+          Config.m_crc16 = configCrc();
           EEPROM.put(IotConfig.getEepromOffset(), Config);
           EEPROM.commit();
           }
@@ -547,19 +568,21 @@ void handleConfig() {
         status = false;
       }
     }
-  // Build the response with the current values
-  JsonBuilder builder;
-  builder.add("ssid", Config.m_szSSID);
-  builder.add("node", Config.m_szNode);
-  builder.add("mqtt", Config.m_szMqtt);
-  builder.add("topic", Config.m_szTopic);
-  if (httpServer.method() == HTTP_POST) {
+  // Send the headers, the length is not known until the body is sent
+  httpServer.setContentLength(CONTENT_LENGTH_UNKNOWN);
+  httpServer.send(200, "application/json", "");
+  // Stream the response with the current values
+  char window[128];
+  ServerOutput output(window, sizeof(window));
+  JsonBuilder builder(output);
+  builder.add(CONFIG_SCHEMA, &Config);
+  if (httpServer.method() == HTTP_POST)
     builder.add("status", status);
-    if(status)
-      IotConfig.onConfigChange();
-    }
   builder.end();
-  httpServer.send(200, "application/json", builder.getResult());
+  // Ends the response (the last chunk if chunked encoding is used)
+  httpServer.sendContent("");
+  if ((httpServer.method() == HTTP_POST) && status)
+    IotConfig.onConfigChange();
   }
 
 void handleDefault() {
@@ -601,9 +624,7 @@ bool IotConfigClass::setup(bool force, int eepromOffset) {
   m_eepromOffset = eepromOffset;
   // Load and verify the stored configuration
   EEPROM.get(m_eepromOffset, Config);
-  Crc16 crc;
-  uint16_t expected = crc.XModemCrc((uint8_t *)&Config, 0, sizeof(WIFI_CONFIG) - sizeof(uint16_t));
-  if(expected!=Config.m_crc16) {
+  if(configCrc()!=Config.m_crc16) {
     memset(&Config, 0, sizeof(WIFI_CONFIG));
     force = true;
     }
@@ -0,0 +1,298 @@
+/*--------------------------------------------------------------------------*
+* CBOR (RFC 7049) encoding with the same interface as the JSON classes.
+*---------------------------------------------------------------------------*
+* CborBuilder and CborParser have the same methods as JsonBuilder and
+* JsonParser so application code can switch between the text and binary
+* formats by changing the type it uses.
+*--------------------------------------------------------------------------*/
+#ifndef __CBOR_H
+#define __CBOR_H
+
+#include "Json.h"
+
+// Maximum nesting depth accepted by the parser (by default anything the
+// builder can generate)
+#ifndef CBOR_MAX_DEPTH
+#  define CBOR_MAX_DEPTH JSON_MAX_DEPTH
+#endif
+
+/** Parser for CBOR content
+ *
+ * Produces the same tokens as JsonParser so find(), next(), bind() and the
+ * key index work unchanged. Maps become JsonObject tokens (keys must be
+ * text strings), arrays become JsonArray tokens, text and byte strings
+ * become JsonString tokens and everything else is a JsonPrimitive. Tags
+ * are skipped. Indefinite length strings are not supported.
+ */
+class CborParser : public JsonParser {
+  protected:
+    /** Tokenise the data set up by parse()
+     *
+     * @return the number of tokens discovered or a negative value if an
+     *         error occurs.
+     */
+    int Scan();
+
+  public:
+    /** Initialise the parser with the token pool to use.
+     *
+     * @param pTokens pointer to an array of JsonToken structures
+     * @param tokens the maximum number of tokens that can be stored.
+     */
+    CborParser(JsonToken *pTokens, int tokens);
+
+    /** Parse CBOR from a buffer in memory
+     *
+     * @param pData pointer to the data to be parsed.
+     * @param length the number of bytes to parse.
+     *
+     * @return the number of tokens discovered or a negative value if an
+     *         error occurs (JsonErrorPartial if the data is incomplete).
+     */
+    int parse(const char *pData, size_t length);
+
+    /** Parse CBOR from a buffer in memory
+     *
+     * @param pData pointer to the data to be parsed.
+     * @param length the number of bytes to parse.
+     *
+     * @return the number of tokens discovered or a negative value if an
+     *         error occurs (JsonErrorPartial if the data is incomplete).
+     */
+    int parse(const uint8_t *pData, size_t length);
+
+    /** Parse with the data available so far
+     *
+     * The data is scanned from the start each time, CBOR has no character
+     * level processing so this is cheap.
+     *
+     * @return the number of tokens discovered, JsonErrorPartial if more data
+     *         is needed or another negative value if an error occurs.
+     */
+    int resume(const char *pData, size_t length);
+
+    /** Get the value of an integer
+     *
+     * @return true on success, false if the token is not an integer or is
+     *         out of range.
+     */
+    virtual bool getInt(int token, long &value);
+
+    /** Get the value of an integer or floating point number
+     *
+     * @return true on success, false if the token is not a number.
+     */
+    virtual bool getDouble(int token, double &value);
+
+    /** Get the value of a boolean
+     *
+     * @return true on success, false if the token is not a boolean.
+     */
+    virtual bool getBool(int token, bool &value);
+
+    /** Determine if a token is null (or undefined)
+     */
+    virtual bool isNull(int token);
+
+    /** Copy the value of a string
+     *
+     * The result is always NUL terminated.
+     *
+     * @return the length of the string (excluding the NUL terminator) or -1
+     *         if the token is not a string or will not fit in the buffer.
+     */
+    virtual int unescape(int token, char *buffer, int size);
+  };
+
+/** Helper class to build a CBOR document in memory
+ *
+ * The document is a map. Maps and arrays use the indefinite length
+ * encoding so nothing needs to be patched when they are closed.
+ */
+class CborBuilder {
+  private:
+    JsonGrowableOutput m_default; // Output used if none is supplied
+    JsonOutput      *m_pOutput;
+    JsonLevelBits    m_arrays; // Levels that are arrays rather than maps
+    int              m_depth;
+
+    // Builders may refer to their own output so cannot be copied
+    CborBuilder(const CborBuilder &);
+    CborBuilder &operator=(const CborBuilder &);
+
+  protected:
+    /** Determine if values are currently being added to a map
+     */
+    inline bool inObject() const {
+      return (m_depth>=0)&&!m_arrays.get(m_depth);
+      }
+
+    /** Determine if values are currently being added to an array
+     */
+    inline bool inArray() const {
+      return (m_depth>=0)&&m_arrays.get(m_depth);
+      }
+
+    /** Add the initial byte(s) of an item
+     *
+     * @param major the major type (in the top three bits).
+     * @param value the argument, encoded in the fewest bytes possible.
+     *
+     * @return true if the header was added, false if the output is full.
+     */
+    bool addHead(uint8_t major, uint64_t value);
+
+    /** Add a text string
+     */
+    bool addString(const char *cszString);
+
+    /** Add an integer
+     */
+    bool addInteger(int64_t value);
+
+    /** Add a floating point value
+     *
+     * Whole numbers are written as integers, other values as single
+     * precision if that is exact.
+     */
+    bool addNumber(double value);
+
+    /** Finish adding a value, rewinding the output if it did not fit
+     *
+     * @return the value of success.
+     */
+    bool completed(size_t mark, bool success);
+
+  public:
+    /** Default constructor
+     *
+     * The result is built in a heap buffer that grows as needed.
+     */
+    CborBuilder();
+
+    /** Build the result using the given output
+     *
+     * @param output the output to use, any existing content is discarded.
+     */
+    CborBuilder(JsonOutput &output);
+
+    /** Add a string value to the current object
+     *
+     * @return true if the value was added, false if the buffer is full.
+     */
+    bool add(const char *cszName, const char *cszValue);
+
+    /** Add a boolean value to the current object
+     *
+     * @return true if the value was added, false if the buffer is full.
+     */
+    bool add(const char *cszName, bool value);
+
+    /** Add a integer value to the current object
+     *
+     * @return true if the value was added, false if the buffer is full.
+     */
+    bool add(const char *cszName, int value);
+
+    /** Add a floating point value to the current object
+     *
+     * @return true if the value was added, false if the buffer is full.
+     */
+    bool add(const char *cszName, double value);
+
+    /** Add the members of a struct to the current object
+     *
+     * @return true if the values were added, false if the buffer is full.
+     */
+    bool add(const JsonField *pSchema, const void *pStruct);
+
+    /** Add a new child object to the current object
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool beginObject(const char *cszName);
+
+    /** Add a new child object to the current array
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool beginObject();
+
+    /** End the current child object
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool endObject();
+
+    /** Add a new child array to the current object
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool beginArray(const char *cszName);
+
+    /** Add a new child array to the current array
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool beginArray();
+
+    /** End the current child array
+     *
+     * @return true on success, false if the buffer is full or the operation
+     *         is not available in the current state.
+     */
+    bool endArray();
+
+    /** Add a new string to the current array
+     *
+     * @return true on success, false if the buffer is full or the builder is
+     *         not currently building an array.
+     */
+    bool add(const char *cszValue);
+
+    /** Add a new boolean value to the current array
+     *
+     * @return true on success, false if the buffer is full or the builder is
+     *         not currently building an array.
+     */
+    bool add(bool value);
+
+    /** Add a new integer value to the current array
+     *
+     * @return true on success, false if the buffer is full or the builder is
+     *         not currently building an array.
+     */
+    bool add(int value);
+
+    /** Add a new floating point value to the current array
+     *
+     * @return true on success, false if the buffer is full or the builder is
+     *         not currently building an array.
+     */
+    bool add(double value);
+
+    /** Finish building.
+     *
+     * This closes all current open maps and arrays and flushes streamed
+     * output.
+     *
+     * @return the number of bytes in the document or 0 if the buffer is
+     *         full.
+     */
+    int end();
+
+    /** Get the resulting document
+     *
+     * The data is binary, use the value returned by end() for the length.
+     */
+    inline const char *getResult() {
+      return m_pOutput->result();
+      }
+  };
+
+#endif /* __CBOR_H */
@@ -8,6 +8,21 @@
 #ifndef __JSON_H
 #define __JSON_H
 
+#include <stddef.h>
+#include <string.h>
+
+// Host builds pre-scan the input 64 bytes at a time (using SSE2 or AVX2 if
+// available) to find quotes, backslashes and non-whitespace characters.
+// Define JSON_NO_PRESCAN to use the character by character scan instead.
+#if !defined(ARDUINO) && !defined(JSON_NO_PRESCAN)
+#  define JSON_PRESCAN
+#endif
+
+// Define this to record the parent of each token. Closing objects and arrays
+// and handling separators then takes constant time rather than a scan back
+// through all the tokens, at the cost of an extra int per token.
+//#define JSON_PARENT_LINKS
+
 /** JSON data types
  */
 typedef enum {
@@ -24,6 +39,10 @@ typedef struct {
   int      start; /* Token start position */
   int      end;   /* Token end position */
   int      size;  /* Number of child (nested) tokens */
+  int      next;  /* Token following this one and everything nested in it */
+#ifdef JSON_PARENT_LINKS
+  int      parent; /* Index of the parent token */
+#endif
   } JsonToken;
 
 typedef enum {
@@ -32,16 +51,88 @@ typedef enum {
   JsonErrorPartial     = -3  // Incomplete JSON data
   } JsonError;
 
+/** Types of struct members that can be bound to JSON fields
+ */
+typedef enum {
+  JsonFieldEnd     = 0, // Marks the end of a schema
+  JsonFieldString  = 1, // Character array
+  JsonFieldInteger = 2, // Signed integer (1, 2, 4 or 8 bytes)
+  JsonFieldNumber  = 3, // float or double
+  JsonFieldBoolean = 4  // bool
+  } JsonFieldType;
+
+/** Modifiers for bound fields
+ */
+typedef enum {
+  NoJsonModifier     = 0,    // Use for no modifications
+  JsonFieldWriteOnly = 0x80  // Field is read from JSON but never generated
+  } JsonFieldModifier;
+
+/** Describes how a member of a struct maps to a JSON field
+ */
+typedef struct {
+  const char    *name;   // Name of the JSON field
+  uint32_t       hash;   // Hash of the name (see JsonHash())
+  unsigned char  type;   // Member type (JsonFieldType)
+  unsigned char  flags;  // Modifiers (JsonFieldModifier)
+  unsigned short offset; // Offset of the member in the struct
+  unsigned short size;   // Size of the member in bytes
+  } JsonField;
+
+/** Hash a field name (FNV-1a), evaluated at compile time for constants
+ */
+constexpr uint32_t JsonHash(const char *cszName, uint32_t hash = 2166136261u) {
+  return (*cszName == '\0') ? hash : JsonHash(cszName + 1, (hash ^ (uint8_t)*cszName) * 16777619u);
+  }
+
+//---------------------------------------------------------------------------
+// Macros to build a schema table
+//---------------------------------------------------------------------------
+
+#define BEGIN_JSON_SCHEMA(name) \
+  const JsonField name[] = {
+
+#define JSON_FIELD(type, member, name, kind, flags) \
+  { name, JsonHash(name), kind, flags, offsetof(type, member), sizeof(((type *)0)->member) },
+
+#define JSON_STRING(type, member, name, flags) \
+  JSON_FIELD(type, member, name, JsonFieldString, flags)
+
+#define JSON_INTEGER(type, member, name, flags) \
+  JSON_FIELD(type, member, name, JsonFieldInteger, flags)
+
+#define JSON_NUMBER(type, member, name, flags) \
+  JSON_FIELD(type, member, name, JsonFieldNumber, flags)
+
+#define JSON_BOOLEAN(type, member, name, flags) \
+  JSON_FIELD(type, member, name, JsonFieldBoolean, flags)
+
+#define END_JSON_SCHEMA \
+  { "", 0, JsonFieldEnd } \
+  };
+
 /** Parser for JSON content
  */
 class JsonParser {
-  private:
+  protected:
     unsigned int m_pos;       // offset in the JSON string
     unsigned int m_toknext;   // next token to allocate
     int          m_toksuper;  // superior token node, e.g parent object or array
     JsonToken   *m_pTokens;   // Array of tokens to use
     int          m_tokens;    // Number of available tokens
     const char  *m_cszSource; // Json source data
+    unsigned int m_length;    // Length of the source data
+    int          m_open;      // Number of open objects and arrays
+    int          m_partial;   // Start of a partially scanned string
+    unsigned int m_resume;    // Where to continue scanning that string
+    int         *m_pIndex;    // Scratch memory for key indexes
+    int          m_indexSize; // Size of the scratch memory (in ints)
+    int          m_indexUsed; // Amount of scratch memory in use
+#ifdef JSON_PRESCAN
+    unsigned int m_block;     // Offset of the block described by the masks
+    uint64_t     m_quotes;    // Quotes and backslashes in the block
+    uint64_t     m_nonspace;  // Non whitespace characters in the block
+#endif
 
   protected:
     /** Allocate (and initialise) a new token
@@ -67,6 +158,54 @@ class JsonParser {
      */
     int ParseString();
 
+#ifdef JSON_PARENT_LINKS
+    /** Find the innermost open object or array
+     *
+     * Starts at the given token and follows the parent links.
+     *
+     * @return the index of the container or -1 if there is none.
+     */
+    int OpenContainer(int token);
+#endif
+
+    /** Compare the name of a field with a string
+     */
+    bool IsField(int key, const char *cszName, int nameLen);
+
+    /** Find (or build) the key index for an object
+     *
+     * @return the offset of the index in the scratch memory or -1 if
+     *         the object cannot be indexed.
+     */
+    int FindIndex(int object);
+
+    /** Store the value of a token in a bound struct member
+     *
+     * @return true on success, false if the value is the wrong type or will
+     *         not fit.
+     */
+    bool StoreField(int token, const JsonField *pField, void *pMember);
+
+#ifdef JSON_PRESCAN
+    /** Build the character masks for the 64 byte block at the given offset
+     */
+    void ScanBlock(unsigned int block);
+
+    /** Find the next quote or backslash at or after the given position
+     *
+     * @return the position of the character or the length of the source if
+     *         there are none.
+     */
+    unsigned int NextString(unsigned int pos);
+
+    /** Find the next non whitespace character at or after the given position
+     *
+     * @return the position of the character or the length of the source if
+     *         there are none.
+     */
+    unsigned int NextToken(unsigned int pos);
+#endif
+
   public:
     /** Initialise the parser with the token pool to use.
      *
@@ -75,6 +214,10 @@ class JsonParser {
      */
     JsonParser(JsonToken *pTokens, int tokens);
 
+    /** Destructor
+     */
+    virtual ~JsonParser() { }
+
     /** Parse JSON from a string buffer in memory
      *
      * @param cszJson pointer to a NUL terminated string containing the JSON
@@ -85,6 +228,48 @@ class JsonParser {
      */
     int parse(const char *cszJson);
 
+    /** Parse JSON from a buffer of known length
+     *
+     * The data is tokenised in place, every scan is limited by the length
+     * so there is no need to copy it into a NUL terminated buffer first.
+     *
+     * @param pData pointer to the JSON to be parsed, this does not need to
+     *              be NUL terminated.
+     * @param length the number of bytes to parse.
+     *
+     * @return the number of tokens discovered or a negative value if an
+     *         error occurs.
+     */
+    int parse(const char *pData, size_t length);
+
+    /** Start an incremental parse
+     *
+     * Resets the parser state ready for a sequence of calls to resume().
+     */
+    void begin();
+
+    /** Continue parsing with the data available so far
+     *
+     * Use this to parse a document that is collected into a buffer as it
+     * arrives, the parser carries on from where the previous call stopped
+     * rather than starting again. pData is the whole document received so
+     * far, independent chunks are not supported: the tokens only record
+     * offsets into the document so every byte of it must still be in one
+     * contiguous buffer when the tokens are used.
+     *
+     * @param pData pointer to the start of the JSON document (not to the
+     *              newly received data). This does not need to be NUL
+     *              terminated and may move between calls.
+     * @param length the number of bytes of the document that are available,
+     *               this must not be less than the value given in the
+     *               previous call.
+     *
+     * @return the number of tokens discovered, JsonErrorPartial if more data
+     *         is needed to complete the document or another negative value
+     *         if an error occurs.
+     */
+    int resume(const char *pData, size_t length);
+
     /** Find the token representing the content of a named field
      *
      * @param object the token index of the object containing the field.
@@ -95,7 +280,50 @@ class JsonParser {
      */
     int find(int object, const char *cszName);
 
+    /** Provide scratch memory for key indexes
+     *
+     * When this is set the first find() on an object builds a small hash
+     * table of its field names in the scratch memory, later lookups in the
+     * same object then take constant time. The indexes are discarded when
+     * a new parse starts. If the scratch memory is full find() falls back
+     * to a linear search.
+     *
+     * @param pScratch memory for the indexes or NULL to disable them.
+     * @param size the number of ints available in the scratch memory.
+     */
+    void setIndex(int *pScratch, int size);
+
+    /** Get the token following a value
+     *
+     * Skips over any tokens nested in the value, for a field name this
+     * includes the value of the field. Use this to step through the fields
+     * of an object or the elements of an array.
+     *
+     * @param token the index of the current token.
+     *
+     * @return the index of the next token or -1 if the token is invalid or
+     *         not complete yet.
+     */
+    int next(int token);
+
+    /** Get the number of fields in an object or elements in an array
+     *
+     * @return the number of children or -1 if the token is not an object or
+     *         array.
+     */
+    int size(int token);
+
+    /** Determine if a token is an object
+     */
+    bool isObject(int token);
+
+    /** Determine if a token is a string (rather than a primitive)
+     */
+    bool isString(int token);
+
     /** Get a pointer to the string represented by the token
+     *
+     * The string is not NUL terminated, use len() to get the length.
      */
     const char *str(int token);
 
@@ -103,36 +331,533 @@ class JsonParser {
      */
     int len(int token);
 
+    /** Get the value of an integer primitive
+     *
+     * The value is parsed straight from the source data.
+     *
+     * @param token the index of the token.
+     * @param value receives the value.
+     *
+     * @return true on success, false if the token is not an integer or is
+     *         out of range.
+     */
+    virtual bool getInt(int token, long &value);
+
+    /** Get the value of a numeric primitive
+     *
+     * Most values (up to 19 significant digits with a small exponent) are
+     * converted exactly without any library calls, anything else falls back
+     * to strtod().
+     *
+     * @param token the index of the token.
+     * @param value receives the value.
+     *
+     * @return true on success, false if the token is not a number.
+     */
+    virtual bool getDouble(int token, double &value);
+
+    /** Get the value of a boolean primitive
+     *
+     * @param token the index of the token.
+     * @param value receives the value.
+     *
+     * @return true on success, false if the token is not 'true' or 'false'.
+     */
+    virtual bool getBool(int token, bool &value);
+
+    /** Determine if a token is the 'null' primitive
+     */
+    virtual bool isNull(int token);
+
+    /** Copy the value of a string with escape sequences decoded
+     *
+     * Escaped unicode characters are stored as UTF-8. The result is always
+     * NUL terminated.
+     *
+     * @param token the index of the token.
+     * @param buffer the buffer to receive the string.
+     * @param size the size of the buffer (including the NUL terminator).
+     *
+     * @return the length of the string (excluding the NUL terminator) or -1
+     *         if the token is not a string or primitive, contains an invalid
+     *         escape sequence or will not fit in the buffer.
+     */
+    virtual int unescape(int token, char *buffer, int size);
+
+    /** Copy the fields of an object into a struct
+     *
+     * The object is walked once, each field name is matched against the
+     * schema by hash. Fields that are not in the schema are ignored and
+     * members that are not in the object are left unchanged.
+     *
+     * @param object the token index of the object.
+     * @param pSchema the schema describing the struct (see BEGIN_JSON_SCHEMA).
+     * @param pStruct the struct to update.
+     *
+     * @return the number of members updated or -1 if the object is invalid
+     *         or any value is of the wrong type or will not fit (the member
+     *         is left unchanged, other members are still updated).
+     */
+    int bind(int object, const JsonField *pSchema, void *pStruct);
+
   };
 
-// Builder state values
-typedef enum {
-  BuildBase,
-  BuildObject,
-  BuildArray
-  } JsonBuilderState;
+/** Add the members of a struct to the current object of a builder
+ *
+ * Shared by the JSON and CBOR builders. Members marked with
+ * JsonFieldWriteOnly are skipped.
+ *
+ * @return true if all the values were added, false if the output is full.
+ */
+template<class BUILDER>
+bool JsonAddFields(BUILDER &builder, const JsonField *pSchema, const void *pStruct) {
+  for(const JsonField *pField = pSchema; pField->type != JsonFieldEnd; pField++) {
+    if(pField->flags & JsonFieldWriteOnly)
+      continue;
+    const void *pMember = (const char *)pStruct + pField->offset;
+    bool added = false;
+    switch(pField->type) {
+      case JsonFieldString:
+        added = builder.add(pField->name, (const char *)pMember);
+        break;
+      case JsonFieldInteger: {
+        int64_t value = 0;
+        if(pField->size==sizeof(int8_t))
+          value = *(const int8_t *)pMember;
+        else if(pField->size==sizeof(int16_t)) {
+          int16_t member;
+          memcpy(&member, pMember, sizeof(member));
+          value = member;
+          }
+        else if(pField->size==sizeof(int32_t)) {
+          int32_t member;
+          memcpy(&member, pMember, sizeof(member));
+          value = member;
+          }
+        else if(pField->size==sizeof(int64_t))
+          memcpy(&value, pMember, sizeof(value));
+        // Values beyond the range of an int are written as numbers
+        if(value==(int)value)
+          added = builder.add(pField->name, (int)value);
+        else
+          added = builder.add(pField->name, (double)value);
+        break;
+        }
+      case JsonFieldNumber:
+        if(pField->size==sizeof(float)) {
+          float member;
+          memcpy(&member, pMember, sizeof(member));
+          added = builder.add(pField->name, (double)member);
+          }
+        else {
+          double member;
+          memcpy(&member, pMember, sizeof(member));
+          added = builder.add(pField->name, member);
+          }
+        break;
+      case JsonFieldBoolean:
+        added = builder.add(pField->name, *(const bool *)pMember);
+        break;
+      }
+    if(!added)
+      return false;
+    }
+  return true;
+  }
+
+// Maximum nesting depth for the builders (including the top level object)
+#ifndef JSON_MAX_DEPTH
+#  define JSON_MAX_DEPTH 32
+#endif
+
+/** One bit of builder state for each nesting level
+ */
+class JsonLevelBits {
+  private:
+    uint32_t m_bits[(JSON_MAX_DEPTH + 31) / 32];
 
-// Maximum nesting depth
-#define MAX_DEPTH 8
+  public:
+    /** Constructor, all bits start clear
+     */
+    JsonLevelBits() {
+      memset(m_bits, 0, sizeof(m_bits));
+      }
+
+    /** Get the bit for a level
+     */
+    inline bool get(int level) const {
+      return (m_bits[level >> 5] >> (level & 31)) & 1;
+      }
+
+    /** Set or clear the bit for a level
+     */
+    inline void set(int level, bool value) {
+      uint32_t mask = (uint32_t)1 << (level & 31);
+      if(value)
+        m_bits[level >> 5] |= mask;
+      else
+        m_bits[level >> 5] &= ~mask;
+      }
+  };
+
+// Buffer sizes (including the NUL terminator) for formatted numbers
+#define JSON_INTEGER_SIZE 22
+#define JSON_NUMBER_SIZE  32
+
+/** Number formatting used by the builder
+ */
+class JsonFormat {
+  public:
+    /** Format an integer
+     *
+     * @param buffer the buffer to receive the value, this must be at least
+     *               JSON_INTEGER_SIZE bytes.
+     * @param value the value to format.
+     *
+     * @return the number of characters (excluding the NUL terminator).
+     */
+    static int integer(char *buffer, long value);
+
+    /** Format a floating point value
+     *
+     * Produces the shortest string that converts back to the same value.
+     * NaN and infinity are written as 'null'.
+     *
+     * @param buffer the buffer to receive the value, this must be at least
+     *               JSON_NUMBER_SIZE bytes.
+     * @param value the value to format.
+     *
+     * @return the number of characters (excluding the NUL terminator).
+     */
+    static int number(char *buffer, double value);
+  };
+
+/** Output window for the JSON builder
+ *
+ * Characters are written into a window of memory, overflow() is only called
+ * when the window is full. The derived classes decide what happens then.
+ * One byte after the window is always kept free for the NUL terminator.
+ */
+class JsonOutput {
+  protected:
+    char  *m_pBuffer; // Start of the window
+    size_t m_size;    // Size of the window (excluding the NUL terminator)
+    size_t m_used;    // Number of bytes in the window
+
+    /** Make room for more data when the window is full
+     *
+     * @return true if there is now space in the window, false if the output
+     *         is full.
+     */
+    virtual bool overflow();
+
+  public:
+    /** Default constructor
+     */
+    JsonOutput();
+
+    /** Destructor
+     */
+    virtual ~JsonOutput() { }
+
+    /** Discard any existing output
+     */
+    virtual void reset();
+
+    /** Add a single character
+     *
+     * @return true if the character was added, false if the output is full.
+     */
+    inline bool write(char ch) {
+      if((m_used>=m_size)&&!overflow())
+        return false;
+      m_pBuffer[m_used++] = ch;
+      return true;
+      }
+
+    /** Add a block of characters
+     *
+     * @return true if the data was added, false if the output is full.
+     */
+    bool write(const char *pData, size_t length);
+
+    /** Add a NUL terminated string
+     *
+     * @return true if the string was added, false if the output is full.
+     */
+    bool write(const char *cszString);
+
+    /** Get the number of characters written so far
+     */
+    virtual size_t length() const;
+
+    /** Discard output written after a previous position
+     *
+     * @param length the value of length() to return to.
+     *
+     * @return true on success, false if the data is no longer available.
+     */
+    virtual bool rewind(size_t length);
+
+    /** Send any buffered output to its destination
+     *
+     * Called by the builder when the document is complete.
+     *
+     * @return true on success, false if the output could not be sent.
+     */
+    virtual bool flush();
+
+    /** Get the output as a NUL terminated string
+     */
+    virtual const char *result();
+  };
+
+/** Output to a fixed buffer supplied by the caller
+ */
+class JsonFixedOutput : public JsonOutput {
+  public:
+    /** Constructor
+     *
+     * @param buffer the buffer to write to.
+     * @param size the size of the buffer (including the NUL terminator).
+     */
+    JsonFixedOutput(char *buffer, size_t size);
+  };
+
+/** Output to a fixed buffer that is part of the object
+ */
+template<size_t SIZE> class JsonStaticOutput : public JsonFixedOutput {
+  private:
+    char m_data[SIZE];
+
+  public:
+    JsonStaticOutput() : JsonFixedOutput(m_data, SIZE) { }
+  };
+
+/** Output to a block reserved once when the object is created
+ *
+ * The block is reused for every document built (call reset() or start a new
+ * builder) so there is no heap activity after construction.
+ */
+class JsonArenaOutput : public JsonOutput {
+  public:
+    /** Constructor
+     *
+     * @param size the size of the block to reserve (including the NUL
+     *             terminator).
+     */
+    JsonArenaOutput(size_t size);
+
+    /** Destructor
+     */
+    virtual ~JsonArenaOutput();
+  };
+
+/** Output to a heap buffer that doubles in size as needed
+ */
+class JsonGrowableOutput : public JsonOutput {
+  private:
+    size_t m_initial; // Size of the first allocation
+    size_t m_limit;   // Maximum size (0 for no limit)
+
+  protected:
+    /** Double the size of the buffer
+     */
+    virtual bool overflow();
+
+  public:
+    /** Constructor
+     *
+     * @param initial the size of the first allocation.
+     * @param limit the maximum size of the buffer or 0 for no limit.
+     */
+    JsonGrowableOutput(size_t initial = 64, size_t limit = 0);
+
+    /** Destructor
+     */
+    virtual ~JsonGrowableOutput();
+  };
+
+/** Output that sends the document in pieces as it is built
+ *
+ * The document is built in a small window which is sent whenever it fills
+ * up. Values can only be rewound within the window, if a send fails all
+ * further output fails.
+ *
+ * Derived classes implement send() to deliver the data.
+ */
+class JsonStreamOutput : public JsonOutput {
+  private:
+    size_t m_sent;    // Number of characters sent so far
+    bool   m_chunked; // Use HTTP chunked transfer encoding
+    bool   m_failed;  // A send has failed
+
+    /** Send a block of data (as a single chunk if required)
+     */
+    bool sendChunk(const char *pData, size_t length);
+
+  protected:
+    /** Send the window
+     */
+    virtual bool overflow();
+
+    /** Deliver data to the destination
+     *
+     * @return true if all of the data was sent.
+     */
+    virtual bool send(const char *pData, size_t length) = 0;
+
+  public:
+    /** Constructor
+     *
+     * @param buffer the buffer to use for the window.
+     * @param size the size of the buffer.
+     * @param chunked true to frame the data with HTTP chunked transfer
+     *                encoding.
+     */
+    JsonStreamOutput(char *buffer, size_t size, bool chunked = false);
+
+    /** Discard any existing output and clear errors
+     */
+    virtual void reset();
+
+    /** Get the number of characters written so far
+     */
+    virtual size_t length() const;
+
+    /** Discard output written after a previous position
+     */
+    virtual bool rewind(size_t length);
+
+    /** Send the remaining output (and the final chunk)
+     */
+    virtual bool flush();
+
+    /** The output is not available as a string
+     *
+     * @return an empty string.
+     */
+    virtual const char *result();
+  };
+
+#ifdef ARDUINO
+/** Stream output to a Print implementation (a WiFiClient for example)
+ */
+class JsonPrintOutput : public JsonStreamOutput {
+  private:
+    Print &m_print;
+
+  protected:
+    virtual bool send(const char *pData, size_t length);
+
+  public:
+    /** Constructor
+     *
+     * @param print the destination for the output.
+     * @param buffer the buffer to use for the window.
+     * @param size the size of the buffer.
+     * @param chunked true to use HTTP chunked transfer encoding.
+     */
+    JsonPrintOutput(Print &print, char *buffer, size_t size, bool chunked = false);
+  };
+#else
+/** Stream output to a file descriptor (host builds only)
+ */
+class JsonFileOutput : public JsonStreamOutput {
+  private:
+    int m_fd;
+
+  protected:
+    virtual bool send(const char *pData, size_t length);
+
+  public:
+    /** Constructor
+     *
+     * @param fd the file descriptor to write to.
+     * @param buffer the buffer to use for the window.
+     * @param size the size of the buffer.
+     * @param chunked true to use HTTP chunked transfer encoding.
+     */
+    JsonFileOutput(int fd, char *buffer, size_t size, bool chunked = false);
+  };
+#endif
 
 /** Helper class to build a JSON string in memory
  */
 class JsonBuilder {
   private:
-    String           m_buffer;
-    JsonBuilderState m_state[MAX_DEPTH];
+    JsonGrowableOutput m_default; // Output used if none is supplied
+    JsonOutput      *m_pOutput;
+    JsonLevelBits    m_arrays;  // Levels that are arrays rather than objects
+    JsonLevelBits    m_started; // Levels that have at least one value
     int              m_depth;
 
+    // Builders may refer to their own output so cannot be copied
+    JsonBuilder(const JsonBuilder &);
+    JsonBuilder &operator=(const JsonBuilder &);
+
   protected:
     /** Add a string to the buffer
+     *
+     * @return true if the string was added, false if the buffer is full.
      */
-    void addString(const char *cszString);
+    bool addString(const char *cszString);
+
+    /** Add a field name (and the separator following it) to the buffer
+     *
+     * @return true if the name was added, false if the buffer is full.
+     */
+    bool addName(const char *cszName);
+
+    /** Add the separator needed before a value at the current level
+     *
+     * @return true if the separator was added (or is not needed), false if
+     *         the buffer is full.
+     */
+    bool addSeparator();
+
+    /** Start a new nested object or array
+     */
+    void push(bool array);
+
+    /** Determine if values are currently being added to an object
+     */
+    inline bool inObject() const {
+      return (m_depth>=0)&&!m_arrays.get(m_depth);
+      }
+
+    /** Determine if values are currently being added to an array
+     */
+    inline bool inArray() const {
+      return (m_depth>=0)&&m_arrays.get(m_depth);
+      }
+
+    /** Finish adding a value
+     *
+     * If the value did not fit the output is returned to the state it was in
+     * before the value was started, otherwise the current level is marked as
+     * having a value.
+     *
+     * @param mark the length of the output before the value was started.
+     * @param success true if all of the value was written.
+     *
+     * @return the value of success.
+     */
+    bool completed(size_t mark, bool success);
 
   public:
     /** Default constructor
+     *
+     * The result is built in a heap buffer that grows as needed.
      */
     JsonBuilder();
 
+    /** Build the result using the given output
+     *
+     * @param output the output to use, any existing content is discarded.
+     */
+    JsonBuilder(JsonOutput &output);
+
     /** Add a string value to the current object
      *
      * @param cszName the name of the new value
@@ -169,6 +894,18 @@ class JsonBuilder {
      */
     bool add(const char *cszName, double value);
 
+    /** Add the members of a struct to the current object
+     *
+     * Every member in the schema is added as a field except those marked
+     * with JsonFieldWriteOnly.
+     *
+     * @param pSchema the schema describing the struct (see BEGIN_JSON_SCHEMA).
+     * @param pStruct the struct containing the values.
+     *
+     * @return true if the values were added, false if the buffer is full.
+     */
+    bool add(const JsonField *pSchema, const void *pStruct);
+
     /** Add a new child object to the current object
      *
      * Adds a new field to the current object that will contain a child
@@ -261,8 +998,8 @@ class JsonBuilder {
 
     /** Finish building.
      *
-     * This closes all current open objects and arrays and terminates the
-     * string in the output buffer.
+     * This closes all current open objects and arrays, terminates the
+     * string in the output buffer and flushes streamed output.
      *
      * @return the number of characters (excluding the NUL terminator) in the
      *         buffer or 0 if the buffer is full.
@@ -271,8 +1008,8 @@ class JsonBuilder {
 
     /** Get the resulting string
      */
-    inline String& getResult() {
-      return m_buffer;
+    inline const char *getResult() {
+      return m_pOutput->result();
       }
   };
 
@@ -8,8 +8,13 @@
 #include "Arduino.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include "Json.h"
 
+#if defined(JSON_PRESCAN) && defined(__SSE2__)
+#  include <immintrin.h>
+#endif
+
 #define BEGIN_OBJECT '{'
 #define END_OBJECT '}'
 #define BEGIN_ARRAY '['
@@ -17,63 +22,254 @@
 #define SEPARATOR ','
 #define QUOTE '"'
 #define END_NAME ':'
+#define ESCAPE '\\'
 
 //---------------------------------------------------------------------------
 // Helpers
 //---------------------------------------------------------------------------
 
 /** Add an integer value to the output
+ */
+static bool writeInteger(JsonOutput *pOutput, int value) {
+  char buffer[JSON_INTEGER_SIZE];
+  return pOutput->write(buffer, JsonFormat::integer(buffer, value));
+  }
+
+/** Add a floating point value to the output
+ */
+static bool writeDouble(JsonOutput *pOutput, double value) {
+  char buffer[JSON_NUMBER_SIZE];
+  return pOutput->write(buffer, JsonFormat::number(buffer, value));
+  }
+
+// The string scans read past the NUL terminator (but never past the end of
+// the aligned block holding it) so must not be checked by AddressSanitizer
+#if defined(__SANITIZE_ADDRESS__)
+#  define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#  endif
+#endif
+#ifndef NO_SANITIZE_ADDRESS
+#  define NO_SANITIZE_ADDRESS
+#endif
+
+/** Determine if a character can be written in a string without escaping
  *
- * use itoa()
+ * The NUL terminator is also reported as unsafe so scans stop there.
+ */
+static inline bool isSafe(char ch) {
+  return ((uint8_t)ch>=0x20)&&(ch!=QUOTE)&&(ch!=ESCAPE);
+  }
+
+#if defined(JSON_PRESCAN) && defined(__SSE2__)
+
+/** Get a mask of the characters in a block that need escaping
+ */
+static inline unsigned int unsafeMask(__m128i block) {
+  __m128i control = _mm_cmpeq_epi8(_mm_min_epu8(block, _mm_set1_epi8(0x1F)), block);
+  __m128i special = _mm_or_si128(
+    _mm_cmpeq_epi8(block, _mm_set1_epi8(QUOTE)),
+    _mm_cmpeq_epi8(block, _mm_set1_epi8(ESCAPE)));
+  return (unsigned int)_mm_movemask_epi8(_mm_or_si128(control, special));
+  }
+
+/** Count the characters at the start of a string that need no escaping
  *
+ * Scans 16 bytes at a time. Aligned loads never cross a page boundary so
+ * reading past the NUL terminator is safe.
  */
-static const char *getInteger(int value) {
-  static char intBuff[12];
-  int count = snprintf(intBuff, sizeof(intBuff), "%d", value);
-  if((count<0)||(count>=sizeof(intBuff)))
-    return "0"; // Should be something better
-  return intBuff;
+NO_SANITIZE_ADDRESS static size_t safeLength(const char *cszString) {
+  uintptr_t offset = (uintptr_t)cszString & 15;
+  const char *pBlock = cszString - offset;
+  unsigned int mask = unsafeMask(_mm_load_si128((const __m128i *)pBlock)) >> offset;
+  if(mask!=0)
+    return __builtin_ctz(mask);
+  for(pBlock += 16; ; pBlock += 16) {
+    mask = unsafeMask(_mm_load_si128((const __m128i *)pBlock));
+    if(mask!=0)
+      return (pBlock - cszString) + __builtin_ctz(mask);
+    }
   }
 
-/** Add a floating point value to the output
+#else
+
+// Constants for testing every byte in a word at once
+#define WORD_ONES  ((size_t)-1 / 0xFF)
+#define WORD_HIGHS (WORD_ONES * 0x80)
+
+/** Determine if any byte in a word needs escaping
  *
- * Use dtostrf()
+ * Bytes below 0x20 have their top bit set by the subtraction, quotes and
+ * backslashes are turned into zero bytes first.
+ */
+static inline bool hasUnsafe(size_t word) {
+  size_t quotes = word ^ (WORD_ONES * QUOTE);
+  size_t escapes = word ^ (WORD_ONES * ESCAPE);
+  return (((word - WORD_ONES * 0x20) & ~word) |
+    ((quotes - WORD_ONES) & ~quotes) |
+    ((escapes - WORD_ONES) & ~escapes)) & WORD_HIGHS;
+  }
+
+/** Count the characters at the start of a string that need no escaping
  *
- * http://www.nongnu.org/avr-libc/user-manual/group__avr__stdlib.html#ga6c140bdd3b9bd740a1490137317caa44
+ * Scans a word at a time. Aligned loads never cross a page boundary so
+ * reading past the NUL terminator is safe.
  */
-static const char *getDouble(double value) {
-  static char floatBuff[12];
-  int count = snprintf(floatBuff, sizeof(floatBuff), "%g", value);
-  if((count<0)||(count>=sizeof(floatBuff)))
-    return "0"; // Should be something better
-  return floatBuff;
+NO_SANITIZE_ADDRESS static size_t safeLength(const char *cszString) {
+  const char *pScan = cszString;
+  // Step to a word boundary
+  while(((uintptr_t)pScan & (sizeof(size_t) - 1))!=0) {
+    if(!isSafe(*pScan))
+      return pScan - cszString;
+    pScan++;
+    }
+  // Skip whole words that need no escaping
+  for(; ; pScan += sizeof(size_t)) {
+    size_t word;
+    memcpy(&word, pScan, sizeof(word));
+    if(hasUnsafe(word))
+      break;
+    }
+  // Find the character in the last word
+  while(isSafe(*pScan))
+    pScan++;
+  return pScan - cszString;
   }
 
-/** Trim a separator character from the end of the string
+#endif
+
+/** Add the escape sequence for a character
  */
-static void trimSeparator(String &buffer) {
-  int last = buffer.length() - 1;
-  if((last>0)&&(buffer.charAt(last) == SEPARATOR))
-    buffer.remove(last);
+static bool writeEscape(JsonOutput *pOutput, char ch) {
+  char buffer[6] = { ESCAPE, ch };
+  switch(ch) {
+    case QUOTE:
+    case ESCAPE:
+      break;
+    case '\b':
+      buffer[1] = 'b';
+      break;
+    case '\f':
+      buffer[1] = 'f';
+      break;
+    case '\n':
+      buffer[1] = 'n';
+      break;
+    case '\r':
+      buffer[1] = 'r';
+      break;
+    case '\t':
+      buffer[1] = 't';
+      break;
+    default:
+      // Other control characters use the \u00XX form
+      buffer[1] = 'u';
+      buffer[2] = '0';
+      buffer[3] = '0';
+      buffer[4] = "0123456789abcdef"[(ch >> 4) & 0x0F];
+      buffer[5] = "0123456789abcdef"[ch & 0x0F];
+      return pOutput->write(buffer, 6);
+    }
+  return pOutput->write(buffer, 2);
   }
 
 //---------------------------------------------------------------------------
 // Implementation of JsonBuilder
 //---------------------------------------------------------------------------
 
-void JsonBuilder::addString(const char *cszString) {
-  m_buffer += '"';
-  m_buffer += cszString;
-  m_buffer += '"';
+/** Add a string to the buffer
+ *
+ * Quotes, backslashes and control characters are escaped. Runs of other
+ * characters are copied in a single write.
+ *
+ * @return true if the string was added, false if the buffer is full.
+ */
+bool JsonBuilder::addString(const char *cszString) {
+  if(!m_pOutput->write(QUOTE))
+    return false;
+  for(;;) {
+    size_t length = safeLength(cszString);
+    if((length>0)&&!m_pOutput->write(cszString, length))
+      return false;
+    cszString += length;
+    if(*cszString=='\0')
+      break;
+    if(!writeEscape(m_pOutput, *cszString))
+      return false;
+    cszString++;
+    }
+  return m_pOutput->write(QUOTE);
+  }
+
+/** Add a field name (and the separator following it) to the buffer
+ *
+ * @return true if the name was added, false if the buffer is full.
+ */
+bool JsonBuilder::addName(const char *cszName) {
+  return addString(cszName) && m_pOutput->write(END_NAME);
+  }
+
+/** Add the separator needed before a value at the current level
+ *
+ * The first value in an object or array does not need one.
+ *
+ * @return true if the separator was added (or is not needed), false if the
+ *         buffer is full.
+ */
+bool JsonBuilder::addSeparator() {
+  return !m_started.get(m_depth) || m_pOutput->write(SEPARATOR);
+  }
+
+/** Start a new nested object or array
+ *
+ * @param array true for an array, false for an object.
+ */
+void JsonBuilder::push(bool array) {
+  m_depth++;
+  m_arrays.set(m_depth, array);
+  m_started.set(m_depth, false);
+  }
+
+/** Finish adding a value
+ *
+ * If the value did not fit the output is returned to the state it was in
+ * before the value was started, otherwise the current level is marked as
+ * having a value.
+ *
+ * @param mark the length of the output before the value was started.
+ * @param success true if all of the value was written.
+ *
+ * @return the value of success.
+ */
+bool JsonBuilder::completed(size_t mark, bool success) {
+  if(success)
+    m_started.set(m_depth, true);
+  else
+    m_pOutput->rewind(mark);
+  return success;
   }
 
 /** Default constructor
  */
 JsonBuilder::JsonBuilder() {
-  m_state[0] = BuildBase;
+  m_pOutput = &m_default;
+  m_depth = 0;
+  // Add the opening brace
+  m_pOutput->write(BEGIN_OBJECT);
+  }
+
+/** Build the result using the given output
+ *
+ * @param output the output to use, any existing content is discarded.
+ */
+JsonBuilder::JsonBuilder(JsonOutput &output) {
+  m_pOutput = &output;
+  m_pOutput->reset();
   m_depth = 0;
   // Add the opening brace
-  m_buffer += BEGIN_OBJECT;
+  m_pOutput->write(BEGIN_OBJECT);
   }
 
 /** Add a string value to the current object
@@ -82,13 +278,10 @@ JsonBuilder::JsonBuilder() {
  * @param cszValue the value to associated with the name.
  */
 bool JsonBuilder::add(const char *cszName, const char *cszValue) {
-  if((m_depth<0)||(m_state[m_depth]==BuildArray))
+  if(!inObject())
     return false; // Invalid state
-  addString(cszName);
-  m_buffer += END_NAME;
-  addString(cszValue);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && addName(cszName) && addString(cszValue));
   }
 
 /** Add a boolean value to the current object
@@ -99,13 +292,10 @@ bool JsonBuilder::add(const char *cszName, const char *cszValue) {
  * @return true if the value was added, false if the buffer is full.
  */
 bool JsonBuilder::add(const char *cszName, bool value) {
-  if((m_depth<0)||(m_state[m_depth]==BuildArray))
+  if(!inObject())
     return false; // Invalid state
-  addString(cszName);
-  m_buffer += END_NAME;
-  m_buffer += (value ? "true" : "false");
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && addName(cszName) && m_pOutput->write(value ? "true" : "false"));
   }
 
 /** Add a integer value to the current object
@@ -116,13 +306,10 @@ bool JsonBuilder::add(const char *cszName, bool value) {
  * @return true if the value was added, false if the buffer is full.
  */
 bool JsonBuilder::add(const char *cszName, int value) {
-  if((m_depth<0)||(m_state[m_depth]==BuildArray))
+  if(!inObject())
     return false; // Invalid state
-  addString(cszName);
-  m_buffer += END_NAME;
-  m_buffer += getInteger(value);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && addName(cszName) && writeInteger(m_pOutput, value));
   }
 
 /** Add a floating point value to the current object
@@ -133,13 +320,33 @@ bool JsonBuilder::add(const char *cszName, int value) {
  * @return true if the value was added, false if the buffer is full.
  */
 bool JsonBuilder::add(const char *cszName, double value) {
-  if((m_depth<0)||(m_state[m_depth]==BuildArray))
+  if(!inObject())
     return false; // Invalid state
-  addString(cszName);
-  m_buffer += END_NAME;
-  m_buffer += getDouble(value);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && addName(cszName) && writeDouble(m_pOutput, value));
+  }
+
+/** Add the members of a struct to the current object
+ *
+ * Every member in the schema is added as a field except those marked with
+ * JsonFieldWriteOnly.
+ *
+ * @param pSchema the schema describing the struct.
+ * @param pStruct the struct containing the values.
+ *
+ * @return true if the values were added, false if the buffer is full.
+ */
+bool JsonBuilder::add(const JsonField *pSchema, const void *pStruct) {
+  if(!inObject()||(pSchema==NULL))
+    return false; // Invalid state
+  // Each field records its own separator so remember where we started
+  size_t mark = m_pOutput->length();
+  bool started = m_started.get(m_depth);
+  if(JsonAddFields(*this, pSchema, pStruct))
+    return true;
+  m_pOutput->rewind(mark);
+  m_started.set(m_depth, started);
+  return false;
   }
 
 /** Add a new child object to the current object
@@ -154,15 +361,14 @@ bool JsonBuilder::add(const char *cszName, double value) {
  *         is not available in the current state.
  */
 bool JsonBuilder::beginObject(const char *cszName) {
-  if((m_depth<0)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]==BuildArray))
+  if(!inObject()||((m_depth + 1)>=JSON_MAX_DEPTH))
     return false; // Invalid state
-  // Start the new object
-  m_depth++;
-  m_state[m_depth] = BuildObject;
   // Add the name and opening brace
-  addString(cszName);
-  m_buffer += END_NAME;
-  m_buffer += BEGIN_OBJECT;
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addSeparator() && addName(cszName) && m_pOutput->write(BEGIN_OBJECT)))
+    return false;
+  // Start the new object
+  push(false);
   return true;
   }
 
@@ -176,13 +382,14 @@ bool JsonBuilder::beginObject(const char *cszName) {
  *         is not available in the current state.
  */
 bool JsonBuilder::beginObject() {
-  if((m_depth<0)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]!=BuildArray))
+  if(!inArray()||((m_depth + 1)>=JSON_MAX_DEPTH))
     return false; // Invalid state
-  // Start the new object
-  m_depth++;
-  m_state[m_depth] = BuildObject;
   // Add the opening brace
-  m_buffer += BEGIN_OBJECT;
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addSeparator() && m_pOutput->write(BEGIN_OBJECT)))
+    return false;
+  // Start the new object
+  push(false);
   return true;
   }
 
@@ -192,15 +399,13 @@ bool JsonBuilder::beginObject() {
  *         is not available in the current state.
  */
 bool JsonBuilder::endObject() {
-  if((m_depth<1)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]!=BuildObject))
+  if((m_depth<1)||m_arrays.get(m_depth))
+    return false;
+  // Add the closing brace
+  if(!m_pOutput->write(END_OBJECT))
     return false;
   // Move back to the previous state
   m_depth--;
-  // Remove trailing comma if present
-  trimSeparator(m_buffer);
-  // Add the closing brace and comma
-  m_buffer += END_OBJECT;
-  m_buffer += SEPARATOR;
   return true;
   }
 
@@ -212,15 +417,14 @@ bool JsonBuilder::endObject() {
  *         is not available in the current state.
  */
 bool JsonBuilder::beginArray(const char *cszName) {
-  if((m_depth<0)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]==BuildArray))
+  if(!inObject()||((m_depth + 1)>=JSON_MAX_DEPTH))
     return false; // Invalid state
-  // Start the new array
-  m_depth++;
-  m_state[m_depth] = BuildArray;
   // Add the name and opening bracket
-  addString(cszName);
-  m_buffer += END_NAME;
-  m_buffer += BEGIN_ARRAY;
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addSeparator() && addName(cszName) && m_pOutput->write(BEGIN_ARRAY)))
+    return false;
+  // Start the new array
+  push(true);
   return true;
   }
 
@@ -230,13 +434,14 @@ bool JsonBuilder::beginArray(const char *cszName) {
  *         is not available in the current state.
  */
 bool JsonBuilder::beginArray() {
-  if((m_depth<0)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]!=BuildArray))
+  if(!inArray()||((m_depth + 1)>=JSON_MAX_DEPTH))
     return false; // Invalid state
-  // Start the new object
-  m_depth++;
-  m_state[m_depth] = BuildArray;
   // Add the opening bracket
-  m_buffer += BEGIN_ARRAY;
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addSeparator() && m_pOutput->write(BEGIN_ARRAY)))
+    return false;
+  // Start the new array
+  push(true);
   return true;
   }
 
@@ -246,15 +451,13 @@ bool JsonBuilder::beginArray() {
  *         is not available in the current state.
  */
 bool JsonBuilder::endArray() {
-  if((m_depth<1)||(m_depth>=MAX_DEPTH)||(m_state[m_depth]!=BuildArray))
+  if((m_depth<1)||!m_arrays.get(m_depth))
+    return false;
+  // Add the closing bracket
+  if(!m_pOutput->write(END_ARRAY))
     return false;
   // Move back to the previous state
   m_depth--;
-  // Remove trailing comma if present
-  trimSeparator(m_buffer);
-  // Add the closing bracket and comma
-  m_buffer += END_ARRAY;
-  m_buffer += SEPARATOR;
   return true;
   }
 
@@ -266,11 +469,10 @@ bool JsonBuilder::endArray() {
  *         not currently building an array.
  */
 bool JsonBuilder::add(const char *cszValue) {
-  if((m_depth<0)||(m_state[m_depth]!=BuildArray))
+  if(!inArray())
     return false; // Invalid state
-  addString(cszValue);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && addString(cszValue));
   }
 
 /** Add a new boolean value to the current array
@@ -281,11 +483,10 @@ bool JsonBuilder::add(const char *cszValue) {
  *         not currently building an array.
  */
 bool JsonBuilder::add(bool value) {
-  if((m_depth<0)||(m_state[m_depth]!=BuildArray))
+  if(!inArray())
     return false; // Invalid state
-  m_buffer += (value ? "true" : "false");
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && m_pOutput->write(value ? "true" : "false"));
   }
 
 /** Add a new integer value to the current array
@@ -296,11 +497,10 @@ bool JsonBuilder::add(bool value) {
  *         not currently building an array.
  */
 bool JsonBuilder::add(int value) {
-  if((m_depth<0)||(m_state[m_depth]!=BuildArray))
+  if(!inArray())
     return false; // Invalid state
-  m_buffer += getInteger(value);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && writeInteger(m_pOutput, value));
   }
 
 /** Add a new floating point value to the current array
@@ -311,17 +511,17 @@ bool JsonBuilder::add(int value) {
  *         not currently building an array.
  */
 bool JsonBuilder::add(double value) {
-  if((m_depth<0)||(m_state[m_depth]!=BuildArray))
+  if(!inArray())
     return false; // Invalid state
-  m_buffer += getDouble(value);
-  m_buffer += SEPARATOR;
-  return true;
+  size_t mark = m_pOutput->length();
+  return completed(mark, addSeparator() && writeDouble(m_pOutput, value));
   }
 
 /** Finish building.
  *
- * This closes all current open objects and arrays and terminates the
- * string in the output buffer.
+ * This closes all current open objects and arrays, terminates the string
+ * in the output buffer and flushes streamed output. No more values can be
+ * added afterwards.
  *
  * @return the number of characters (excluding the NUL terminator) in the
  *         buffer or 0 if the buffer is full.
@@ -330,24 +530,12 @@ int JsonBuilder::end() {
   // Make sure we have been initialised
   if (m_depth < 0)
     return -1;
-  // Close out any pending blocks
-  while(m_depth) {
-    // Remove trailing comma if present
-    trimSeparator(m_buffer);
-    // Handle each object type
-    switch(m_state[m_depth]) {
-      case BuildObject:
-        m_buffer += END_OBJECT;
-        break;
-      case BuildArray:
-        m_buffer += END_ARRAY;
-        break;
-      }
-    m_depth--;
+  // Close out any pending blocks and the top level object
+  for(; m_depth >= 0; m_depth--) {
+    if(!m_pOutput->write(m_arrays.get(m_depth) ? END_ARRAY : END_OBJECT))
+      return 0;
     }
-  // Remove trailing comma if present
-  trimSeparator(m_buffer);
-  // Add the terminating brace
-  m_buffer += END_OBJECT;
-  return m_buffer.length();
+  if(!m_pOutput->flush())
+    return 0;
+  return m_pOutput->length();
   }
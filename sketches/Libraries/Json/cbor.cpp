@@ -0,0 +1,623 @@
+/*--------------------------------------------------------------------------*
+* Implementation of the CBOR builder and parser
+*---------------------------------------------------------------------------*
+* Only the subset of CBOR needed to represent JSON documents is generated,
+* the parser accepts any well formed data apart from indefinite length
+* strings.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+#include "Cbor.h"
+
+// Major types (in the top three bits of the initial byte)
+#define CBOR_UNSIGNED 0x00
+#define CBOR_NEGATIVE 0x20
+#define CBOR_BYTES    0x40
+#define CBOR_TEXT     0x60
+#define CBOR_ARRAY    0x80
+#define CBOR_MAP      0xA0
+#define CBOR_TAG      0xC0
+#define CBOR_SIMPLE   0xE0
+
+// Masks for the initial byte
+#define CBOR_MAJOR_MASK 0xE0
+#define CBOR_INFO_MASK  0x1F
+
+// Additional information values
+#define CBOR_INDEFINITE 0x1F
+
+// Simple values and floating point types
+#define CBOR_FALSE     0xF4
+#define CBOR_TRUE      0xF5
+#define CBOR_NULL      0xF6
+#define CBOR_UNDEFINED 0xF7
+#define CBOR_FLOAT16   0xF9
+#define CBOR_FLOAT32   0xFA
+#define CBOR_FLOAT64   0xFB
+#define CBOR_BREAK     0xFF
+
+// Whole numbers below this magnitude are written as integers
+#define INT64_LIMIT 9223372036854775808.0
+
+// Marks an indefinite length container in the parser
+#define CBOR_NO_LIMIT ((uint64_t)-1)
+
+//---------------------------------------------------------------------------
+// Helpers
+//---------------------------------------------------------------------------
+
+/** Read the argument following an initial byte
+ *
+ * @param pData pointer to the initial byte.
+ * @param available the number of bytes available.
+ * @param value receives the argument (0 for indefinite lengths).
+ *
+ * @return the number of bytes in the header, 0 if more data is needed or -1
+ *         if the header is invalid.
+ */
+static int readArgument(const uint8_t *pData, size_t available, uint64_t &value) {
+  uint8_t info = pData[0] & CBOR_INFO_MASK;
+  value = 0;
+  if(info<24) {
+    value = info;
+    return 1;
+    }
+  if(info==CBOR_INDEFINITE)
+    return 1;
+  if(info>27)
+    return -1;
+  size_t bytes = 1 << (info - 24);
+  if(available<(bytes + 1))
+    return 0;
+  for(size_t i = 1; i <= bytes; i++)
+    value = (value << 8) | pData[i];
+  return bytes + 1;
+  }
+
+/** Convert a half precision value
+ */
+static double halfToDouble(uint16_t half) {
+  int exponent = (half >> 10) & 0x1F;
+  int mantissa = half & 0x3FF;
+  double value;
+  if(exponent==0)
+    value = ldexp(mantissa, -24);
+  else if(exponent!=31)
+    value = ldexp(mantissa + 1024, exponent - 25);
+  else
+    value = (mantissa==0) ? INFINITY : NAN;
+  return (half & 0x8000) ? -value : value;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of CborParser
+//---------------------------------------------------------------------------
+
+/** Initialise the parser with the token pool to use.
+ */
+CborParser::CborParser(JsonToken *pTokens, int tokens) : JsonParser(pTokens, tokens) {
+  }
+
+/** Parse CBOR from a buffer in memory
+ */
+int CborParser::parse(const char *pData, size_t length) {
+  // Token positions are stored as ints
+  if(length>INT_MAX)
+    return JsonErrorNoMemory;
+  begin();
+  m_cszSource = pData;
+  m_length = length;
+  return Scan();
+  }
+
+/** Parse CBOR from a buffer in memory
+ */
+int CborParser::parse(const uint8_t *pData, size_t length) {
+  return parse((const char *)pData, length);
+  }
+
+/** Parse with the data available so far
+ */
+int CborParser::resume(const char *pData, size_t length) {
+  return parse(pData, length);
+  }
+
+/** Tokenise the data set up by parse()
+ *
+ * @return the number of tokens discovered or a negative value if an error
+ *         occurs.
+ */
+int CborParser::Scan() {
+  const uint8_t *pData = (const uint8_t *)m_cszSource;
+  // Open maps and arrays
+  int      open[CBOR_MAX_DEPTH];      // Token for the container
+  uint64_t remaining[CBOR_MAX_DEPTH]; // Items left (CBOR_NO_LIMIT if indefinite)
+  bool     isMap[CBOR_MAX_DEPTH];     // Container is a map
+  bool     isKey[CBOR_MAX_DEPTH];     // Next item in the map is a key
+  int      depth = 0;
+  for(;;) {
+    // Close any fixed length containers that are complete
+    while((depth>0)&&(remaining[depth - 1]==0)) {
+      JsonToken *pToken = &m_pTokens[open[--depth]];
+      pToken->end = m_pos;
+      pToken->next = m_toknext;
+      }
+    if(m_pos>=m_length)
+      break;
+    uint8_t initial = pData[m_pos];
+    uint8_t major = initial & CBOR_MAJOR_MASK;
+    // End of an indefinite length container
+    if(initial==CBOR_BREAK) {
+      if((depth==0)||(remaining[depth - 1]!=CBOR_NO_LIMIT)||(isMap[depth - 1]&&!isKey[depth - 1]))
+        return JsonErrorInvalidChar;
+      JsonToken *pToken = &m_pTokens[open[--depth]];
+      pToken->end = ++m_pos;
+      pToken->next = m_toknext;
+      continue;
+      }
+    uint64_t argument;
+    int header = readArgument(&pData[m_pos], m_length - m_pos, argument);
+    if(header==0)
+      return JsonErrorPartial;
+    if(header<0)
+      return JsonErrorInvalidChar;
+    bool indefinite = ((initial & CBOR_INFO_MASK)==CBOR_INDEFINITE);
+    // Tags apply to the following item
+    if(major==CBOR_TAG) {
+      if(indefinite)
+        return JsonErrorInvalidChar;
+      m_pos += header;
+      continue;
+      }
+    // Keys must be text strings
+    bool key = (depth>0)&&isMap[depth - 1]&&isKey[depth - 1];
+    if(key&&(major!=CBOR_TEXT))
+      return JsonErrorInvalidChar;
+    m_toksuper = (depth>0) ? open[depth - 1] : -1;
+    JsonToken *pToken = AllocToken();
+    if(pToken==NULL)
+      return JsonErrorNoMemory;
+    switch(major) {
+      case CBOR_UNSIGNED:
+      case CBOR_NEGATIVE:
+        if(indefinite)
+          return JsonErrorInvalidChar;
+        pToken->type = JsonPrimitive;
+        pToken->start = m_pos;
+        m_pos += header;
+        pToken->end = m_pos;
+        break;
+      case CBOR_BYTES:
+      case CBOR_TEXT:
+        if(indefinite)
+          return JsonErrorInvalidChar;
+        if(argument>(m_length - m_pos - header))
+          return JsonErrorPartial;
+        pToken->type = JsonString;
+        pToken->start = m_pos + header;
+        m_pos += header + (unsigned int)argument;
+        pToken->end = m_pos;
+        break;
+      case CBOR_ARRAY:
+      case CBOR_MAP:
+        if(depth>=CBOR_MAX_DEPTH)
+          return JsonErrorNoMemory;
+        pToken->type = (major==CBOR_MAP) ? JsonObject : JsonArray;
+        pToken->start = m_pos;
+        pToken->next = -1; // Filled in when it is closed
+        m_pos += header;
+        break;
+      default: // CBOR_SIMPLE
+        if(indefinite)
+          return JsonErrorInvalidChar;
+        pToken->type = JsonPrimitive;
+        pToken->start = m_pos;
+        m_pos += header;
+        pToken->end = m_pos;
+        break;
+      }
+    // Count the item in its container
+    if(depth>0) {
+      int parent = depth - 1;
+      if(!isMap[parent]||key)
+        m_pTokens[open[parent]].size++;
+      if(isMap[parent]) {
+        // Keys have their value as a child
+        if(key)
+          pToken->size = 1;
+        isKey[parent] = !key;
+        }
+      if(remaining[parent]!=CBOR_NO_LIMIT)
+        remaining[parent]--;
+      }
+    // Open a new container
+    if((major==CBOR_ARRAY)||(major==CBOR_MAP)) {
+      open[depth] = m_toknext - 1;
+      isMap[depth] = (major==CBOR_MAP);
+      isKey[depth] = true;
+      if(indefinite)
+        remaining[depth] = CBOR_NO_LIMIT;
+      else if(argument>m_length)
+        return JsonErrorPartial; // Every item needs at least one byte
+      else
+        remaining[depth] = isMap[depth] ? (argument * 2) : argument;
+      depth++;
+      }
+    }
+  if(depth>0)
+    return JsonErrorPartial;
+  return m_toknext;
+  }
+
+/** Get the value of an integer
+ *
+ * @return true on success, false if the token is not an integer or is out
+ *         of range.
+ */
+bool CborParser::getInt(int token, long &value) {
+  if((token<0)||(token>=(int)m_toknext)||(m_pTokens[token].type!=JsonPrimitive))
+    return false;
+  const uint8_t *pData = (const uint8_t *)&m_cszSource[m_pTokens[token].start];
+  uint8_t major = pData[0] & CBOR_MAJOR_MASK;
+  uint64_t argument;
+  if(((major!=CBOR_UNSIGNED)&&(major!=CBOR_NEGATIVE))||(readArgument(pData, m_pTokens[token].end - m_pTokens[token].start, argument)<=0))
+    return false;
+  if(argument>(uint64_t)LONG_MAX)
+    return false;
+  value = (major==CBOR_UNSIGNED) ? (long)argument : (-1 - (long)argument);
+  return true;
+  }
+
+/** Get the value of an integer or floating point number
+ *
+ * @return true on success, false if the token is not a number.
+ */
+bool CborParser::getDouble(int token, double &value) {
+  if((token<0)||(token>=(int)m_toknext)||(m_pTokens[token].type!=JsonPrimitive))
+    return false;
+  const uint8_t *pData = (const uint8_t *)&m_cszSource[m_pTokens[token].start];
+  uint8_t major = pData[0] & CBOR_MAJOR_MASK;
+  uint64_t argument;
+  if(readArgument(pData, m_pTokens[token].end - m_pTokens[token].start, argument)<=0)
+    return false;
+  if(major==CBOR_UNSIGNED)
+    value = (double)argument;
+  else if(major==CBOR_NEGATIVE)
+    value = -1.0 - (double)argument;
+  else if(pData[0]==CBOR_FLOAT16)
+    value = halfToDouble((uint16_t)argument);
+  else if(pData[0]==CBOR_FLOAT32) {
+    uint32_t bits = (uint32_t)argument;
+    float number;
+    memcpy(&number, &bits, sizeof(number));
+    value = number;
+    }
+  else if(pData[0]==CBOR_FLOAT64)
+    memcpy(&value, &argument, sizeof(value));
+  else
+    return false;
+  return true;
+  }
+
+/** Get the value of a boolean
+ *
+ * @return true on success, false if the token is not a boolean.
+ */
+bool CborParser::getBool(int token, bool &value) {
+  if((token<0)||(token>=(int)m_toknext)||(m_pTokens[token].type!=JsonPrimitive))
+    return false;
+  uint8_t initial = (uint8_t)m_cszSource[m_pTokens[token].start];
+  if((initial!=CBOR_TRUE)&&(initial!=CBOR_FALSE))
+    return false;
+  value = (initial==CBOR_TRUE);
+  return true;
+  }
+
+/** Determine if a token is null (or undefined)
+ */
+bool CborParser::isNull(int token) {
+  if((token<0)||(token>=(int)m_toknext)||(m_pTokens[token].type!=JsonPrimitive))
+    return false;
+  uint8_t initial = (uint8_t)m_cszSource[m_pTokens[token].start];
+  return (initial==CBOR_NULL)||(initial==CBOR_UNDEFINED);
+  }
+
+/** Copy the value of a string
+ *
+ * @return the length of the string (excluding the NUL terminator) or -1 if
+ *         the token is not a string or will not fit in the buffer.
+ */
+int CborParser::unescape(int token, char *buffer, int size) {
+  if((token<0)||(token>=(int)m_toknext)||(m_pTokens[token].type!=JsonString)||(buffer==NULL))
+    return -1;
+  int length = len(token);
+  if(length>=size)
+    return -1;
+  memcpy(buffer, str(token), length);
+  buffer[length] = '\0';
+  return length;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of CborBuilder
+//---------------------------------------------------------------------------
+
+/** Add the initial byte(s) of an item
+ *
+ * @param major the major type (in the top three bits).
+ * @param value the argument, encoded in the fewest bytes possible.
+ *
+ * @return true if the header was added, false if the output is full.
+ */
+bool CborBuilder::addHead(uint8_t major, uint64_t value) {
+  char header[9];
+  int bytes;
+  if(value<24) {
+    header[0] = (char)(major | value);
+    return m_pOutput->write(header[0]);
+    }
+  if(value<=0xFF) {
+    header[0] = (char)(major | 24);
+    bytes = 1;
+    }
+  else if(value<=0xFFFF) {
+    header[0] = (char)(major | 25);
+    bytes = 2;
+    }
+  else if(value<=0xFFFFFFFFULL) {
+    header[0] = (char)(major | 26);
+    bytes = 4;
+    }
+  else {
+    header[0] = (char)(major | 27);
+    bytes = 8;
+    }
+  // Big endian argument
+  for(int i = bytes; i > 0; i--, value >>= 8)
+    header[i] = (char)(value & 0xFF);
+  return m_pOutput->write(header, bytes + 1);
+  }
+
+/** Add a text string
+ */
+bool CborBuilder::addString(const char *cszString) {
+  size_t length = strlen(cszString);
+  return addHead(CBOR_TEXT, length) && m_pOutput->write(cszString, length);
+  }
+
+/** Add an integer
+ */
+bool CborBuilder::addInteger(int64_t value) {
+  if(value<0)
+    return addHead(CBOR_NEGATIVE, (uint64_t)(-1 - value));
+  return addHead(CBOR_UNSIGNED, (uint64_t)value);
+  }
+
+/** Add a floating point value
+ *
+ * Whole numbers are written as integers (as the JSON formatter does) and
+ * other values as single precision if that is exact.
+ */
+bool CborBuilder::addNumber(double value) {
+  if((value==floor(value))&&(value>-INT64_LIMIT)&&(value<INT64_LIMIT)&&!((value==0)&&signbit(value)))
+    return addInteger((int64_t)value);
+  char data[9];
+  uint64_t bits;
+  int bytes;
+  float single = (float)value;
+  if(((double)single==value)||(value!=value)) {
+    uint32_t bits32;
+    memcpy(&bits32, &single, sizeof(bits32));
+    bits = bits32;
+    data[0] = (char)CBOR_FLOAT32;
+    bytes = 4;
+    }
+  else {
+    memcpy(&bits, &value, sizeof(bits));
+    data[0] = (char)CBOR_FLOAT64;
+    bytes = 8;
+    }
+  // Big endian value
+  for(int i = bytes; i > 0; i--, bits >>= 8)
+    data[i] = (char)(bits & 0xFF);
+  return m_pOutput->write(data, bytes + 1);
+  }
+
+/** Finish adding a value, rewinding the output if it did not fit
+ *
+ * @return the value of success.
+ */
+bool CborBuilder::completed(size_t mark, bool success) {
+  if(!success)
+    m_pOutput->rewind(mark);
+  return success;
+  }
+
+/** Default constructor
+ */
+CborBuilder::CborBuilder() {
+  m_pOutput = &m_default;
+  m_depth = 0;
+  // The document is a map
+  m_pOutput->write((char)(CBOR_MAP | CBOR_INDEFINITE));
+  }
+
+/** Build the result using the given output
+ *
+ * @param output the output to use, any existing content is discarded.
+ */
+CborBuilder::CborBuilder(JsonOutput &output) {
+  m_pOutput = &output;
+  m_pOutput->reset();
+  m_depth = 0;
+  // The document is a map
+  m_pOutput->write((char)(CBOR_MAP | CBOR_INDEFINITE));
+  }
+
+/** Add a string value to the current object
+ */
+bool CborBuilder::add(const char *cszName, const char *cszValue) {
+  if(!inObject())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addString(cszName) && addString(cszValue));
+  }
+
+/** Add a boolean value to the current object
+ */
+bool CborBuilder::add(const char *cszName, bool value) {
+  if(!inObject())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addString(cszName) && m_pOutput->write((char)(value ? CBOR_TRUE : CBOR_FALSE)));
+  }
+
+/** Add a integer value to the current object
+ */
+bool CborBuilder::add(const char *cszName, int value) {
+  if(!inObject())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addString(cszName) && addInteger(value));
+  }
+
+/** Add a floating point value to the current object
+ */
+bool CborBuilder::add(const char *cszName, double value) {
+  if(!inObject())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addString(cszName) && addNumber(value));
+  }
+
+/** Add the members of a struct to the current object
+ */
+bool CborBuilder::add(const JsonField *pSchema, const void *pStruct) {
+  if(!inObject()||(pSchema==NULL))
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, JsonAddFields(*this, pSchema, pStruct));
+  }
+
+/** Add a new child object to the current object
+ */
+bool CborBuilder::beginObject(const char *cszName) {
+  if(!inObject()||((m_depth + 1)>=JSON_MAX_DEPTH))
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addString(cszName) && m_pOutput->write((char)(CBOR_MAP | CBOR_INDEFINITE))))
+    return false;
+  m_arrays.set(++m_depth, false);
+  return true;
+  }
+
+/** Add a new child object to the current array
+ */
+bool CborBuilder::beginObject() {
+  if(!inArray()||((m_depth + 1)>=JSON_MAX_DEPTH))
+    return false; // Invalid state
+  if(!m_pOutput->write((char)(CBOR_MAP | CBOR_INDEFINITE)))
+    return false;
+  m_arrays.set(++m_depth, false);
+  return true;
+  }
+
+/** End the current child object
+ */
+bool CborBuilder::endObject() {
+  if((m_depth<1)||m_arrays.get(m_depth))
+    return false;
+  if(!m_pOutput->write((char)CBOR_BREAK))
+    return false;
+  m_depth--;
+  return true;
+  }
+
+/** Add a new child array to the current object
+ */
+bool CborBuilder::beginArray(const char *cszName) {
+  if(!inObject()||((m_depth + 1)>=JSON_MAX_DEPTH))
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  if(!completed(mark, addString(cszName) && m_pOutput->write((char)(CBOR_ARRAY | CBOR_INDEFINITE))))
+    return false;
+  m_arrays.set(++m_depth, true);
+  return true;
+  }
+
+/** Add a new child array to the current array
+ */
+bool CborBuilder::beginArray() {
+  if(!inArray()||((m_depth + 1)>=JSON_MAX_DEPTH))
+    return false; // Invalid state
+  if(!m_pOutput->write((char)(CBOR_ARRAY | CBOR_INDEFINITE)))
+    return false;
+  m_arrays.set(++m_depth, true);
+  return true;
+  }
+
+/** End the current child array
+ */
+bool CborBuilder::endArray() {
+  if((m_depth<1)||!m_arrays.get(m_depth))
+    return false;
+  if(!m_pOutput->write((char)CBOR_BREAK))
+    return false;
+  m_depth--;
+  return true;
+  }
+
+/** Add a new string to the current array
+ */
+bool CborBuilder::add(const char *cszValue) {
+  if(!inArray())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addString(cszValue));
+  }
+
+/** Add a new boolean value to the current array
+ */
+bool CborBuilder::add(bool value) {
+  if(!inArray())
+    return false; // Invalid state
+  return m_pOutput->write((char)(value ? CBOR_TRUE : CBOR_FALSE));
+  }
+
+/** Add a new integer value to the current array
+ */
+bool CborBuilder::add(int value) {
+  if(!inArray())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addInteger(value));
+  }
+
+/** Add a new floating point value to the current array
+ */
+bool CborBuilder::add(double value) {
+  if(!inArray())
+    return false; // Invalid state
+  size_t mark = m_pOutput->length();
+  return completed(mark, addNumber(value));
+  }
+
+/** Finish building.
+ *
+ * @return the number of bytes in the document or 0 if the buffer is full.
+ */
+int CborBuilder::end() {
+  // Make sure we have been initialised
+  if(m_depth<0)
+    return -1;
+  // Close the document and any open maps or arrays
+  for(; m_depth >= 0; m_depth--) {
+    if(!m_pOutput->write((char)CBOR_BREAK))
+      return 0;
+    }
+  if(!m_pOutput->flush())
+    return 0;
+  return m_pOutput->length();
+  }
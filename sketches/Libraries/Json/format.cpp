@@ -0,0 +1,448 @@
+/*--------------------------------------------------------------------------*
+* Number formatting for the JSON builder
+*---------------------------------------------------------------------------*
+* Integers are converted two digits at a time from a table of digit pairs.
+* Floating point values use the Grisu2 algorithm (Florian Loitsch, "Printing
+* Floating-Point Numbers Quickly and Accurately with Integers") which gives
+* the shortest representation that converts back to the same value in all
+* but a tiny fraction of cases (where it is still exact, just one digit
+* longer than necessary).
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <string.h>
+#include "Json.h"
+
+// Allow flash resident tables to be used on platforms without PROGMEM
+#ifndef PROGMEM
+#  define PROGMEM
+#endif
+
+#ifndef pgm_read_byte
+#  define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#endif
+
+#ifndef pgm_read_word
+#  define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#endif
+
+#ifndef pgm_read_dword
+#  define pgm_read_dword(addr) (*(const uint32_t *)(addr))
+#endif
+
+//---------------------------------------------------------------------------
+// Tables
+//---------------------------------------------------------------------------
+
+/** Pairs of decimal digits for 00 to 99
+ */
+static const char DIGIT_PAIRS[200] PROGMEM = {
+  '0','0','0','1','0','2','0','3','0','4','0','5','0','6','0','7','0','8','0','9',
+  '1','0','1','1','1','2','1','3','1','4','1','5','1','6','1','7','1','8','1','9',
+  '2','0','2','1','2','2','2','3','2','4','2','5','2','6','2','7','2','8','2','9',
+  '3','0','3','1','3','2','3','3','3','4','3','5','3','6','3','7','3','8','3','9',
+  '4','0','4','1','4','2','4','3','4','4','4','5','4','6','4','7','4','8','4','9',
+  '5','0','5','1','5','2','5','3','5','4','5','5','5','6','5','7','5','8','5','9',
+  '6','0','6','1','6','2','6','3','6','4','6','5','6','6','6','7','6','8','6','9',
+  '7','0','7','1','7','2','7','3','7','4','7','5','7','6','7','7','7','8','7','9',
+  '8','0','8','1','8','2','8','3','8','4','8','5','8','6','8','7','8','8','8','9',
+  '9','0','9','1','9','2','9','3','9','4','9','5','9','6','9','7','9','8','9','9'
+  };
+
+/** Normalised significands of 10^k for k = -348, -340, ..., 340
+ *
+ * Each value is stored as the upper and lower 32 bits.
+ */
+static const uint32_t CACHED_POWERS[] PROGMEM = {
+  0xfa8fd5a0, 0x081c0288, 0xbaaee17f, 0xa23ebf76,
+  0x8b16fb20, 0x3055ac76, 0xcf42894a, 0x5dce35ea,
+  0x9a6bb0aa, 0x55653b2d, 0xe61acf03, 0x3d1a45df,
+  0xab70fe17, 0xc79ac6ca, 0xff77b1fc, 0xbebcdc4f,
+  0xbe5691ef, 0x416bd60c, 0x8dd01fad, 0x907ffc3c,
+  0xd3515c28, 0x31559a83, 0x9d71ac8f, 0xada6c9b5,
+  0xea9c2277, 0x23ee8bcb, 0xaecc4991, 0x4078536d,
+  0x823c1279, 0x5db6ce57, 0xc2109436, 0x4dfb5637,
+  0x9096ea6f, 0x3848984f, 0xd77485cb, 0x25823ac7,
+  0xa086cfcd, 0x97bf97f4, 0xef340a98, 0x172aace5,
+  0xb23867fb, 0x2a35b28e, 0x84c8d4df, 0xd2c63f3b,
+  0xc5dd4427, 0x1ad3cdba, 0x936b9fce, 0xbb25c996,
+  0xdbac6c24, 0x7d62a584, 0xa3ab6658, 0x0d5fdaf6,
+  0xf3e2f893, 0xdec3f126, 0xb5b5ada8, 0xaaff80b8,
+  0x87625f05, 0x6c7c4a8b, 0xc9bcff60, 0x34c13053,
+  0x964e858c, 0x91ba2655, 0xdff97724, 0x70297ebd,
+  0xa6dfbd9f, 0xb8e5b88f, 0xf8a95fcf, 0x88747d94,
+  0xb9447093, 0x8fa89bcf, 0x8a08f0f8, 0xbf0f156b,
+  0xcdb02555, 0x653131b6, 0x993fe2c6, 0xd07b7fac,
+  0xe45c10c4, 0x2a2b3b06, 0xaa242499, 0x697392d3,
+  0xfd87b5f2, 0x8300ca0e, 0xbce50864, 0x92111aeb,
+  0x8cbccc09, 0x6f5088cc, 0xd1b71758, 0xe219652c,
+  0x9c400000, 0x00000000, 0xe8d4a510, 0x00000000,
+  0xad78ebc5, 0xac620000, 0x813f3978, 0xf8940984,
+  0xc097ce7b, 0xc90715b3, 0x8f7e32ce, 0x7bea5c70,
+  0xd5d238a4, 0xabe98068, 0x9f4f2726, 0x179a2245,
+  0xed63a231, 0xd4c4fb27, 0xb0de6538, 0x8cc8ada8,
+  0x83c7088e, 0x1aab65db, 0xc45d1df9, 0x42711d9a,
+  0x924d692c, 0xa61be758, 0xda01ee64, 0x1a708dea,
+  0xa26da399, 0x9aef774a, 0xf209787b, 0xb47d6b85,
+  0xb454e4a1, 0x79dd1877, 0x865b8692, 0x5b9bc5c2,
+  0xc83553c5, 0xc8965d3d, 0x952ab45c, 0xfa97a0b3,
+  0xde469fbd, 0x99a05fe3, 0xa59bc234, 0xdb398c25,
+  0xf6c69a72, 0xa3989f5c, 0xb7dcbf53, 0x54e9bece,
+  0x88fcf317, 0xf22241e2, 0xcc20ce9b, 0xd35c78a5,
+  0x98165af3, 0x7b2153df, 0xe2a0b5dc, 0x971f303a,
+  0xa8d9d153, 0x5ce3b396, 0xfb9b7cd9, 0xa4a7443c,
+  0xbb764c4c, 0xa7a44410, 0x8bab8eef, 0xb6409c1a,
+  0xd01fef10, 0xa657842c, 0x9b10a4e5, 0xe9913129,
+  0xe7109bfb, 0xa19c0c9d, 0xac2820d9, 0x623bf429,
+  0x80444b5e, 0x7aa7cf85, 0xbf21e440, 0x03acdd2d,
+  0x8e679c2f, 0x5e44ff8f, 0xd433179d, 0x9c8cb841,
+  0x9e19db92, 0xb4e31ba9, 0xeb96bf6e, 0xbadf77d9,
+  0xaf87023b, 0x9bf0ee6b
+  };
+
+/** Binary exponents of the cached powers
+ */
+static const int16_t CACHED_EXPONENTS[] PROGMEM = {
+  -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+  -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+  -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+  -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+  -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+  109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+  375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+  641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+  907, 933, 960, 986, 1013, 1039, 1066
+  };
+
+// First decimal exponent and step between cached powers
+#define CACHED_POWER_MIN  -348
+#define CACHED_POWER_STEP 8
+
+/** Powers of ten that fit in 64 bits
+ */
+static const uint64_t POW10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL,
+  100000000ULL, 1000000000ULL, 10000000000ULL, 100000000000ULL,
+  1000000000000ULL, 10000000000000ULL, 100000000000000ULL,
+  1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+  };
+
+//---------------------------------------------------------------------------
+// Helpers
+//---------------------------------------------------------------------------
+
+/** Copy a pair of digits from the table
+ */
+static inline void copyPair(char *pOutput, unsigned int value) {
+  pOutput[0] = (char)pgm_read_byte(&DIGIT_PAIRS[value * 2]);
+  pOutput[1] = (char)pgm_read_byte(&DIGIT_PAIRS[value * 2 + 1]);
+  }
+
+/** Write an unsigned value
+ *
+ * @return the number of characters written.
+ */
+static int formatUnsigned(char *buffer, unsigned long value) {
+  // Build the digits backwards from the end of a temporary buffer
+  char digits[JSON_INTEGER_SIZE];
+  char *pDigit = &digits[sizeof(digits)];
+  while(value>=100) {
+    pDigit -= 2;
+    copyPair(pDigit, (unsigned int)(value % 100));
+    value /= 100;
+    }
+  if(value>=10) {
+    pDigit -= 2;
+    copyPair(pDigit, (unsigned int)value);
+    }
+  else
+    *--pDigit = (char)('0' + value);
+  int length = &digits[sizeof(digits)] - pDigit;
+  memcpy(buffer, pDigit, length);
+  return length;
+  }
+
+/** A floating point value as a 64 bit significand and binary exponent
+ */
+typedef struct {
+  uint64_t f;
+  int      e;
+  } DiyFp;
+
+// IEEE double precision layout
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS    (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_HIDDEN_BIT       0x0010000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_EXPONENT_MASK    0x7FF0000000000000ULL
+
+/** Multiply two values, rounding the 128 bit result to 64 bits
+ */
+static DiyFp multiply(DiyFp x, DiyFp y) {
+  const uint64_t M32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & M32;
+  uint64_t c = y.f >> 32, d = y.f & M32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t tmp = (bd >> 32) + (ad & M32) + (bc & M32);
+  tmp += 1ULL << 31; // Round
+  DiyFp result = { ac + (ad >> 32) + (bc >> 32) + (tmp >> 32), x.e + y.e + 64 };
+  return result;
+  }
+
+/** Get the cached power of ten that brings a binary exponent into range
+ *
+ * @param e the binary exponent of the value.
+ * @param k receives the decimal exponent of the power (negated).
+ */
+static DiyFp cachedPower(int e, int &k) {
+  double dk = (-61 - e) * 0.30102999566398114 + 347; // 1/log2(10)
+  int ik = (int)dk;
+  if((dk - ik)>0.0)
+    ik++;
+  unsigned int index = (unsigned int)((ik >> 3) + 1);
+  k = -(CACHED_POWER_MIN + (int)index * CACHED_POWER_STEP);
+  DiyFp result;
+  result.f = ((uint64_t)pgm_read_dword(&CACHED_POWERS[index * 2]) << 32) | pgm_read_dword(&CACHED_POWERS[index * 2 + 1]);
+  result.e = (int16_t)pgm_read_word(&CACHED_EXPONENTS[index]);
+  return result;
+  }
+
+/** Move the last digit towards the exact value while it stays in range
+ */
+static void grisuRound(char *buffer, int length, uint64_t delta, uint64_t rest, uint64_t tenKappa, uint64_t distance) {
+  while((rest<distance)&&((delta - rest)>=tenKappa)&&
+    (((rest + tenKappa)<distance)||((distance - rest)>(rest + tenKappa - distance)))) {
+    buffer[length - 1]--;
+    rest += tenKappa;
+    }
+  }
+
+/** Count the decimal digits in a 32 bit value
+ */
+static int countDigits(uint32_t value) {
+  int digits = 1;
+  while((digits<10)&&(value>=POW10[digits]))
+    digits++;
+  return digits;
+  }
+
+/** Generate the shortest digits between the boundaries
+ *
+ * @return the number of digits generated.
+ */
+static int digitGen(DiyFp w, DiyFp mp, uint64_t delta, char *buffer, int &k) {
+  DiyFp one = { 1ULL << -mp.e, mp.e };
+  uint64_t distance = mp.f - w.f;
+  uint32_t p1 = (uint32_t)(mp.f >> -one.e);
+  uint64_t p2 = mp.f & (one.f - 1);
+  int kappa = countDigits(p1);
+  int length = 0;
+  // Integer part
+  while(kappa>0) {
+    uint32_t digit = (uint32_t)(p1 / POW10[kappa - 1]);
+    p1 %= (uint32_t)POW10[kappa - 1];
+    if(digit||length)
+      buffer[length++] = (char)('0' + digit);
+    kappa--;
+    uint64_t rest = ((uint64_t)p1 << -one.e) + p2;
+    if(rest<=delta) {
+      k += kappa;
+      grisuRound(buffer, length, delta, rest, POW10[kappa] << -one.e, distance);
+      return length;
+      }
+    }
+  // Fractional part
+  for(;;) {
+    p2 *= 10;
+    delta *= 10;
+    char digit = (char)(p2 >> -one.e);
+    if(digit||length)
+      buffer[length++] = (char)('0' + digit);
+    p2 &= one.f - 1;
+    kappa--;
+    if(p2<delta) {
+      k += kappa;
+      int index = -kappa;
+      grisuRound(buffer, length, delta, p2, one.f, distance * ((index<20) ? POW10[index] : 0));
+      return length;
+      }
+    }
+  }
+
+/** Generate the digits for a positive, finite, non zero value
+ *
+ * The value is buffer * 10^k.
+ *
+ * @return the number of digits generated (at most 17).
+ */
+static int grisu2(double value, char *buffer, int &k) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  int exponent = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+  DiyFp v;
+  v.f = bits & DP_SIGNIFICAND_MASK;
+  if(exponent!=0) {
+    v.f += DP_HIDDEN_BIT;
+    v.e = exponent - DP_EXPONENT_BIAS;
+    }
+  else
+    v.e = 1 - DP_EXPONENT_BIAS;
+  // Boundaries half way to the neighbouring values
+  DiyFp plus = { (v.f << 1) + 1, v.e - 1 };
+  while(!(plus.f & (DP_HIDDEN_BIT << 1))) {
+    plus.f <<= 1;
+    plus.e--;
+    }
+  plus.f <<= 10;
+  plus.e -= 10;
+  DiyFp minus;
+  if(v.f==DP_HIDDEN_BIT) {
+    minus.f = (v.f << 2) - 1;
+    minus.e = v.e - 2;
+    }
+  else {
+    minus.f = (v.f << 1) - 1;
+    minus.e = v.e - 1;
+    }
+  minus.f <<= minus.e - plus.e;
+  minus.e = plus.e;
+  // Normalise the value itself
+  DiyFp w = v;
+  while(!(w.f & DP_HIDDEN_BIT)) {
+    w.f <<= 1;
+    w.e--;
+    }
+  w.f <<= 11;
+  w.e -= 11;
+  // Scale everything into range and generate the digits
+  DiyFp power = cachedPower(plus.e, k);
+  w = multiply(w, power);
+  DiyFp wp = multiply(plus, power);
+  DiyFp wm = multiply(minus, power);
+  wm.f++;
+  wp.f--;
+  return digitGen(w, wp, wp.f - wm.f, buffer, k);
+  }
+
+/** Write a decimal exponent
+ *
+ * @return the number of characters written.
+ */
+static int formatExponent(char *buffer, int exponent) {
+  int length = 0;
+  buffer[length++] = 'e';
+  if(exponent<0) {
+    buffer[length++] = '-';
+    exponent = -exponent;
+    }
+  if(exponent>=100) {
+    buffer[length++] = (char)('0' + exponent / 100);
+    exponent %= 100;
+    copyPair(&buffer[length], exponent);
+    length += 2;
+    }
+  else if(exponent>=10) {
+    copyPair(&buffer[length], exponent);
+    length += 2;
+    }
+  else
+    buffer[length++] = (char)('0' + exponent);
+  return length;
+  }
+
+/** Lay out the digits as a decimal or exponential number
+ *
+ * @param buffer holds the digits on entry, the value is digits * 10^k.
+ * @param length the number of digits.
+ *
+ * @return the number of characters in the result.
+ */
+static int prettify(char *buffer, int length, int k) {
+  int kk = length + k; // 10^(kk - 1) <= v < 10^kk
+  if((k>=0)&&(kk<=21)) {
+    // 1234e7 -> 12340000000
+    memset(&buffer[length], '0', k);
+    return kk;
+    }
+  if((kk>0)&&(kk<=21)) {
+    // 1234e-2 -> 12.34
+    memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+    buffer[kk] = '.';
+    return length + 1;
+    }
+  if((kk>-6)&&(kk<=0)) {
+    // 1234e-6 -> 0.001234
+    int offset = 2 - kk;
+    memmove(&buffer[offset], &buffer[0], length);
+    buffer[0] = '0';
+    buffer[1] = '.';
+    memset(&buffer[2], '0', offset - 2);
+    return length + offset;
+    }
+  if(length==1) {
+    // 1e30
+    return 1 + formatExponent(&buffer[1], kk - 1);
+    }
+  // 1234e30 -> 1.234e33
+  memmove(&buffer[2], &buffer[1], length - 1);
+  buffer[1] = '.';
+  return length + 1 + formatExponent(&buffer[length + 1], kk - 1);
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of JsonFormat
+//---------------------------------------------------------------------------
+
+/** Format an integer
+ *
+ * @param buffer the buffer to receive the value, this must be at least
+ *               JSON_INTEGER_SIZE bytes.
+ * @param value the value to format.
+ *
+ * @return the number of characters (excluding the NUL terminator).
+ */
+int JsonFormat::integer(char *buffer, long value) {
+  int length = 0;
+  unsigned long magnitude = (unsigned long)value;
+  if(value<0) {
+    buffer[length++] = '-';
+    magnitude = 0UL - magnitude;
+    }
+  length += formatUnsigned(&buffer[length], magnitude);
+  buffer[length] = '\0';
+  return length;
+  }
+
+/** Format a floating point value
+ *
+ * Produces the shortest string that converts back to the same value. JSON
+ * cannot represent NaN or infinity so they are written as 'null'.
+ *
+ * @param buffer the buffer to receive the value, this must be at least
+ *               JSON_NUMBER_SIZE bytes.
+ * @param value the value to format.
+ *
+ * @return the number of characters (excluding the NUL terminator).
+ */
+int JsonFormat::number(char *buffer, double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  if((bits & DP_EXPONENT_MASK)==DP_EXPONENT_MASK) {
+    strcpy(buffer, "null");
+    return 4;
+    }
+  int length = 0;
+  if(bits>>63) {
+    buffer[length++] = '-';
+    value = -value;
+    }
+  if(value==0.0)
+    buffer[length++] = '0';
+  else {
+    int k;
+    int digits = grisu2(value, &buffer[length], k);
+    length += prettify(&buffer[length], digits, k);
+    }
+  buffer[length] = '\0';
+  return length;
+  }
@@ -0,0 +1,342 @@
+/*--------------------------------------------------------------------------*
+* Output windows for the JSON builder
+*---------------------------------------------------------------------------*
+* Fixed, reserved, growable and streamed output policies. The builder writes
+* into a window of memory and only calls the policy when the window is full.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include "Json.h"
+
+#ifndef ARDUINO
+#  include <errno.h>
+#  include <unistd.h>
+#endif
+
+//---------------------------------------------------------------------------
+// Implementation of JsonOutput
+//---------------------------------------------------------------------------
+
+/** Default constructor
+ */
+JsonOutput::JsonOutput() {
+  m_pBuffer = NULL;
+  m_size = 0;
+  m_used = 0;
+  }
+
+/** Make room for more data when the window is full
+ *
+ * The default window is a fixed size so there is never any more room.
+ */
+bool JsonOutput::overflow() {
+  return false;
+  }
+
+/** Discard any existing output
+ */
+void JsonOutput::reset() {
+  m_used = 0;
+  }
+
+/** Add a block of characters
+ *
+ * @return true if the data was added, false if the output is full.
+ */
+bool JsonOutput::write(const char *pData, size_t length) {
+  while(length>0) {
+    if((m_used>=m_size)&&!overflow())
+      return false;
+    size_t count = m_size - m_used;
+    if(count>length)
+      count = length;
+    memcpy(&m_pBuffer[m_used], pData, count);
+    m_used += count;
+    pData += count;
+    length -= count;
+    }
+  return true;
+  }
+
+/** Add a NUL terminated string
+ *
+ * @return true if the string was added, false if the output is full.
+ */
+bool JsonOutput::write(const char *cszString) {
+  return write(cszString, strlen(cszString));
+  }
+
+/** Get the number of characters written so far
+ */
+size_t JsonOutput::length() const {
+  return m_used;
+  }
+
+/** Discard output written after a previous position
+ *
+ * @param length the value of length() to return to.
+ *
+ * @return true on success, false if the data is no longer available.
+ */
+bool JsonOutput::rewind(size_t length) {
+  if(length>m_used)
+    return false;
+  m_used = length;
+  return true;
+  }
+
+/** Send any buffered output to its destination
+ *
+ * Buffered output stays in memory so there is nothing to do.
+ */
+bool JsonOutput::flush() {
+  return true;
+  }
+
+/** Get the output as a NUL terminated string
+ */
+const char *JsonOutput::result() {
+  if(m_pBuffer==NULL)
+    return "";
+  m_pBuffer[m_used] = '\0';
+  return m_pBuffer;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of JsonFixedOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param buffer the buffer to write to.
+ * @param size the size of the buffer (including the NUL terminator).
+ */
+JsonFixedOutput::JsonFixedOutput(char *buffer, size_t size) {
+  if((buffer!=NULL)&&(size>0)) {
+    m_pBuffer = buffer;
+    m_size = size - 1;
+    }
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of JsonArenaOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param size the size of the block to reserve (including the NUL
+ *             terminator).
+ */
+JsonArenaOutput::JsonArenaOutput(size_t size) {
+  if(size>0)
+    m_pBuffer = (char *)malloc(size);
+  if(m_pBuffer!=NULL)
+    m_size = size - 1;
+  }
+
+/** Destructor
+ */
+JsonArenaOutput::~JsonArenaOutput() {
+  free(m_pBuffer);
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of JsonGrowableOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * No memory is allocated until the first character is written.
+ *
+ * @param initial the size of the first allocation.
+ * @param limit the maximum size of the buffer or 0 for no limit.
+ */
+JsonGrowableOutput::JsonGrowableOutput(size_t initial, size_t limit) {
+  m_initial = (initial<2) ? 2 : initial;
+  m_limit = limit;
+  }
+
+/** Destructor
+ */
+JsonGrowableOutput::~JsonGrowableOutput() {
+  free(m_pBuffer);
+  }
+
+/** Double the size of the buffer
+ *
+ * @return true if the buffer was expanded, false if it has reached the limit
+ *         or there is not enough memory.
+ */
+bool JsonGrowableOutput::overflow() {
+  // Sizes include the NUL terminator
+  size_t size = (m_pBuffer==NULL) ? m_initial : ((m_size + 1) * 2);
+  if((m_limit>0)&&(size>m_limit))
+    size = m_limit;
+  if(size<=(m_size + 1))
+    return false;
+  char *pBuffer = (char *)realloc(m_pBuffer, size);
+  if(pBuffer==NULL)
+    return false;
+  m_pBuffer = pBuffer;
+  m_size = size - 1;
+  return true;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of JsonStreamOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param buffer the buffer to use for the window.
+ * @param size the size of the buffer.
+ * @param chunked true to frame the data with HTTP chunked transfer encoding.
+ */
+JsonStreamOutput::JsonStreamOutput(char *buffer, size_t size, bool chunked) {
+  // The window does not need space for a NUL terminator
+  if(buffer!=NULL) {
+    m_pBuffer = buffer;
+    m_size = size;
+    }
+  m_sent = 0;
+  m_chunked = chunked;
+  m_failed = false;
+  }
+
+/** Send a block of data (as a single chunk if required)
+ */
+bool JsonStreamOutput::sendChunk(const char *pData, size_t length) {
+  // An empty chunk would mark the end of the data
+  if(length==0)
+    return true;
+  if(m_chunked) {
+    char header[12];
+    int count = snprintf(header, sizeof(header), "%x\r\n", (unsigned int)length);
+    if(!send(header, count))
+      return false;
+    }
+  if(!send(pData, length))
+    return false;
+  return !m_chunked || send("\r\n", 2);
+  }
+
+/** Send the window
+ */
+bool JsonStreamOutput::overflow() {
+  if(m_failed||(m_size==0))
+    return false;
+  if(!sendChunk(m_pBuffer, m_used)) {
+    m_failed = true;
+    return false;
+    }
+  m_sent += m_used;
+  m_used = 0;
+  return true;
+  }
+
+/** Discard any existing output and clear errors
+ */
+void JsonStreamOutput::reset() {
+  m_used = 0;
+  m_sent = 0;
+  m_failed = false;
+  }
+
+/** Get the number of characters written so far
+ */
+size_t JsonStreamOutput::length() const {
+  return m_sent + m_used;
+  }
+
+/** Discard output written after a previous position
+ *
+ * @return true on success, false if the data has already been sent.
+ */
+bool JsonStreamOutput::rewind(size_t length) {
+  if((length<m_sent)||(length>(m_sent + m_used)))
+    return false;
+  m_used = length - m_sent;
+  return true;
+  }
+
+/** Send the remaining output (and the final chunk)
+ *
+ * @return true on success, false if the output could not be sent.
+ */
+bool JsonStreamOutput::flush() {
+  if(m_failed||!sendChunk(m_pBuffer, m_used)||(m_chunked&&!send("0\r\n\r\n", 5))) {
+    m_failed = true;
+    return false;
+    }
+  m_sent += m_used;
+  m_used = 0;
+  return true;
+  }
+
+/** The output is not available as a string
+ *
+ * @return an empty string.
+ */
+const char *JsonStreamOutput::result() {
+  return "";
+  }
+
+#ifdef ARDUINO
+
+//---------------------------------------------------------------------------
+// Implementation of JsonPrintOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param print the destination for the output.
+ * @param buffer the buffer to use for the window.
+ * @param size the size of the buffer.
+ * @param chunked true to use HTTP chunked transfer encoding.
+ */
+JsonPrintOutput::JsonPrintOutput(Print &print, char *buffer, size_t size, bool chunked) :
+  JsonStreamOutput(buffer, size, chunked), m_print(print) {
+  }
+
+/** Deliver data to the destination
+ */
+bool JsonPrintOutput::send(const char *pData, size_t length) {
+  return m_print.write((const uint8_t *)pData, length) == length;
+  }
+
+#else
+
+//---------------------------------------------------------------------------
+// Implementation of JsonFileOutput
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param fd the file descriptor to write to.
+ * @param buffer the buffer to use for the window.
+ * @param size the size of the buffer.
+ * @param chunked true to use HTTP chunked transfer encoding.
+ */
+JsonFileOutput::JsonFileOutput(int fd, char *buffer, size_t size, bool chunked) :
+  JsonStreamOutput(buffer, size, chunked), m_fd(fd) {
+  }
+
+/** Deliver data to the destination
+ */
+bool JsonFileOutput::send(const char *pData, size_t length) {
+  while(length>0) {
+    ssize_t count = ::write(m_fd, pData, length);
+    if(count<0) {
+      if(errno==EINTR)
+        continue;
+      return false;
+      }
+    pData += count;
+    length -= count;
+    }
+  return true;
+  }
+
+#endif /* ARDUINO */
@@ -8,8 +8,16 @@
 *--------------------------------------------------------------------------*/
 #include "Arduino.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
 #include "Json.h"
 
+#ifdef JSON_PRESCAN
+#  if defined(__AVX2__) || defined(__SSE2__)
+#    include <immintrin.h>
+#  endif
+#endif
+
 //---------------------------------------------------------------------------
 // Implementation of JsonParser
 //---------------------------------------------------------------------------
@@ -34,9 +42,31 @@ JsonToken *JsonParser::AllocToken() {
   JsonToken *pToken = &m_pTokens[m_toknext++];
   pToken->start = pToken->end = -1;
   pToken->size = 0;
+  pToken->next = m_toknext;
+#ifdef JSON_PARENT_LINKS
+  pToken->parent = m_toksuper;
+#endif
   return pToken;
   }
 
+#ifdef JSON_PARENT_LINKS
+/** Find the innermost open object or array
+ *
+ * Starts at the given token and follows the parent links.
+ *
+ * @return the index of the container or -1 if there is none.
+ */
+int JsonParser::OpenContainer(int token) {
+  while(token != -1) {
+    JsonToken *pToken = &m_pTokens[token];
+    if(pToken->start != -1 && pToken->end == -1)
+      return token;
+    token = pToken->parent;
+    }
+  return -1;
+  }
+#endif
+
 /** Parse a primitive from the current position in the source
  *
  * Looks for a primitive (boolean, null and numbers) and adds the appropriate
@@ -47,7 +77,7 @@ JsonToken *JsonParser::AllocToken() {
 int JsonParser::ParsePrimitive() {
   JsonToken *pToken;
   int start = m_pos;
-  for(;m_cszSource[m_pos]!='\0'; m_pos++) {
+  for(;m_pos < m_length; m_pos++) {
     switch(m_cszSource[m_pos]) {
       case '\t' : case '\r' : case '\n' : case ' ' :
       case ','  : case ']'  : case '}' :
@@ -81,8 +111,20 @@ found:
 int JsonParser::ParseString() {
   JsonToken *pToken;
   int start = m_pos++;
+  /* Carry on from where a partial scan of this string stopped */
+  if((start == m_partial) && (m_resume > m_pos))
+    m_pos = m_resume;
+  unsigned int resume = m_pos;
   /* Skip starting quote */
-  for(;m_cszSource[m_pos] != '\0'; m_pos++) {
+  for(;m_pos < m_length; m_pos++) {
+#ifdef JSON_PRESCAN
+    /* Go straight to the next quote or backslash */
+    if((m_pos = NextString(m_pos)) >= m_length) {
+      resume = m_length;
+      break;
+      }
+#endif
+    resume = m_pos;
     char c = m_cszSource[m_pos];
     /* Quote: end of string */
     if(c == '\"') {
@@ -95,7 +137,7 @@ int JsonParser::ParseString() {
       return 0;
       }
       /* Backslash: Quoted symbol expected */
-      if(c == '\\' && m_cszSource[m_pos + 1]) {
+      if(c == '\\' && (m_pos + 1) < m_length) {
         int i;
         m_pos++;
         switch(m_cszSource[m_pos]) {
@@ -106,7 +148,7 @@ int JsonParser::ParseString() {
           /* Allows escaped symbol \uXXXX */
           case 'u':
             m_pos++;
-            for(i=0; i < 4 && m_cszSource[m_pos]; i++) {
+            for(i=0; i < 4 && m_pos < m_length; i++) {
               /* If it isn't a hex character we have an error */
               char h = m_cszSource[m_pos];
               if(!((h >= '0' && h <= '9') || (h >= 'A' && h <= 'F') || (h >= 'a' && h <= 'f'))) {
@@ -124,10 +166,114 @@ int JsonParser::ParseString() {
           }
       }
     }
+  /* Remember how far we got in case more data arrives */
+  m_partial = start;
+  m_resume = resume;
   m_pos = start;
   return JsonErrorPartial;
   }
 
+#ifdef JSON_PRESCAN
+
+/** Space characters recognised between tokens
+ */
+static inline bool isSpace(char c) {
+  return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+  }
+
+/** Build the character masks for the 64 byte block at the given offset
+ *
+ * Bit n of each mask describes the character at offset block + n. The last
+ * block is copied into a zero padded buffer so we never read past the end
+ * of the source.
+ */
+void JsonParser::ScanBlock(unsigned int block) {
+  char padded[64];
+  const char *pBlock = &m_cszSource[block];
+  if((block + 64) > m_length) {
+    memset(padded, 0, sizeof(padded));
+    memcpy(padded, pBlock, m_length - block);
+    pBlock = padded;
+    }
+  uint64_t quotes = 0, spaces = 0;
+#if defined(__AVX2__)
+  for(int i = 0; i < 64; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)&pBlock[i]);
+    __m256i q = _mm256_or_si256(
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    __m256i s = _mm256_or_si256(
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+      _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+    quotes |= (uint64_t)(uint32_t)_mm256_movemask_epi8(q) << i;
+    spaces |= (uint64_t)(uint32_t)_mm256_movemask_epi8(s) << i;
+    }
+#elif defined(__SSE2__)
+  for(int i = 0; i < 64; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)&pBlock[i]);
+    __m128i q = _mm_or_si128(
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+      _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    __m128i s = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+    quotes |= (uint64_t)(uint16_t)_mm_movemask_epi8(q) << i;
+    spaces |= (uint64_t)(uint16_t)_mm_movemask_epi8(s) << i;
+    }
+#else
+  for(int i = 0; i < 64; i++) {
+    char c = pBlock[i];
+    if((c == '"') || (c == '\\'))
+      quotes |= (uint64_t)1 << i;
+    if(isSpace(c))
+      spaces |= (uint64_t)1 << i;
+    }
+#endif
+  m_block = block;
+  m_quotes = quotes;
+  m_nonspace = ~spaces;
+  }
+
+/** Find the next quote or backslash at or after the given position
+ *
+ * @return the position of the character or the length of the source if
+ *         there are none.
+ */
+unsigned int JsonParser::NextString(unsigned int pos) {
+  while(pos < m_length) {
+    unsigned int block = pos & ~63u;
+    if(block != m_block)
+      ScanBlock(block);
+    uint64_t bits = m_quotes >> (pos - block);
+    if(bits != 0)
+      return pos + __builtin_ctzll(bits);
+    pos = block + 64;
+    }
+  return m_length;
+  }
+
+/** Find the next non whitespace character at or after the given position
+ *
+ * @return the position of the character or the length of the source if
+ *         there are none.
+ */
+unsigned int JsonParser::NextToken(unsigned int pos) {
+  while(pos < m_length) {
+    unsigned int block = pos & ~63u;
+    if(block != m_block)
+      ScanBlock(block);
+    uint64_t bits = m_nonspace >> (pos - block);
+    if(bits != 0) {
+      pos += __builtin_ctzll(bits);
+      return (pos < m_length) ? pos : m_length;
+      }
+    pos = block + 64;
+    }
+  return m_length;
+  }
+
+#endif /* JSON_PRESCAN */
+
 /** Initialise the parser with space to keep tokens
  *
  * @param pTokens pointer to an array of JsonToken structures
@@ -136,6 +282,9 @@ int JsonParser::ParseString() {
 JsonParser::JsonParser(JsonToken *pTokens, int tokens) {
   m_pTokens = pTokens;
   m_tokens = tokens;
+  m_pIndex = NULL;
+  m_indexSize = 0;
+  begin();
   }
 
 /** Parse JSON from a string buffer in memory
@@ -147,16 +296,67 @@ JsonParser::JsonParser(JsonToken *pTokens, int tokens) {
  *         occurs.
  */
 int JsonParser::parse(const char *cszJson) {
-  // Set up state
+  return parse(cszJson, strlen(cszJson));
+  }
+
+/** Parse JSON from a buffer of known length
+ *
+ * @param pData pointer to the JSON to be parsed, this does not need to be
+ *              NUL terminated.
+ * @param length the number of bytes to parse.
+ *
+ * @return the number of tokens discovered or a negative value if an error
+ *         occurs.
+ */
+int JsonParser::parse(const char *pData, size_t length) {
+  begin();
+  return resume(pData, length);
+  }
+
+/** Start an incremental parse
+ *
+ * Resets the parser state ready for a sequence of calls to resume().
+ */
+void JsonParser::begin() {
   m_pos = 0;
   m_toknext = 0;
   m_toksuper = -1;
-  m_cszSource = cszJson;
+  m_open = 0;
+  m_partial = -1;
+  m_indexUsed = 0;
+  }
+
+/** Continue parsing with the data available so far
+ *
+ * pData is the whole document received so far, independent chunks are not
+ * supported because the tokens are offsets into the document.
+ *
+ * @param pData pointer to the start of the JSON document (not to the newly
+ *              received data). This does not need to be NUL terminated and
+ *              may move between calls.
+ * @param length the number of bytes of the document that are available,
+ *               this must not be less than the value given in the previous
+ *               call.
+ *
+ * @return the number of tokens discovered, JsonErrorPartial if more data
+ *         is needed to complete the document or another negative value if
+ *         an error occurs.
+ */
+int JsonParser::resume(const char *pData, size_t length) {
+  // Token positions are stored as ints
+  if (length > INT_MAX)
+    return JsonErrorNoMemory;
+  // Set up state
+  m_cszSource = pData;
+  m_length = length;
+#ifdef JSON_PRESCAN
+  m_block = ~0u;
+#endif
   // Do the parsing
   int r, i;
   JsonToken *pToken;
   int count = m_toknext;
-  for(; m_cszSource[m_pos] != '\0'; m_pos++) {
+  for(; m_pos < m_length; m_pos++) {
     JsonType type;
     char c = m_cszSource[m_pos];
     switch (c) {
@@ -168,10 +368,25 @@ int JsonParser::parse(const char *cszJson) {
           m_pTokens[m_toksuper].size++;
         pToken->type = (c == '{' ? JsonObject : JsonArray);
         pToken->start = m_pos;
+        pToken->next = -1; // Filled in when it is closed
         m_toksuper = m_toknext - 1;
+        m_open++;
         break;
       case '}': case ']':
         type = (c == '}' ? JsonObject : JsonArray);
+#ifdef JSON_PARENT_LINKS
+        /* Innermost open container is the current parent or one of its parents */
+        i = OpenContainer(m_toksuper);
+        if(i == -1)
+          return JsonErrorInvalidChar;
+        pToken = &m_pTokens[i];
+        if(pToken->type != type)
+          return JsonErrorInvalidChar;
+        pToken->end = m_pos + 1;
+        pToken->next = m_toknext;
+        m_toksuper = OpenContainer(pToken->parent);
+        m_open--;
+#else
         for (i = m_toknext - 1; i >= 0; i--) {
           pToken = &m_pTokens[i];
           if (pToken->start != -1 && pToken->end == -1) {
@@ -179,6 +394,8 @@ int JsonParser::parse(const char *cszJson) {
               return JsonErrorInvalidChar;
             m_toksuper = -1;
             pToken->end = m_pos + 1;
+            pToken->next = m_toknext;
+            m_open--;
             break;
             }
           }
@@ -192,6 +409,7 @@ int JsonParser::parse(const char *cszJson) {
             break;
             }
           }
+#endif
         break;
       case '\"':
         if((r = ParseString()) < 0)
@@ -201,12 +419,19 @@ int JsonParser::parse(const char *cszJson) {
           m_pTokens[m_toksuper].size++;
         break;
       case '\t' : case '\r' : case '\n' : case ' ':
+#ifdef JSON_PRESCAN
+        /* Skip the rest of the whitespace in one go */
+        m_pos = NextToken(m_pos) - 1;
+#endif
         break;
       case ':':
         m_toksuper = m_toknext - 1;
         break;
       case ',':
         if(m_toksuper != -1 && m_pTokens[m_toksuper].type != JsonArray && m_pTokens[m_toksuper].type != JsonObject) {
+#ifdef JSON_PARENT_LINKS
+          m_toksuper = OpenContainer(m_pTokens[m_toksuper].parent);
+#else
           for (i = m_toknext - 1; i >= 0; i--) {
             if (m_pTokens[i].type == JsonArray || m_pTokens[i].type == JsonObject) {
               if (m_pTokens[i].start != -1 && m_pTokens[i].end == -1) {
@@ -215,6 +440,7 @@ int JsonParser::parse(const char *cszJson) {
                 }
               }
             }
+#endif
           }
         break;
       /* In strict mode primitives are: numbers and booleans */
@@ -238,14 +464,86 @@ int JsonParser::parse(const char *cszJson) {
           return JsonErrorInvalidChar;
       }
     }
-  for (i = m_toknext - 1; i >= 0; i--) {
-    /* Unmatched opened object or array */
-    if (m_pTokens[i].start != -1 && m_pTokens[i].end == -1)
-      return JsonErrorPartial;
-    }
+  /* Unmatched opened object or array */
+  if (m_open > 0)
+    return JsonErrorPartial;
   return count;
   }
 
+/** Hash a field name (FNV-1a)
+ */
+static uint32_t HashName(const char *pName, int length) {
+  uint32_t hash = 2166136261u;
+  while(length-- > 0)
+    hash = (hash ^ (uint8_t)*pName++) * 16777619u;
+  return hash;
+  }
+
+/** Compare the name of a field with a string
+ */
+bool JsonParser::IsField(int key, const char *cszName, int nameLen) {
+  int fieldLen = m_pTokens[key].end - m_pTokens[key].start;
+  return (fieldLen == nameLen) && (memcmp(cszName, &m_cszSource[m_pTokens[key].start], nameLen) == 0);
+  }
+
+/** Find (or build) the key index for an object
+ *
+ * Each index in the scratch memory is laid out as the object token, the
+ * number of slots (a power of two) and then the slots themselves. Slots
+ * contain the token for the field name or -1 if they are empty.
+ *
+ * @return the offset of the index in the scratch memory or -1 if
+ *         the object cannot be indexed.
+ */
+int JsonParser::FindIndex(int object) {
+  int offset;
+  for(offset = 0; offset < m_indexUsed; offset += m_pIndex[offset + 1] + 2) {
+    if(m_pIndex[offset] == object)
+      return offset;
+    }
+  // Only complete objects can be indexed
+  JsonToken *pObject = &m_pTokens[object];
+  if(pObject->end == -1)
+    return -1;
+  // Keep the table no more than half full
+  int slots = 4;
+  while(slots < (pObject->size * 2))
+    slots *= 2;
+  if((m_indexUsed + slots + 2) > m_indexSize)
+    return -1;
+  int *pSlots = &m_pIndex[offset + 2];
+  for(int i = 0; i < slots; i++)
+    pSlots[i] = -1;
+  // Add the fields, keeping the first if a name is repeated
+  int key = object + 1;
+  for(int fields = 0; fields < pObject->size; fields++, key = next(key)) {
+    if((key < 0) || ((key + 1) >= (int)m_toknext) || (m_pTokens[key].type != JsonString))
+      return -1; // Malformed object, leave it to the linear search
+    const char *pName = &m_cszSource[m_pTokens[key].start];
+    int nameLen = m_pTokens[key].end - m_pTokens[key].start;
+    int slot = HashName(pName, nameLen) & (slots - 1);
+    while((pSlots[slot] != -1) && !IsField(pSlots[slot], pName, nameLen))
+      slot = (slot + 1) & (slots - 1);
+    if(pSlots[slot] == -1)
+      pSlots[slot] = key;
+    }
+  m_pIndex[offset] = object;
+  m_pIndex[offset + 1] = slots;
+  m_indexUsed = offset + slots + 2;
+  return offset;
+  }
+
+/** Provide scratch memory for key indexes
+ *
+ * @param pScratch memory for the indexes or NULL to disable them.
+ * @param size the number of ints available in the scratch memory.
+ */
+void JsonParser::setIndex(int *pScratch, int size) {
+  m_pIndex = pScratch;
+  m_indexSize = (pScratch == NULL) ? 0 : size;
+  m_indexUsed = 0;
+  }
+
 /** Find the token representing the content of a named field
  *
  * @param object the token index of the object containing the field.
@@ -256,29 +554,85 @@ int JsonParser::parse(const char *cszJson) {
  */
 int JsonParser::find(int object, const char *cszName) {
   // Make sure we are starting with a valid object token
-  if ((object < 0) || (object >= m_tokens) || (m_pTokens[object].type != JsonObject))
+  if ((object < 0) || (object >= (int)m_toknext) || (m_pTokens[object].type != JsonObject))
     return -1;
-  int index = 1, fields = 1;
   int nameLen = strlen(cszName);
-  while(fields <= m_pTokens[object].size) {
-    if (m_pTokens[object + index].type != JsonString)
+  // Use the key index if we have one
+  int offset = (m_indexSize > 0) ? FindIndex(object) : -1;
+  if(offset >= 0) {
+    int slots = m_pIndex[offset + 1];
+    int *pSlots = &m_pIndex[offset + 2];
+    int slot = HashName(cszName, nameLen) & (slots - 1);
+    for(; pSlots[slot] != -1; slot = (slot + 1) & (slots - 1)) {
+      if(IsField(pSlots[slot], cszName, nameLen))
+        return pSlots[slot] + 1; // Found it
+      }
+    return -1;
+    }
+  // Walk through the fields
+  int key = object + 1;
+  for(int fields = 0; fields < m_pTokens[object].size; fields++, key = next(key)) {
+    if ((key < 0) || ((key + 1) >= (int)m_toknext))
+      return -1; // Incomplete object
+    if (m_pTokens[key].type != JsonString)
       return -1; // Field name must be a string
-    int fieldLen = m_pTokens[object + index].end - m_pTokens[object + index].start;
-    if((fieldLen == nameLen) && (strncmp(cszName, &m_cszSource[m_pTokens[object + index].start], nameLen) == 0))
-      return object + index + 1; // Found it
-    // Move to the next field
-    fields++;
-    index = index + m_pTokens[object + index].size + 1;
+    if(IsField(key, cszName, nameLen))
+      return key + 1; // Found it
     }
   // Not found
   return -1;
   }
 
+/** Get the token following a value
+ *
+ * Skips over any tokens nested in the value, for a field name this includes
+ * the value of the field.
+ *
+ * @param token the index of the current token.
+ *
+ * @return the index of the next token or -1 if the token is invalid or not
+ *         complete yet.
+ */
+int JsonParser::next(int token) {
+  if ((token < 0) || (token >= (int)m_toknext))
+    return -1;
+  // Field names skip their value as well
+  JsonToken *pToken = &m_pTokens[token];
+  if ((pToken->type != JsonObject) && (pToken->type != JsonArray) && (pToken->size > 0))
+    return next(token + 1);
+  return pToken->next;
+  }
+
+/** Get the number of fields in an object or elements in an array
+ *
+ * @return the number of children or -1 if the token is not an object or
+ *         array.
+ */
+int JsonParser::size(int token) {
+  if ((token < 0) || (token >= (int)m_toknext) || ((m_pTokens[token].type != JsonObject) && (m_pTokens[token].type != JsonArray)))
+    return -1;
+  return m_pTokens[token].size;
+  }
+
+/** Determine if a token is an object
+ */
+bool JsonParser::isObject(int token) {
+  return (token >= 0) && (token < (int)m_toknext) && (m_pTokens[token].type == JsonObject);
+  }
+
+/** Determine if a token is a string (rather than a primitive)
+ */
+bool JsonParser::isString(int token) {
+  return (token >= 0) && (token < (int)m_toknext) && (m_pTokens[token].type == JsonString);
+  }
+
 /** Get a pointer to the string represented by the token
+ *
+ * The string is not NUL terminated, use len() to get the length.
  */
 const char *JsonParser::str(int token) {
   // Make it can be represented as a string
-  if ((token < 0) || (token >= m_tokens) || ((m_pTokens[token].type != JsonPrimitive) && (m_pTokens[token].type != JsonString)))
+  if ((token < 0) || (token >= (int)m_toknext) || ((m_pTokens[token].type != JsonPrimitive) && (m_pTokens[token].type != JsonString)))
     return NULL;
   // Return the pointer to the start of the string
   return &m_cszSource[m_pTokens[token].start];
@@ -288,7 +642,409 @@ const char *JsonParser::str(int token) {
  */
 int JsonParser::len(int token) {
   // Make it can be represented as a string
-  if ((token < 0) || (token >= m_tokens) || ((m_pTokens[token].type != JsonPrimitive) && (m_pTokens[token].type != JsonString)))
+  if ((token < 0) || (token >= (int)m_toknext) || ((m_pTokens[token].type != JsonPrimitive) && (m_pTokens[token].type != JsonString)))
     return 0;
   return m_pTokens[token].end - m_pTokens[token].start;
   }
+
+/** Compare the content of a primitive with a string
+ */
+static bool IsLiteral(const char *cszValue, int length, const char *cszLiteral) {
+  return (cszValue != NULL) && (length == (int)strlen(cszLiteral)) && (memcmp(cszValue, cszLiteral, length) == 0);
+  }
+
+/** Get the value of an integer primitive
+ *
+ * The value is parsed straight from the source data.
+ *
+ * @param token the index of the token.
+ * @param value receives the value.
+ *
+ * @return true on success, false if the token is not an integer or is out
+ *         of range.
+ */
+bool JsonParser::getInt(int token, long &value) {
+  if ((token < 0) || (token >= (int)m_toknext) || (m_pTokens[token].type != JsonPrimitive))
+    return false;
+  const char *pChar = str(token);
+  const char *pEnd = pChar + len(token);
+  bool negative = (pChar < pEnd) && (*pChar == '-');
+  if (negative)
+    pChar++;
+  if (pChar == pEnd)
+    return false;
+  unsigned long limit = negative ? (0UL - (unsigned long)LONG_MIN) : (unsigned long)LONG_MAX;
+  unsigned long result = 0;
+  for (; pChar < pEnd; pChar++) {
+    unsigned int digit = *pChar - '0';
+    if ((digit > 9) || (result > ((limit - digit) / 10)))
+      return false;
+    result = (result * 10) + digit;
+    }
+  value = negative ? (long)(0UL - result) : (long)result;
+  return true;
+  }
+
+/** Get the value of a numeric primitive
+ *
+ * Values with up to 19 significant digits and a decimal exponent of 22 or
+ * less are exact after a single multiply or divide (the mantissa and the
+ * power of ten are both exact doubles) so they are converted directly. Any
+ * other value falls back to strtod().
+ *
+ * @param token the index of the token.
+ * @param value receives the value.
+ *
+ * @return true on success, false if the token is not a number.
+ */
+bool JsonParser::getDouble(int token, double &value) {
+  if ((token < 0) || (token >= (int)m_toknext) || (m_pTokens[token].type != JsonPrimitive))
+    return false;
+  const char *pStart = str(token);
+  const char *pChar = pStart;
+  const char *pEnd = pChar + len(token);
+  bool negative = (pChar < pEnd) && (*pChar == '-');
+  if (negative)
+    pChar++;
+  // Mantissa, digits after the 19th are only counted
+  uint64_t mantissa = 0;
+  int digits = 0, scale = 0, count = 0;
+  for (; (pChar < pEnd) && (*pChar >= '0') && (*pChar <= '9'); pChar++, count++) {
+    if ((mantissa != 0) || (*pChar != '0'))
+      digits++;
+    if (digits <= 19)
+      mantissa = (mantissa * 10) + (*pChar - '0');
+    else
+      scale++;
+    }
+  if (count == 0)
+    return false;
+  if ((pChar < pEnd) && (*pChar == '.')) {
+    pChar++;
+    for (count = 0; (pChar < pEnd) && (*pChar >= '0') && (*pChar <= '9'); pChar++, count++) {
+      if ((mantissa != 0) || (*pChar != '0'))
+        digits++;
+      if (digits <= 19) {
+        mantissa = (mantissa * 10) + (*pChar - '0');
+        scale--;
+        }
+      }
+    if (count == 0)
+      return false;
+    }
+  // Exponent
+  if ((pChar < pEnd) && ((*pChar == 'e') || (*pChar == 'E'))) {
+    pChar++;
+    bool minus = (pChar < pEnd) && (*pChar == '-');
+    if ((pChar < pEnd) && ((*pChar == '-') || (*pChar == '+')))
+      pChar++;
+    int exponent = 0;
+    for (count = 0; (pChar < pEnd) && (*pChar >= '0') && (*pChar <= '9'); pChar++, count++) {
+      if (exponent < 10000)
+        exponent = (exponent * 10) + (*pChar - '0');
+      }
+    if (count == 0)
+      return false;
+    scale += minus ? -exponent : exponent;
+    }
+  if (pChar != pEnd)
+    return false;
+  // Fast path
+  if ((digits <= 19) && (mantissa <= (1ULL << 53)) && (scale >= -22) && (scale <= 22)) {
+    double power = 1.0;
+    for (int i = (scale < 0) ? -scale : scale; i > 0; i--)
+      power *= 10.0;
+    double result = (double)mantissa;
+    result = (scale < 0) ? (result / power) : (result * power);
+    value = negative ? -result : result;
+    return true;
+    }
+  // Fall back to the library. The source is not NUL terminated and may be
+  // of any length so the number is rebuilt from its first 40 significant
+  // digits, with a trailing 1 standing in for any non zero digits after them.
+  char buffer[64];
+  char *pOut = buffer;
+  if (negative)
+    *pOut++ = '-';
+  int kept = 0;
+  bool dropped = false;
+  for (pChar = negative ? (pStart + 1) : pStart; (pChar < pEnd) && (*pChar != 'e') && (*pChar != 'E'); pChar++) {
+    if ((*pChar == '.') || ((kept == 0) && (*pChar == '0')))
+      continue;
+    if (kept < 40) {
+      *pOut++ = *pChar;
+      kept++;
+      }
+    else
+      dropped = dropped || (*pChar != '0');
+    }
+  // The scale applies to the first 19 digits
+  scale -= kept - ((digits < 19) ? digits : 19);
+  if (kept == 0)
+    *pOut++ = '0';
+  else if (dropped) {
+    *pOut++ = '1';
+    scale--;
+    }
+  snprintf(pOut, buffer + sizeof(buffer) - pOut, "e%d", scale);
+  value = strtod(buffer, NULL);
+  return true;
+  }
+
+/** Get the value of a boolean primitive
+ *
+ * @param token the index of the token.
+ * @param value receives the value.
+ *
+ * @return true on success, false if the token is not 'true' or 'false'.
+ */
+bool JsonParser::getBool(int token, bool &value) {
+  if ((token < 0) || (token >= (int)m_toknext) || (m_pTokens[token].type != JsonPrimitive))
+    return false;
+  if (IsLiteral(str(token), len(token), "true"))
+    value = true;
+  else if (IsLiteral(str(token), len(token), "false"))
+    value = false;
+  else
+    return false;
+  return true;
+  }
+
+/** Determine if a token is the 'null' primitive
+ */
+bool JsonParser::isNull(int token) {
+  if ((token < 0) || (token >= (int)m_toknext) || (m_pTokens[token].type != JsonPrimitive))
+    return false;
+  return IsLiteral(str(token), len(token), "null");
+  }
+
+/** Get the value of a hex digit
+ *
+ * @return the value or -1 if the character is not a hex digit.
+ */
+static int HexDigit(char c) {
+  if ((c >= '0') && (c <= '9'))
+    return c - '0';
+  if ((c >= 'a') && (c <= 'f'))
+    return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F'))
+    return c - 'A' + 10;
+  return -1;
+  }
+
+/** Decode the four hex digits of a \uXXXX escape
+ *
+ * @return the code unit or -1 if the digits are invalid.
+ */
+static long HexCode(const char *pChar, const char *pEnd) {
+  if ((pEnd - pChar) < 4)
+    return -1;
+  long code = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = HexDigit(pChar[i]);
+    if (digit < 0)
+      return -1;
+    code = (code << 4) | digit;
+    }
+  return code;
+  }
+
+/** Copy the value of a string with escape sequences decoded
+ *
+ * Escaped unicode characters are stored as UTF-8, surrogate pairs are
+ * combined. The result is always NUL terminated.
+ *
+ * @param token the index of the token.
+ * @param buffer the buffer to receive the string.
+ * @param size the size of the buffer (including the NUL terminator).
+ *
+ * @return the length of the string (excluding the NUL terminator) or -1 if
+ *         the token is not a string or primitive, contains an invalid escape
+ *         sequence or will not fit in the buffer.
+ */
+int JsonParser::unescape(int token, char *buffer, int size) {
+  const char *pChar = str(token);
+  if ((pChar == NULL) || (buffer == NULL) || (size <= 0))
+    return -1;
+  const char *pEnd = pChar + len(token);
+  int length = 0;
+  for (; pChar < pEnd; pChar++) {
+    // Copy runs of plain characters in one go
+    const char *pRun = pChar;
+    while ((pChar < pEnd) && (*pChar != '\\'))
+      pChar++;
+    if (pChar > pRun) {
+      if ((pChar - pRun) >= (size - length))
+        return -1;
+      memcpy(&buffer[length], pRun, pChar - pRun);
+      length += pChar - pRun;
+      if (pChar == pEnd)
+        break;
+      }
+    // Decode the escape sequence
+    if (++pChar == pEnd)
+      return -1;
+    long code;
+    switch (*pChar) {
+      case 'b': code = '\b'; break;
+      case 'f': code = '\f'; break;
+      case 'n': code = '\n'; break;
+      case 'r': code = '\r'; break;
+      case 't': code = '\t'; break;
+      case '\"': case '/': case '\\':
+        code = *pChar;
+        break;
+      case 'u':
+        code = HexCode(pChar + 1, pEnd);
+        if (code < 0)
+          return -1;
+        pChar += 4;
+        // Combine surrogate pairs
+        if ((code >= 0xD800) && (code <= 0xDBFF) && ((pEnd - pChar) > 6) && (pChar[1] == '\\') && (pChar[2] == 'u')) {
+          long low = HexCode(pChar + 3, pEnd);
+          if ((low >= 0xDC00) && (low <= 0xDFFF)) {
+            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            pChar += 6;
+            }
+          }
+        break;
+      default:
+        return -1;
+      }
+    // Store as UTF-8
+    char utf8[4];
+    int bytes = 0;
+    if (code < 0x80)
+      utf8[bytes++] = (char)code;
+    else if (code < 0x800) {
+      utf8[bytes++] = (char)(0xC0 | (code >> 6));
+      utf8[bytes++] = (char)(0x80 | (code & 0x3F));
+      }
+    else if (code < 0x10000) {
+      utf8[bytes++] = (char)(0xE0 | (code >> 12));
+      utf8[bytes++] = (char)(0x80 | ((code >> 6) & 0x3F));
+      utf8[bytes++] = (char)(0x80 | (code & 0x3F));
+      }
+    else {
+      utf8[bytes++] = (char)(0xF0 | (code >> 18));
+      utf8[bytes++] = (char)(0x80 | ((code >> 12) & 0x3F));
+      utf8[bytes++] = (char)(0x80 | ((code >> 6) & 0x3F));
+      utf8[bytes++] = (char)(0x80 | (code & 0x3F));
+      }
+    if (bytes >= (size - length))
+      return -1;
+    memcpy(&buffer[length], utf8, bytes);
+    length += bytes;
+    }
+  buffer[length] = '\0';
+  return length;
+  }
+
+/** Store the value of a token in a bound struct member
+ *
+ * @return true on success, false if the value is the wrong type or will not
+ *         fit.
+ */
+bool JsonParser::StoreField(int token, const JsonField *pField, void *pMember) {
+  switch (pField->type) {
+    case JsonFieldString: {
+      // Escape sequences never make the value longer
+      if ((str(token) == NULL) || (len(token) >= pField->size))
+        return false;
+      int length = unescape(token, (char *)pMember, pField->size);
+      if (length < 0)
+        return false;
+      memset((char *)pMember + length, 0, pField->size - length);
+      return true;
+      }
+    case JsonFieldInteger: {
+      long value;
+      if (!getInt(token, value))
+        return false;
+      if (pField->size == sizeof(int8_t)) {
+        int8_t member = (int8_t)value;
+        if (member != value)
+          return false;
+        memcpy(pMember, &member, sizeof(member));
+        }
+      else if (pField->size == sizeof(int16_t)) {
+        int16_t member = (int16_t)value;
+        if (member != value)
+          return false;
+        memcpy(pMember, &member, sizeof(member));
+        }
+      else if (pField->size == sizeof(int32_t)) {
+        int32_t member = (int32_t)value;
+        if (member != value)
+          return false;
+        memcpy(pMember, &member, sizeof(member));
+        }
+      else if (pField->size == sizeof(int64_t)) {
+        int64_t member = value;
+        memcpy(pMember, &member, sizeof(member));
+        }
+      else
+        return false;
+      return true;
+      }
+    case JsonFieldNumber: {
+      double value;
+      if (!getDouble(token, value))
+        return false;
+      if (pField->size == sizeof(float)) {
+        float member = (float)value;
+        memcpy(pMember, &member, sizeof(member));
+        }
+      else if (pField->size == sizeof(double))
+        memcpy(pMember, &value, sizeof(value));
+      else
+        return false;
+      return true;
+      }
+    case JsonFieldBoolean: {
+      bool value;
+      if ((pField->size != sizeof(bool)) || !getBool(token, value))
+        return false;
+      memcpy(pMember, &value, sizeof(value));
+      return true;
+      }
+    }
+  return false;
+  }
+
+/** Copy the fields of an object into a struct
+ *
+ * The object is walked once, each field name is hashed and matched against
+ * the (precalculated) hashes in the schema. Fields that are not in the
+ * schema are ignored and members that are not in the object are left
+ * unchanged.
+ *
+ * @param object the token index of the object.
+ * @param pSchema the schema describing the struct.
+ * @param pStruct the struct to update.
+ *
+ * @return the number of members updated or -1 if the object is invalid or
+ *         any value is of the wrong type or will not fit.
+ */
+int JsonParser::bind(int object, const JsonField *pSchema, void *pStruct) {
+  if ((object < 0) || (object >= (int)m_toknext) || (m_pTokens[object].type != JsonObject) || (pSchema == NULL))
+    return -1;
+  int updated = 0;
+  bool failed = false;
+  int key = object + 1;
+  for(int fields = 0; fields < m_pTokens[object].size; fields++, key = next(key)) {
+    if ((key < 0) || ((key + 1) >= (int)m_toknext))
+      return -1;
+    uint32_t hash = HashName(str(key), len(key));
+    for (const JsonField *pField = pSchema; pField->type != JsonFieldEnd; pField++) {
+      if ((pField->hash != hash) || !IsField(key, pField->name, strlen(pField->name)))
+        continue;
+      if (StoreField(key + 1, pField, (char *)pStruct + pField->offset))
+        updated++;
+      else
+        failed = true;
+      break;
+      }
+    }
+  return failed ? -1 : updated;
+  }
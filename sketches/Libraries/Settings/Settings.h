@@ -8,6 +8,8 @@
 #ifndef __SETTINGS_H
 #define __SETTINGS_H
 
+#include <stdint.h>
+
 /** Data types available for settings
  */
 typedef enum {
@@ -30,11 +32,24 @@ typedef enum {
   } SettingModifier;
 
 // Mask to extract setting modifiers
-#define SETTING_MODIFIER_MASK 0x80
+#define SETTING_MODIFIER_MASK 0xF0
 
 // Maximum length of a setting name
 #define MAX_SETTING_NAME_LENGTH 32
 
+// Marks a setting that is not present in the index
+#define NO_SETTING 0xFFFF
+
+// Maximum number of changes in a Settings::Transaction
+#ifndef SETTINGS_TRANSACTION_SIZE
+#  define SETTINGS_TRANSACTION_SIZE 32
+#endif
+
+// Maximum number of change subscriptions
+#ifndef SETTINGS_MAX_SUBSCRIBERS
+#  define SETTINGS_MAX_SUBSCRIBERS 8
+#endif
+
 /** Represents the value for a setting
  */
 typedef union {
@@ -52,12 +67,51 @@ typedef struct {
   SettingValue  value;            // The value of this setting
   } SettingDescription;
 
+/** Callback for changes to a setting
+ *
+ * String values are only valid until the settings are changed again.
+ *
+ * @param previous the setting with its old value.
+ * @param current the setting with its new value.
+ * @param pContext the context given when subscribing.
+ */
+typedef void (*PFN_SETTING_CHANGED)(const SettingDescription &previous, const SettingDescription &current, void *pContext);
+
+/** Reasons a value could not be imported from JSON
+ */
+typedef enum {
+  SettingUnknown   = 1, // There is no setting with that name
+  SettingReadOnly  = 2, // The setting cannot be written to
+  SettingWrongType = 3  // The value is of the wrong type or out of range
+  } SettingError;
+
+// Parser used for imports (see the Json library)
+class JsonParser;
+class JsonBuilder;
+
+/** Callback for values that could not be imported from JSON
+ *
+ * @param parser the parser containing the JSON.
+ * @param key the token for the name of the field.
+ * @param error the reason the value was not used.
+ * @param pContext the context given to Settings::fromJson().
+ */
+typedef void (*PFN_SETTING_ERROR)(JsonParser &parser, int key, SettingError error, void *pContext);
+
+/** A subscription to setting changes
+ */
+typedef struct {
+  int                 number;     // The setting (or -1 for all settings)
+  PFN_SETTING_CHANGED pfnChanged; // The function to call
+  void               *pContext;   // Passed to the function
+  } SettingSubscription;
+
 //---------------------------------------------------------------------------
 // Macros to build setting description table
 //---------------------------------------------------------------------------
 
 #define BEGIN_SETTINGS(name) \
-  SettingDescription name[] = {
+  constexpr SettingDescription name[] = {
 
 #define SETTING_STRING(name, flags, initval) \
   { name, StringSetting | flags, { string: initval } },
@@ -75,6 +129,288 @@ typedef struct {
   { "", EndOfSettings } \
   };
 
+//---------------------------------------------------------------------------
+// Compile time lookup of settings
+//---------------------------------------------------------------------------
+
+// These are deliberately not constexpr, using them while looking up a
+// setting at compile time generates an error with the function name.
+int SettingNameNotFound();
+int SettingTypeMismatch();
+
+/** Compare two names at compile time
+ */
+constexpr bool SettingNameEquals(const char *cszName1, const char *cszName2) {
+  return (*cszName1 == *cszName2) && ((*cszName1 == '\0') || SettingNameEquals(cszName1 + 1, cszName2 + 1));
+  }
+
+/** Find the number of a setting in a table at compile time
+ *
+ * @param table the settings description table.
+ * @param cszName the name of the setting.
+ * @param type the expected type of the setting.
+ * @param number the entry to start searching from.
+ *
+ * @return the position of the setting in the table.
+ */
+constexpr int SettingNumber(const SettingDescription *table, const char *cszName, int type, int number = 0) {
+  return (table[number].typeAndModifier == EndOfSettings) ? SettingNameNotFound()
+    : !SettingNameEquals(table[number].name, cszName) ? SettingNumber(table, cszName, type, number + 1)
+    : ((table[number].typeAndModifier & SETTING_TYPE_MASK) == type) ? number
+    : SettingTypeMismatch();
+  }
+
+/** Holds a compile time constant
+ */
+template<int VALUE>
+struct SettingConstant {
+  static const int value = VALUE;
+  };
+
+/** Mapping between C++ types and setting types
+ *
+ * Only the types with a specialisation can be used for settings.
+ */
+template<typename T>
+struct SettingTraits;
+
+template<>
+struct SettingTraits<const char *> {
+  static const int TYPE = StringSetting;
+  static const char *get(const SettingValue &value) { return value.string; }
+  static void put(SettingValue &value, const char *cszValue) { value.string = cszValue; }
+  };
+
+template<>
+struct SettingTraits<int> {
+  static const int TYPE = IntegerSetting;
+  static int get(const SettingValue &value) { return value.integer; }
+  static void put(SettingValue &value, int number) { value.integer = number; }
+  };
+
+template<>
+struct SettingTraits<bool> {
+  static const int TYPE = BooleanSetting;
+  static bool get(const SettingValue &value) { return value.boolean; }
+  static void put(SettingValue &value, bool flag) { value.boolean = flag; }
+  };
+
+template<>
+struct SettingTraits<double> {
+  static const int TYPE = NumberSetting;
+  static double get(const SettingValue &value) { return value.number; }
+  static void put(SettingValue &value, double number) { value.number = number; }
+  };
+
+/** The number of a setting along with its C++ type
+ *
+ * Made by SETTING_ID once the name and type have been checked, a Setting<T>
+ * only accepts an id of the same type.
+ */
+template<typename T>
+class SettingId {
+  private:
+    int m_number; // Position of the setting in the defaults table
+
+  public:
+    /** Constructor
+     *
+     * @param number the position of the setting in the defaults table.
+     */
+    explicit constexpr SettingId(int number) : m_number(number) {
+      }
+
+    /** Get the position of the setting in the defaults table
+     */
+    constexpr int number() const {
+      return m_number;
+      }
+  };
+
+/** Get the id of a setting, checking the name and type when compiling
+ *
+ * @param table the settings description table (from BEGIN_SETTINGS).
+ * @param type the C++ type of the setting (const char *, int, bool or
+ *             double).
+ * @param name the name of the setting.
+ */
+#define SETTING_ID(table, type, name) \
+  (SettingId<type>(SettingConstant<SettingNumber(table, name, SettingTraits<type>::TYPE)>::value))
+
+//---------------------------------------------------------------------------
+// Storage for saved settings
+//---------------------------------------------------------------------------
+
+/** Flash memory used to hold saved settings
+ *
+ * The storage is divided into sectors that can only be erased as a whole
+ * (setting every byte to 0xFF), writing can only clear bits. Writes always
+ * start at an offset that is a multiple of four, are a multiple of four
+ * bytes long and come from a buffer aligned to four bytes. Reads may be of
+ * any size and alignment.
+ */
+class SettingsStorage {
+  protected:
+    int m_sectorSize; // Size of each sector in bytes
+    int m_sectors;    // Number of sectors available
+
+  public:
+    /** Default constructor
+     */
+    SettingsStorage();
+
+    /** Destructor
+     */
+    virtual ~SettingsStorage();
+
+    /** Get the size of each sector in bytes
+     */
+    inline int getSectorSize() const {
+      return m_sectorSize;
+      }
+
+    /** Get the number of sectors available
+     */
+    inline int getSectors() const {
+      return m_sectors;
+      }
+
+    /** Erase a sector
+     *
+     * @return true on success.
+     */
+    virtual bool erase(int sector) = 0;
+
+    /** Write data to an erased part of a sector
+     *
+     * @return true on success.
+     */
+    virtual bool write(int sector, int offset, const void *pData, int length) = 0;
+
+    /** Read data from a sector
+     *
+     * @return true on success.
+     */
+    virtual bool read(int sector, int offset, void *pData, int length) = 0;
+  };
+
+/** Storage in RAM that simulates flash memory
+ *
+ * Keeps count of erase cycles and the time the same operations would take
+ * on a real flash chip so wear and save times can be measured on the host.
+ */
+class SettingsMemoryStorage : public SettingsStorage {
+  private:
+    unsigned char *m_pMemory;   // The simulated flash
+    uint32_t      *m_pErases;   // Number of times each sector was erased
+    uint32_t       m_eraseTime; // Time to erase a sector (microseconds)
+    uint32_t       m_pageTime;  // Time to program a page (microseconds)
+    uint32_t       m_written;   // Number of bytes written
+    uint64_t       m_elapsed;   // Simulated time used (microseconds)
+
+    // The erase counts are owned by the instance so it cannot be copied
+    SettingsMemoryStorage(const SettingsMemoryStorage &);
+    SettingsMemoryStorage &operator=(const SettingsMemoryStorage &);
+
+  public:
+    /** Constructor
+     *
+     * @param pMemory the memory to use, this should be erased (all 0xFF)
+     *                or hold the contents of an earlier session.
+     * @param sectorSize the size of each sector in bytes.
+     * @param sectors the number of sectors.
+     */
+    SettingsMemoryStorage(void *pMemory, int sectorSize, int sectors);
+
+    /** Destructor
+     */
+    virtual ~SettingsMemoryStorage();
+
+    /** Set the timing used to simulate the flash
+     *
+     * @param eraseTime the time to erase a sector (microseconds).
+     * @param pageTime the time to program a 256 byte page (microseconds).
+     */
+    void setTiming(uint32_t eraseTime, uint32_t pageTime);
+
+    /** Get the number of times a sector has been erased
+     */
+    uint32_t getErases(int sector) const;
+
+    /** Get the total number of bytes written
+     */
+    inline uint32_t getWritten() const {
+      return m_written;
+      }
+
+    /** Get the time the operations so far would take on a flash chip
+     *
+     * @return the simulated time in microseconds.
+     */
+    inline uint64_t getElapsed() const {
+      return m_elapsed;
+      }
+
+    /** Erase a sector
+     *
+     * @return true on success.
+     */
+    virtual bool erase(int sector);
+
+    /** Write data to an erased part of a sector
+     *
+     * @return true on success, false if the write would need to set bits
+     *         that are not erased.
+     */
+    virtual bool write(int sector, int offset, const void *pData, int length);
+
+    /** Read data from a sector
+     *
+     * @return true on success.
+     */
+    virtual bool read(int sector, int offset, void *pData, int length);
+  };
+
+#ifdef ARDUINO_ARCH_ESP8266
+
+/** Storage in the SPI flash of the ESP8266
+ *
+ * Uses a range of sectors that are not part of the sketch or file system
+ * (the sectors just before the EEPROM emulation for example).
+ */
+class SettingsFlashStorage : public SettingsStorage {
+  private:
+    uint32_t m_first; // Number of the first sector in the flash chip
+
+  public:
+    /** Constructor
+     *
+     * @param first the number of the first sector in the flash chip.
+     * @param sectors the number of sectors to use.
+     */
+    SettingsFlashStorage(uint32_t first, int sectors);
+
+    /** Erase a sector
+     *
+     * @return true on success.
+     */
+    virtual bool erase(int sector);
+
+    /** Write data to an erased part of a sector
+     *
+     * @return true on success.
+     */
+    virtual bool write(int sector, int offset, const void *pData, int length);
+
+    /** Read data from a sector
+     *
+     * @return true on success.
+     */
+    virtual bool read(int sector, int offset, void *pData, int length);
+  };
+
+#endif /* ARDUINO_ARCH_ESP8266 */
+
 //---------------------------------------------------------------------------
 // Settings management classes
 //---------------------------------------------------------------------------
@@ -83,14 +419,186 @@ typedef struct {
  */
 class Settings {
   private:
-    SettingDescription *m_pDefaults; // The default setting values
+    const SettingDescription *m_pDefaults; // The default setting values
     unsigned char      *m_pBuffer1; // The first half of the buffer
     unsigned char      *m_pBuffer2; // The second half of the buffer
     unsigned char      *m_pActive;  // Pointer to the active buffer
     int                 m_size;     // Size of each of the buffer halves
     int                 m_used;     // Number of bytes used
+    uint16_t           *m_pSlots;   // Hash table of setting numbers by name
+    uint16_t           *m_pOffsets; // Offset of each setting in the active buffer
+    int                 m_count;    // Number of entries in the defaults table
+    int                 m_slots;    // Number of hash slots (a power of two)
+    SettingsStorage    *m_pStorage; // Where settings are saved
+    uint16_t           *m_pStored;  // Offset of each setting in the log sector
+    int                 m_sector;   // Sector holding the current log
+    int                 m_next;     // Offset of the next record in the sector
+    uint32_t            m_sequence; // Last sequence number used in the log
+    uint16_t           *m_pDirty;   // Settings changed since the last save
+    SettingSubscription m_subscribers[SETTINGS_MAX_SUBSCRIBERS];
+    int                 m_subscriptions; // Number of subscribers
+
+    // The index is owned by the instance so it cannot be copied
+    Settings(const Settings &);
+    Settings &operator=(const Settings &);
+
+    /** Build the offsets of each setting in the active buffer
+     */
+    void updateOffsets();
+
+    /** Find a setting in the active buffer
+     *
+     * @param cszName the name of the setting to locate
+     * @param setting the SettingDescription structure to fill out
+     *
+     * @return the offset of the setting in the active buffer or -1 if no
+     *         setting of that name is present.
+     */
+    int locate(const char *cszName, SettingDescription &setting);
+
+    /** Determine if anyone is subscribed to changes of a setting
+     */
+    bool isSubscribed(int number);
+
+    /** Call the subscribers for a setting that has changed
+     */
+    void notify(int number, const SettingDescription &previous, const SettingDescription &current);
+
+    /** Mark every setting as changed after the active buffer is replaced
+     *
+     * @param pOld the previous active buffer.
+     * @param used the number of bytes used in the previous buffer.
+     */
+    void replaced(unsigned char *pOld, int used);
+
+    /** Get the position of a setting in the defaults table
+     *
+     * @return the number of the setting or -1 if it is not present (or
+     *         there is no index).
+     */
+    int lookup(const char *cszName);
+
+    /** Read a record from the log
+     *
+     * @param sector the sector containing the record.
+     * @param offset the offset of the record in the sector.
+     * @param kind receives the type of record.
+     * @param sequence receives the sequence number of the record.
+     * @param pBuffer the buffer for the payload (m_size bytes).
+     *
+     * @return the length of the payload, -1 if the record is not valid or
+     *         -2 if the log ends here.
+     */
+    int readRecord(int sector, int offset, int &kind, uint32_t &sequence, unsigned char *pBuffer);
+
+    /** Determine if a setting in the active buffer matches the log
+     *
+     * @param offset the offset of the setting in the active buffer.
+     * @param length the length of the packed setting.
+     * @param stored the offset of the setting in the log sector.
+     */
+    bool matchesLog(int offset, int length, int stored);
+
+    /** Read the newest settings in the log into the active buffer
+     *
+     * @return true on success.
+     */
+    bool readLog();
+
+    /** Add a record to the log
+     *
+     * A snapshot contains every setting and starts a new sector, a delta
+     * contains the settings that are not in the log and is added to the
+     * current sector.
+     *
+     * @return true on success.
+     */
+    bool writeRecord(int kind);
+
+    /** Change the value of a setting
+     *
+     * @param offset the offset of the setting in the active buffer.
+     * @param setting the setting to change (with the new value).
+     *
+     * @return true on success, false if the buffer is not large enough.
+     */
+    bool update(int offset, SettingDescription &setting);
+
+    /** Apply a set of changes (all of them or none)
+     *
+     * @param pChanges the names and new values of the settings.
+     * @param count the number of changes.
+     *
+     * @return true on success, false if a setting is missing or of the
+     *         wrong type or the buffer is not large enough.
+     */
+    bool apply(const SettingDescription *pChanges, int count);
 
   public:
+    /** A group of changes applied together
+     *
+     * Changes are collected and then applied by commit() in a single step,
+     * either in place or with one copy of the settings buffer however many
+     * values change. Names and string values must remain valid until the
+     * transaction is committed. Changes that are not committed are
+     * discarded.
+     */
+    class Transaction {
+      private:
+        Settings          &m_settings; // The settings to change
+        SettingDescription m_changes[SETTINGS_TRANSACTION_SIZE];
+        int                m_count;    // Number of changes collected
+
+        /** Add a change to the transaction
+         *
+         * @return true if the change was added, false if the setting does
+         *         not exist, is of the wrong type or the transaction is full.
+         */
+        bool stage(const char *cszName, int type, const SettingValue &value);
+
+      public:
+        /** Start a new set of changes
+         *
+         * @param settings the settings to change.
+         */
+        Transaction(Settings &settings);
+
+        /** Set the value of a string setting
+         *
+         * @return true if the change was added, false if the setting is of
+         *         the wrong type or the transaction is full.
+         */
+        bool setString(const char *cszName, const char *cszValue);
+
+        /** Set the value of an integer setting
+         *
+         * @return true if the change was added, false if the setting is of
+         *         the wrong type or the transaction is full.
+         */
+        bool setInteger(const char *cszName, int value);
+
+        /** Set the value of a numeric (floating point) setting
+         *
+         * @return true if the change was added, false if the setting is of
+         *         the wrong type or the transaction is full.
+         */
+        bool setNumber(const char *cszName, double value);
+
+        /** Set the value of a boolean setting
+         *
+         * @return true if the change was added, false if the setting is of
+         *         the wrong type or the transaction is full.
+         */
+        bool setBoolean(const char *cszName, bool value);
+
+        /** Apply all of the changes
+         *
+         * @return true on success, false if the buffer is not large enough
+         *         (in which case none of the changes are made).
+         */
+        bool commit();
+      };
+
     /** Initialise the settings.
      *
      * This method prepares the internal settings buffers, reads any valid
@@ -105,24 +613,113 @@ class Settings {
      *             used to store the active settings, the other half is used
      *             for applying modifications. The amount of data stored in
      *             the EEPROM will be size / 2 bytes.
+     * @param packDefaults false to leave the defaults unpacked because
+     *                     load() is called next, it only packs them if
+     *                     nothing could be loaded. This saves packing every
+     *                     setting twice at boot.
+     */
+    Settings(const SettingDescription *defaults, void *pBuffer, int size, bool packDefaults = true);
+
+    /** Destructor
+     */
+    ~Settings();
+
+    /** Set where settings are saved
+     *
+     * The storage is used as a log, each sector starts with a copy of all
+     * the settings and is followed by records of the changes made since. At
+     * least two sectors are needed for the settings to survive power loss
+     * while saving. Call load() afterwards to read the saved values.
+     *
+     * @param pStorage the storage to use or NULL for none.
+     *
+     * @return true on success, false if the storage sectors are too large.
      */
-    Settings(SettingDescription *defaults, void *pBuffer, int size);
+    bool setStorage(SettingsStorage *pStorage);
 
-    /** Save the current settings to EEPROM
+    /** Save the current settings
+     *
+     * Settings changed since the last save are added to the log. When
+     * the current sector is full a copy of all the settings is written to
+     * the next one, that is the only time a sector is erased.
      *
      * @return true on success
      */
     bool save();
 
-    /** Load settings from EEPROM
+    /** Load saved settings
      *
-     * This will load the settings from EEPROM (replacing the currently active
-     * settings).
+     * This will load the settings from storage (replacing the currently
+     * active settings). Saved settings that are no longer in the defaults
+     * table are dropped and new settings get their default values. A log
+     * written with the same table is used as it is. If the defaults were
+     * not packed by the constructor they are used when nothing is loaded.
      *
      * @return true on success
      */
     bool load();
 
+    /** Subscribe to changes
+     *
+     * The function is called after a setting is given a different value by
+     * one of the set methods, a transaction or reset(). Settings replaced by
+     * load() are not reported.
+     *
+     * @param cszName the name of the setting or NULL for all settings.
+     * @param pfnChanged the function to call.
+     * @param pContext a value to pass to the function.
+     *
+     * @return true on success, false if the setting does not exist, there
+     *         are too many subscribers or there was not enough memory for
+     *         the index.
+     */
+    bool subscribe(const char *cszName, PFN_SETTING_CHANGED pfnChanged, void *pContext = NULL);
+
+    /** Remove subscriptions
+     *
+     * @param pfnChanged the function given when subscribing.
+     * @param pContext the context given when subscribing.
+     */
+    void unsubscribe(PFN_SETTING_CHANGED pfnChanged, void *pContext = NULL);
+
+    /** Determine if a setting has changed since it was last saved (or
+     *  loaded)
+     *
+     * @param cszName the name of the setting.
+     */
+    bool isDirty(const char *cszName);
+
+    /** Add the settings to a JSON object
+     *
+     * Every setting except those marked with HiddenSetting is added to the
+     * current object of the builder.
+     *
+     * @param builder the builder to add the settings to.
+     *
+     * @return true on success, false if the output is full.
+     */
+    bool toJson(JsonBuilder &builder);
+
+    /** Change settings to the values in a JSON object
+     *
+     * The object is walked once and all of the values are applied with a
+     * single copy of the settings buffer. Fields that do not match a
+     * setting, are for a setting marked with ReadOnlySetting or have a value
+     * of the wrong type are reported and skipped, the other values are still
+     * used.
+     *
+     * @param parser the parser containing the JSON.
+     * @param object the token for the object.
+     * @param pfnError function to call for each field that is not used (may
+     *                 be NULL). It must not change the settings.
+     * @param pContext a value to pass to the function.
+     *
+     * @return the number of settings changed or -1 if the object is not
+     *         valid or the buffer is not large enough (in which case no
+     *         settings are changed).
+     */
+    int fromJson(JsonParser &parser, int object, PFN_SETTING_ERROR pfnError = NULL, void *pContext = NULL);
+
     /** Reset to default values
      *
      * Resets the current settings to default values
@@ -208,6 +805,73 @@ class Settings {
      *         or the buffer is not large enough to contain the new value.
      */
     bool setBoolean(const char *cszName, bool value);
+
+    /** Get the value of a setting by number
+     *
+     * @param number the position of the setting in the defaults table.
+     *
+     * @return the current value of the setting or the default value if it
+     *         is not present or has the wrong type.
+     */
+    SettingValue getValue(int number);
+
+    /** Set the value of a setting by number
+     *
+     * @param number the position of the setting in the defaults table.
+     * @param value the new value for the setting (of the type given in the
+     *              defaults table).
+     *
+     * @return true on success, false if the setting is not present or the
+     *         buffer is not large enough to contain the new value.
+     */
+    bool setValue(int number, const SettingValue &value);
+  };
+
+/** Typed handle for a single setting
+ *
+ * The setting is identified by its position in the defaults table so no
+ * names are compared when it is used. Handles are created from a SETTING_ID
+ * so the name and type are checked by the compiler:
+ *
+ *   Setting<int> mqttPort(settings, SETTING_ID(DEFAULTS, int, "port"));
+ */
+template<typename T>
+class Setting {
+  private:
+    Settings &m_settings; // The settings containing the value
+    int       m_number;   // Position of the setting in the defaults table
+
+  public:
+    /** Constructor
+     *
+     * @param settings the settings containing the value.
+     * @param id the setting (from SETTING_ID with the same type).
+     */
+    Setting(Settings &settings, SettingId<T> id) : m_settings(settings), m_number(id.number()) {
+      }
+
+    /** Get the current value
+     */
+    inline T get() const {
+      return SettingTraits<T>::get(m_settings.getValue(m_number));
+      }
+
+    /** Change the value
+     *
+     * @return true on success, false if the buffer is not large enough to
+     *         contain the new value.
+     */
+    inline bool set(T value) {
+      SettingValue setting;
+      SettingTraits<T>::put(setting, value);
+      return m_settings.setValue(m_number, setting);
+      }
+
+    /** Get the current value
+     */
+    inline operator T() const {
+      return get();
+      }
   };
 
 #endif /* __SETTINGS_H */
@@ -9,13 +9,179 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <math.h>
+#include <limits.h>
 #include <TGL.h>
+#include <Json.h>
 #include "Settings.h"
 
+//---------------------------------------------------------------------------
+// Saved settings log
+//
+// Each sector starts with a snapshot of all the settings followed by deltas
+// holding the settings changed since. Every record starts with a header:
+//
+//   0  uint16 magic
+//   2  uint8  kind (snapshot or delta)
+//   3  uint8  format version
+//   4  uint32 sequence number
+//   8  uint16 length of the payload
+//  10  uint16 CRC of the payload followed by header bytes 0 to 9
+//
+// Header values are little endian. The payload is a sequence of packed
+// settings padded with 0xFF to a multiple of four bytes.
+//
+// A packed setting is the type byte, the name and the value. Strings are a
+// length byte (characters + 2), the characters and a NUL. Integers are 32
+// bits and numbers are IEEE 754 doubles, both little endian. Booleans are a
+// single byte. The same image can be used on any platform.
+//---------------------------------------------------------------------------
+
+#define LOG_MAGIC       0x4c53
+#define LOG_VERSION     2
+#define LOG_SNAPSHOT    1
+#define LOG_DELTA       2
+#define LOG_HEADER_SIZE 12
+#define LOG_BLOCK_SIZE  64
+
+// Results from Settings::readRecord()
+#define LOG_INVALID     -1
+#define LOG_END         -2
+
+// Round a length up to a whole number of words
+#define LOG_ALIGN(length) (((length) + 3) & ~3)
+
+// Size of packed values
+#define PACKED_INTEGER_SIZE 4
+#define PACKED_NUMBER_SIZE  8
+#define PACKED_BOOLEAN_SIZE 1
+
 //---------------------------------------------------------------------------
 // Helper functions
 //---------------------------------------------------------------------------
 
+/** Store a 16 bit value (little endian)
+ */
+static void put16(unsigned char *pBuffer, uint16_t value) {
+  pBuffer[0] = value & 0xFF;
+  pBuffer[1] = value >> 8;
+  }
+
+/** Store a 32 bit value (little endian)
+ */
+static void put32(unsigned char *pBuffer, uint32_t value) {
+  put16(pBuffer, value & 0xFFFF);
+  put16(&pBuffer[2], value >> 16);
+  }
+
+/** Fetch a 16 bit value (little endian)
+ */
+static uint16_t get16(const unsigned char *pBuffer) {
+  return pBuffer[0] | (pBuffer[1] << 8);
+  }
+
+/** Fetch a 32 bit value (little endian)
+ */
+static uint32_t get32(const unsigned char *pBuffer) {
+  return get16(pBuffer) | ((uint32_t)get16(&pBuffer[2]) << 16);
+  }
+
+/** Compare log sequence numbers, allowing for them wrapping around
+ *
+ * @return true if sequence1 was written after sequence2.
+ */
+static bool isLater(uint32_t sequence1, uint32_t sequence2) {
+  return (int32_t)(sequence1 - sequence2) > 0;
+  }
+
+/** Get the IEEE 754 double precision representation of a number
+ */
+static uint64_t numberBits(double value) {
+#if __SIZEOF_DOUBLE__ == 8
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return bits;
+#else
+  // Doubles are single precision (AVR) so build the representation
+  uint64_t sign = signbit(value) ? 0x8000000000000000ull : 0;
+  if(isnan(value))
+    return 0x7ff8000000000000ull;
+  if(isinf(value))
+    return sign | 0x7ff0000000000000ull;
+  if(value == 0)
+    return sign;
+  int exponent;
+  double mantissa = frexp(fabs(value), &exponent); // In [0.5, 1)
+  return sign | ((uint64_t)(exponent + 1022) << 52) | (uint64_t)ldexp((mantissa * 2) - 1, 52);
+#endif
+  }
+
+/** Get a number from its IEEE 754 double precision representation
+ */
+static double bitsNumber(uint64_t bits) {
+#if __SIZEOF_DOUBLE__ == 8
+  double value;
+  memcpy(&value, &bits, sizeof(value));
+  return value;
+#else
+  int exponent = (bits >> 52) & 0x7ff;
+  uint64_t fraction = bits & 0x000fffffffffffffull;
+  double value;
+  if(exponent == 0x7ff)
+    value = (fraction != 0) ? NAN : INFINITY;
+  else if(exponent == 0)
+    value = 0; // Too small for single precision
+  else
+    value = ldexp(1 + ldexp((double)fraction, -52), exponent - 1023);
+  return (bits >> 63) ? -value : value;
+#endif
+  }
+
+/** Test a bit in a set of flags
+ */
+static bool getBit(const uint16_t *pBits, int bit) {
+  return (pBits[bit / 16] & (1 << (bit % 16))) != 0;
+  }
+
+/** Set a bit in a set of flags
+ */
+static void setBit(uint16_t *pBits, int bit) {
+  pBits[bit / 16] |= (1 << (bit % 16));
+  }
+
+/** Determine if two settings of the same type have the same value
+ */
+static bool sameValue(const SettingDescription &setting1, const SettingDescription &setting2) {
+  switch(setting1.typeAndModifier & SETTING_TYPE_MASK) {
+    case StringSetting:
+      return strcmp(setting1.value.string, setting2.value.string) == 0;
+    case IntegerSetting:
+      return setting1.value.integer == setting2.value.integer;
+    case BooleanSetting:
+      return setting1.value.boolean == setting2.value.boolean;
+    case NumberSetting:
+      return setting1.value.number == setting2.value.number;
+    }
+  return false;
+  }
+
+/** Determine if a change is the last one for its setting in a list
+ */
+static bool lastChange(const SettingDescription *pChanges, int count, int index) {
+  for(int i=index + 1; i<count; i++) {
+    if (strcmp(pChanges[index].name, pChanges[i].name) == 0)
+      return false;
+    }
+  return true;
+  }
+
+/** Create the CRC used for log records
+ */
+static Crc16 logCrc() {
+  // CCITT-False parameters so erased or zeroed data does not pass
+  return Crc16(false, false, 0x1021, 0xffff, 0x0000, 0x8000, 0xffff);
+  }
+
 /** Pack an integer value into the buffer
  *
  * @param pBuffer pointer to the buffer to pack into
@@ -27,10 +193,10 @@
  *         buffer is full.
  */
 static int packInteger(unsigned char *pBuffer, int index, int size, int value) {
-  if((index + sizeof(int)) >= size)
+  if((index + PACKED_INTEGER_SIZE) >= size)
     return 0;
-  *((int *)&pBuffer[index]) = value;
-  return index + sizeof(int);
+  put32(&pBuffer[index], (uint32_t)(int32_t)value);
+  return index + PACKED_INTEGER_SIZE;
   }
 
 /** Pack an numeric (floating point) value into the buffer
@@ -44,10 +210,12 @@ static int packInteger(unsigned char *pBuffer, int index, int size, int value) {
  *         buffer is full.
  */
 static int packDouble(unsigned char *pBuffer, int index, int size, double value) {
-  if((index + sizeof(double)) >= size)
+  if((index + PACKED_NUMBER_SIZE) >= size)
     return 0;
-  *((double *)&pBuffer[index]) = value;
-  return index + sizeof(double);
+  uint64_t bits = numberBits(value);
+  put32(&pBuffer[index], (uint32_t)bits);
+  put32(&pBuffer[index + 4], (uint32_t)(bits >> 32));
+  return index + PACKED_NUMBER_SIZE;
   }
 
 /** Pack a boolean value into the buffer
@@ -61,10 +229,10 @@ static int packDouble(unsigned char *pBuffer, int index, int size, double value)
  *         buffer is full.
  */
 static int packBoolean(unsigned char *pBuffer, int index, int size, bool value) {
-  if((index + sizeof(bool)) >= size)
+  if((index + PACKED_BOOLEAN_SIZE) >= size)
     return 0;
-  *((bool *)&pBuffer[index]) = value;
-  return index + sizeof(bool);
+  pBuffer[index] = value ? 1 : 0;
+  return index + PACKED_BOOLEAN_SIZE;
   }
 
 /** Pack a string value into the buffer
@@ -87,9 +255,33 @@ static int packString(unsigned char *pBuffer, int index, int size, const char *v
   return index;
   }
 
+/** Pack the value of a setting into the buffer
+ *
+ * @param pBuffer pointer to the buffer to pack into
+ * @param index the starting index to write data
+ * @param size the size of the buffer
+ * @param setting the setting containing the type and value
+ *
+ * @return the new index after the data has been written or 0 if the
+ *         buffer is full.
+ */
+static int packValue(unsigned char *pBuffer, int index, int size, const SettingDescription &setting) {
+  switch(setting.typeAndModifier & SETTING_TYPE_MASK) {
+    case StringSetting:
+      return packString(pBuffer, index, size, setting.value.string);
+    case IntegerSetting:
+      return packInteger(pBuffer, index, size, setting.value.integer);
+    case BooleanSetting:
+      return packBoolean(pBuffer, index, size, setting.value.boolean);
+    case NumberSetting:
+      return packDouble(pBuffer, index, size, setting.value.number);
+    }
+  return 0;
+  }
+
 /** Pack an entire setting description into the buffer
  */
-static int packSetting(unsigned char *pBuffer, int index, int size, SettingDescription &setting) {
+static int packSetting(unsigned char *pBuffer, int index, int size, const SettingDescription &setting) {
   if (index>=size)
     return 0;
   // 1 byte for type
@@ -98,23 +290,33 @@ static int packSetting(unsigned char *pBuffer, int index, int size, SettingDescr
   if ((index=packString(pBuffer, index, size, setting.name))<=0)
     return index;
   // And the value itself
-  switch(setting.typeAndModifier & SETTING_TYPE_MASK) {
-    case StringSetting:
-      index = packString(pBuffer, index, size, setting.value.string);
-      break;
-    case IntegerSetting:
-      index = packInteger(pBuffer, index, size, setting.value.integer);
-      break;
-    case BooleanSetting:
-      index = packBoolean(pBuffer, index, size, setting.value.boolean);
-      break;
-    case NumberSetting:
-      index = packDouble(pBuffer, index, size, setting.value.number);
-      break;
-    default:
-      index = 0;
-    }
-  return index;
+  return packValue(pBuffer, index, size, setting);
+  }
+
+/** Determine if a new value packs to the same size as the current one
+ *
+ * Only strings can change size.
+ *
+ * @param pBuffer the buffer containing the setting
+ * @param offset the offset of the setting in the buffer
+ * @param setting the setting with the new value
+ */
+static bool sameSize(unsigned char *pBuffer, int offset, const SettingDescription &setting) {
+  if ((setting.typeAndModifier & SETTING_TYPE_MASK) != StringSetting)
+    return true;
+  // The value follows the type byte and name
+  int index = offset + 1 + pBuffer[offset + 1];
+  return pBuffer[index] == (strlen(setting.value.string) + 2);
+  }
+
+/** Replace the value of a setting without moving anything in the buffer
+ *
+ * The new value must be the same size as the old one (see sameSize()).
+ *
+ * @return the index after the value or 0 if an error occurs.
+ */
+static int packInPlace(unsigned char *pBuffer, int offset, int size, const SettingDescription &setting) {
+  return packValue(pBuffer, offset + 1 + pBuffer[offset + 1], size, setting);
   }
 
 /** Unpack an integer from the buffer at the given index
@@ -127,10 +329,10 @@ static int packSetting(unsigned char *pBuffer, int index, int size, SettingDescr
  * @return the new index for the next piece of data or 0 if an error occurs.
  */
 static int unpackInteger(unsigned char *pBuffer, int index, int size, int &value) {
-  if((index + sizeof(int)) >= size)
+  if((index + PACKED_INTEGER_SIZE) >= size)
     return 0;
-  value = *((int *)&pBuffer[index]);
-  return index + sizeof(int);
+  value = (int32_t)get32(&pBuffer[index]);
+  return index + PACKED_INTEGER_SIZE;
   }
 
 /** Unpack a number from the buffer at the given index
@@ -143,10 +345,10 @@ static int unpackInteger(unsigned char *pBuffer, int index, int size, int &value
  * @return the new index for the next piece of data or 0 if an error occurs.
  */
 static int unpackDouble(unsigned char *pBuffer, int index, int size, double &value) {
-  if((index + sizeof(double)) >= size)
+  if((index + PACKED_NUMBER_SIZE) >= size)
     return 0;
-  value = *((double *)&pBuffer[index]);
-  return index + sizeof(double);
+  value = bitsNumber(get32(&pBuffer[index]) | ((uint64_t)get32(&pBuffer[index + 4]) << 32));
+  return index + PACKED_NUMBER_SIZE;
   }
 
 /** Unpack a boolean from the buffer at the given index
@@ -159,10 +361,10 @@ static int unpackDouble(unsigned char *pBuffer, int index, int size, double &val
  * @return the new index for the next piece of data or 0 if an error occurs.
  */
 static int unpackBoolean(unsigned char *pBuffer, int index, int size, bool &value) {
-  if((index + sizeof(bool)) >= size)
+  if((index + PACKED_BOOLEAN_SIZE) >= size)
     return 0;
-  value = *((bool *)&pBuffer[index]);
-  return index + sizeof(bool);
+  value = (pBuffer[index] != 0);
+  return index + PACKED_BOOLEAN_SIZE;
   }
 
 /** Unpack a string from the buffer at the given index
@@ -179,12 +381,36 @@ static int unpackString(unsigned char *pBuffer, int index, int size, const char
     return 0;
   // Get the length (Characters + NUL + length byte)
   int len = pBuffer[index];
-  if ((index + len) >= size)
+  if ((len < 2) || ((index + len) >= size) || (pBuffer[index + len - 1] != 0))
     return 0;
   *ppValue = (const char *)&pBuffer[index + 1];
   return index + len;
   }
 
+/** Unpack the value of a setting from the buffer
+ *
+ * @param pBuffer the buffer to unpack from
+ * @param index the index in the buffer to start at
+ * @param size the size of the buffer in bytes
+ * @param type the type of the value
+ * @param value the union to hold the value
+ *
+ * @return the new index for the next piece of data or 0 if an error occurs.
+ */
+static int unpackValue(unsigned char *pBuffer, int index, int size, int type, SettingValue &value) {
+  switch(type) {
+    case StringSetting:
+      return unpackString(pBuffer, index, size, &value.string);
+    case IntegerSetting:
+      return unpackInteger(pBuffer, index, size, value.integer);
+    case BooleanSetting:
+      return unpackBoolean(pBuffer, index, size, value.boolean);
+    case NumberSetting:
+      return unpackDouble(pBuffer, index, size, value.number);
+    }
+  return 0;
+  }
+
 /** Unpack an entire setting description from the buffer
  *
  * @param pBuffer the buffer to unpack from
@@ -203,28 +429,22 @@ static int unpackSetting(unsigned char *pBuffer, int index, int size, SettingDes
   if ((index=unpackString(pBuffer, index, size, &setting.name))<=0)
     return index;
   // And the value itself
-  switch(setting.typeAndModifier & SETTING_TYPE_MASK) {
-    case StringSetting:
-      index = unpackString(pBuffer, index, size, &setting.value.string);
-      break;
-    case IntegerSetting:
-      index = unpackInteger(pBuffer, index, size, setting.value.integer);
-      break;
-    case BooleanSetting:
-      index = unpackBoolean(pBuffer, index, size, setting.value.boolean);
-      break;
-    case NumberSetting:
-      index = unpackDouble(pBuffer, index, size, setting.value.number);
-      break;
-    default:
-      index = 0;
-    }
-  return index;
+  return unpackValue(pBuffer, index, size, setting.typeAndModifier & SETTING_TYPE_MASK, setting.value);
+  }
+
+/** Calculate the FNV-1a hash of a setting name
+ */
+static uint32_t hashName(const char *cszName) {
+  uint32_t hash = 2166136261u;
+  while(*cszName)
+    hash = (hash ^ (uint8_t)*cszName++) * 16777619u;
+  return hash;
   }
 
 /** Find a setting by name
  *
  * @param pBuffer the buffer to search in
+ * @param used the number of bytes of settings in the buffer
  * @param size the size of the buffer in bytes
  * @param cszName the name of the setting to locate
  * @param setting the SettingDescription structure to fill out
@@ -232,9 +452,9 @@ static int unpackSetting(unsigned char *pBuffer, int index, int size, SettingDes
  * @return the index into the buffer where the setting was found or -1 if no
  *         setting of that name is present.
  */
-static int findSetting(unsigned char *pBuffer, int size, const char *cszName, SettingDescription &setting) {
+static int findSetting(unsigned char *pBuffer, int used, int size, const char *cszName, SettingDescription &setting) {
   int prev = 0, index = 0;
-  while ((index = unpackSetting(pBuffer, index, size, setting))>0) {
+  while ((index < used) && ((index = unpackSetting(pBuffer, index, size, setting))>0)) {
     if(strcmp(cszName, setting.name)==0)
       return prev;
     prev = index;
@@ -242,23 +462,30 @@ static int findSetting(unsigned char *pBuffer, int size, const char *cszName, Se
   return -1;
   }
 
-/** Clone the primary buffer into the secondary one with a new value
+/** Clone the primary buffer into the secondary one with new values
+ *
+ * If a setting is changed more than once the last change is used.
  *
  * @param pActive pointer to the active buffer
  * @param pBackup pointer to the secondary buffer
+ * @param used the number of bytes of settings in the active buffer
  * @param size size of the buffers
- * @param setting the new value for the named setting
+ * @param pChanges the new values for the named settings
+ * @param count the number of changes
  *
  * @return the size of the new buffer or 0 if an error occured
  */
-static int cloneWithChange(unsigned char *pActive, unsigned char *pBackup, int size, SettingDescription &setting) {
+static int cloneWithChanges(unsigned char *pActive, unsigned char *pBackup, int used, int size, const SettingDescription *pChanges, int count) {
   SettingDescription current;
   int src = 0, dst = 0;
-  while ((src = unpackSetting(pActive, src, size, current))!=0) {
-    if (strcmp(current.name, setting.name) == 0)
-      dst = packSetting(pBackup, dst, size, setting);
-    else
-      dst = packSetting(pBackup, dst, size, current);
+  while ((src < used) && ((src = unpackSetting(pActive, src, size, current))!=0)) {
+    for(int i=count - 1; i>=0; i--) {
+      if (strcmp(current.name, pChanges[i].name) == 0) {
+        current.value = pChanges[i].value;
+        break;
+        }
+      }
+    dst = packSetting(pBackup, dst, size, current);
     // Did we have enough room ?
     if (dst==0)
       return 0;
@@ -290,8 +517,9 @@ static unsigned char *getInactive(unsigned char *p1, unsigned char *p2, unsigned
  *             used to store the active settings, the other half is used
  *             for applying modifications. The amount of data stored in
  *             the EEPROM will be size / 2 bytes.
+ * @param packDefaults false to leave the defaults unpacked until load().
  */
-Settings::Settings(SettingDescription *defaults, void *pBuffer, int size) {
+Settings::Settings(const SettingDescription *defaults, void *pBuffer, int size, bool packDefaults) {
   // Set up state
   m_used = 0;
   m_size = size / 2;
@@ -299,29 +527,587 @@ Settings::Settings(SettingDescription *defaults, void *pBuffer, int size) {
   m_pBuffer2 = &m_pBuffer1[m_size];
   m_pActive = m_pBuffer1;
   m_pDefaults = defaults;
-  // Start with default values
-  reset(); // Just use defaults
+  // Build a hash table of the setting names (at most half full)
+  for(m_count = 0; m_pDefaults[m_count].typeAndModifier != EndOfSettings; m_count++);
+  for(m_slots = 4; m_slots < (m_count * 2); m_slots *= 2);
+  m_pSlots = NULL;
+  m_pOffsets = NULL;
+  m_pStored = NULL;
+  m_pStorage = NULL;
+  m_sector = -1;
+  m_next = 0;
+  m_sequence = 0;
+  m_pDirty = NULL;
+  m_subscriptions = 0;
+  int words = (m_count + 15) / 16;
+  if((m_count < NO_SETTING) && (m_size < NO_SETTING))
+    m_pSlots = (uint16_t *)malloc((m_slots + (2 * m_count) + words) * sizeof(uint16_t));
+  if(m_pSlots != NULL) {
+    m_pOffsets = &m_pSlots[m_slots];
+    m_pStored = &m_pOffsets[m_count];
+    m_pDirty = &m_pStored[m_count];
+    for(int i=0; i<m_count; i++)
+      m_pStored[i] = NO_SETTING;
+    for(int i=0; i<m_slots; i++)
+      m_pSlots[i] = NO_SETTING;
+    for(int i=0; i<m_count; i++) {
+      int slot = hashName(m_pDefaults[i].name) & (m_slots - 1);
+      while(m_pSlots[slot] != NO_SETTING)
+        slot = (slot + 1) & (m_slots - 1);
+      m_pSlots[slot] = i;
+      }
+    }
+  else {
+    DMSG("Not enough memory for the index, using linear search");
+    }
+  // Start with default values (unless load() will replace them)
+  if(packDefaults)
+    reset();
+  }
+
+/** Destructor
+ */
+Settings::~Settings() {
+  free(m_pSlots);
+  }
+
+/** Build the offsets of each setting in the active buffer
+ *
+ * This is called whenever the active buffer changes. Settings that are not
+ * present in the buffer (or not in the defaults table) are not indexed.
+ */
+void Settings::updateOffsets() {
+  if(m_pSlots == NULL)
+    return;
+  for(int i=0; i<m_count; i++)
+    m_pOffsets[i] = NO_SETTING;
+  SettingDescription setting;
+  int index = 0, next;
+  while((index < m_used) && ((next = unpackSetting(m_pActive, index, m_size, setting)) > 0)) {
+    int number = lookup(setting.name);
+    if(number >= 0)
+      m_pOffsets[number] = index;
+    index = next;
+    }
+  }
+
+/** Get the position of a setting in the defaults table
+ *
+ * @param cszName the name of the setting.
+ *
+ * @return the number of the setting or -1 if it is not present (or there is
+ *         no index).
+ */
+int Settings::lookup(const char *cszName) {
+  if(m_pSlots == NULL)
+    return -1;
+  int slot = hashName(cszName) & (m_slots - 1);
+  for(; m_pSlots[slot] != NO_SETTING; slot = (slot + 1) & (m_slots - 1)) {
+    if(strcmp(m_pDefaults[m_pSlots[slot]].name, cszName) == 0)
+      return m_pSlots[slot];
+    }
+  return -1;
+  }
+
+/** Find a setting in the active buffer
+ *
+ * Uses the index if it is available, otherwise the buffer is searched.
+ *
+ * @param cszName the name of the setting to locate
+ * @param setting the SettingDescription structure to fill out
+ *
+ * @return the offset of the setting in the active buffer or -1 if no
+ *         setting of that name is present.
+ */
+int Settings::locate(const char *cszName, SettingDescription &setting) {
+  if(m_pSlots == NULL)
+    return findSetting(m_pActive, m_used, m_size, cszName, setting);
+  int number = lookup(cszName);
+  if((number < 0) || (m_pOffsets[number] == NO_SETTING) || (unpackSetting(m_pActive, m_pOffsets[number], m_size, setting) <= 0))
+    return -1;
+  return m_pOffsets[number];
   }
 
-/** Save the current settings to EEPROM
+/** Change the value of a setting
+ *
+ * Values that are the same size as the current one are replaced in the
+ * active buffer. Otherwise a new copy of the buffer is made, only the size
+ * of the changed setting differs so the settings after it are moved by the
+ * same amount.
+ *
+ * @param offset the offset of the setting in the active buffer.
+ * @param setting the setting to change (with the new value).
+ *
+ * @return true on success, false if the buffer is not large enough.
+ */
+bool Settings::update(int offset, SettingDescription &setting) {
+  SettingDescription previous;
+  if (unpackSetting(m_pActive, offset, m_size, previous)<=0)
+    return false;
+  if (sameValue(previous, setting))
+    return true;
+  int number = lookup(setting.name);
+  bool subscribed = (number>=0) && isSubscribed(number);
+  // Subscribers get the old string so it must not be overwritten
+  if (sameSize(m_pActive, offset, setting) && !(subscribed && ((setting.typeAndModifier & SETTING_TYPE_MASK) == StringSetting))) {
+    if (packInPlace(m_pActive, offset, m_size, setting)<=0)
+      return false;
+    }
+  else {
+    unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
+    int result = cloneWithChanges(m_pActive, pBackup, m_used, m_size, &setting, 1);
+    if (result<=0)
+      return false;
+    if (m_pSlots != NULL) {
+      int delta = result - m_used;
+      for(int i=0; i<m_count; i++) {
+        if ((m_pOffsets[i] != NO_SETTING) && (m_pOffsets[i] > offset))
+          m_pOffsets[i] += delta;
+        }
+      }
+    m_pActive = pBackup;
+    m_used = result;
+    }
+  if (number>=0) {
+    setBit(m_pDirty, number);
+    if (subscribed)
+      notify(number, previous, setting);
+    }
+  return true;
+  }
+
+/** Determine if anyone is subscribed to changes of a setting
+ */
+bool Settings::isSubscribed(int number) {
+  for(int i=0; i<m_subscriptions; i++) {
+    if ((m_subscribers[i].number<0)||(m_subscribers[i].number==number))
+      return true;
+    }
+  return false;
+  }
+
+/** Call the subscribers for a setting that has changed
+ *
+ * @param number the position of the setting in the defaults table.
+ * @param previous the setting with the old value.
+ * @param current the setting with the new value.
+ */
+void Settings::notify(int number, const SettingDescription &previous, const SettingDescription &current) {
+  for(int i=0; i<m_subscriptions; i++) {
+    if ((m_subscribers[i].number<0)||(m_subscribers[i].number==number))
+      (*m_subscribers[i].pfnChanged)(previous, current, m_subscribers[i].pContext);
+    }
+  }
+
+/** Mark every setting as changed after the active buffer is replaced
+ *
+ * Subscribers are told about the settings that have a different value to
+ * the one in the previous buffer.
+ *
+ * @param pOld the previous active buffer.
+ * @param used the number of bytes used in the previous buffer.
+ */
+void Settings::replaced(unsigned char *pOld, int used) {
+  if (m_pDirty == NULL)
+    return;
+  for(int i=0; i<m_count; i++)
+    setBit(m_pDirty, i);
+  SettingDescription previous, current;
+  for(int i=0; (m_subscriptions>0) && (i<m_count); i++) {
+    if (!isSubscribed(i) || (locate(m_pDefaults[i].name, current)<0))
+      continue;
+    if (findSetting(pOld, used, m_size, current.name, previous)<0)
+      continue;
+    if (((previous.typeAndModifier & SETTING_TYPE_MASK) == (current.typeAndModifier & SETTING_TYPE_MASK)) && !sameValue(previous, current))
+      notify(i, previous, current);
+    }
+  }
+
+/** Subscribe to changes
+ *
+ * @param cszName the name of the setting or NULL for all settings.
+ * @param pfnChanged the function to call.
+ * @param pContext a value to pass to the function.
+ *
+ * @return true on success, false if the setting does not exist, there are
+ *         too many subscribers or there was not enough memory for the index.
+ */
+bool Settings::subscribe(const char *cszName, PFN_SETTING_CHANGED pfnChanged, void *pContext) {
+  int number = (cszName == NULL) ? -1 : lookup(cszName);
+  if ((m_pSlots == NULL) || (pfnChanged == NULL) || ((cszName != NULL) && (number < 0)) || (m_subscriptions >= SETTINGS_MAX_SUBSCRIBERS))
+    return false;
+  m_subscribers[m_subscriptions].number = number;
+  m_subscribers[m_subscriptions].pfnChanged = pfnChanged;
+  m_subscribers[m_subscriptions].pContext = pContext;
+  m_subscriptions++;
+  return true;
+  }
+
+/** Remove subscriptions
+ *
+ * @param pfnChanged the function given when subscribing.
+ * @param pContext the context given when subscribing.
+ */
+void Settings::unsubscribe(PFN_SETTING_CHANGED pfnChanged, void *pContext) {
+  int count = 0;
+  for(int i=0; i<m_subscriptions; i++) {
+    if ((m_subscribers[i].pfnChanged != pfnChanged) || (m_subscribers[i].pContext != pContext))
+      m_subscribers[count++] = m_subscribers[i];
+    }
+  m_subscriptions = count;
+  }
+
+/** Determine if a setting has changed since it was last saved (or loaded)
+ *
+ * @param cszName the name of the setting.
+ */
+bool Settings::isDirty(const char *cszName) {
+  int number = lookup(cszName);
+  return (number >= 0) && getBit(m_pDirty, number);
+  }
+
+/** Read a record from the log
+ *
+ * @param sector the sector containing the record.
+ * @param offset the offset of the record in the sector.
+ * @param kind receives the type of record.
+ * @param sequence receives the sequence number of the record.
+ * @param pBuffer the buffer for the payload (m_size bytes).
+ *
+ * @return the length of the payload, LOG_INVALID if the record is not valid
+ *         or LOG_END if the log ends here.
+ */
+int Settings::readRecord(int sector, int offset, int &kind, uint32_t &sequence, unsigned char *pBuffer) {
+  unsigned char header[LOG_HEADER_SIZE];
+  int sectorSize = m_pStorage->getSectorSize();
+  if(((offset + LOG_HEADER_SIZE) > sectorSize) || !m_pStorage->read(sector, offset, header, LOG_HEADER_SIZE))
+    return LOG_INVALID;
+  // Check for the erased space after the last record
+  int erased = 0;
+  while((erased < LOG_HEADER_SIZE) && (header[erased] == 0xFF))
+    erased++;
+  if(erased == LOG_HEADER_SIZE)
+    return LOG_END;
+  // Check the header and get the payload
+  int length = get16(&header[8]);
+  if((get16(header) != LOG_MAGIC) || (header[3] != LOG_VERSION) || (length >= m_size))
+    return LOG_INVALID;
+  if(((offset + LOG_HEADER_SIZE + length) > sectorSize) || !m_pStorage->read(sector, offset + LOG_HEADER_SIZE, pBuffer, length))
+    return LOG_INVALID;
+  Crc16 crc = logCrc();
+  crc.update(pBuffer, length);
+  crc.update(header, 10);
+  if(crc.finalize() != get16(&header[10]))
+    return LOG_INVALID;
+  kind = header[2];
+  sequence = get32(&header[4]);
+  return length;
+  }
+
+/** Determine if a setting in the active buffer matches the log
+ *
+ * @param offset the offset of the setting in the active buffer.
+ * @param length the length of the packed setting.
+ * @param stored the offset of the setting in the log sector.
+ */
+bool Settings::matchesLog(int offset, int length, int stored) {
+  unsigned char block[LOG_BLOCK_SIZE];
+  if((stored + length) > m_pStorage->getSectorSize())
+    return false;
+  while(length > 0) {
+    int count = (length < LOG_BLOCK_SIZE) ? length : LOG_BLOCK_SIZE;
+    if(!m_pStorage->read(m_sector, stored, block, count) || (memcmp(block, &m_pActive[offset], count) != 0))
+      return false;
+    offset += count;
+    stored += count;
+    length -= count;
+    }
+  return true;
+  }
+
+/** Add a record to the log
+ *
+ * A snapshot contains every setting and starts a new sector, a delta
+ * contains the settings that are not in the log and is added to the current
+ * sector. The CRC is calculated before anything is written so the header
+ * goes first, a record that is cut short by a reset fails the CRC check and
+ * ends the log.
+ *
+ * @param kind the type of record to write (LOG_SNAPSHOT or LOG_DELTA).
+ *
+ * @return true on success.
+ */
+bool Settings::writeRecord(int kind) {
+  int sector = m_sector, offset = m_next, sectorSize = m_pStorage->getSectorSize();
+  if(kind == LOG_SNAPSHOT) {
+    sector = (m_sector + 1) % m_pStorage->getSectors();
+    offset = 0;
+    }
+  // Work out the size and CRC of the payload
+  Crc16 crc = logCrc();
+  SettingDescription setting;
+  int length = 0, index, next, number;
+  for(index=0; (index < m_used) && ((next = unpackSetting(m_pActive, index, m_size, setting)) > 0); index = next) {
+    number = lookup(setting.name);
+    if((kind == LOG_DELTA) && ((number < 0) || (m_pStored[number] != NO_SETTING)))
+      continue;
+    crc.update(&m_pActive[index], next - index);
+    length += next - index;
+    }
+  if((offset + LOG_HEADER_SIZE + LOG_ALIGN(length)) > sectorSize)
+    return false;
+  uint32_t block[LOG_BLOCK_SIZE / 4];
+  unsigned char *pBlock = (unsigned char *)block;
+  put16(pBlock, LOG_MAGIC);
+  pBlock[2] = kind;
+  pBlock[3] = LOG_VERSION;
+  put32(&pBlock[4], m_sequence + 1);
+  put16(&pBlock[8], length);
+  crc.update(pBlock, 10);
+  put16(&pBlock[10], crc.finalize());
+  // Sectors are only erased when a snapshot starts a new one
+  bool success = ((kind != LOG_SNAPSHOT) || m_pStorage->erase(sector)) && m_pStorage->write(sector, offset, block, LOG_HEADER_SIZE);
+  if((kind == LOG_SNAPSHOT) && (m_pStored != NULL)) {
+    for(int i=0; i<m_count; i++)
+      m_pStored[i] = NO_SETTING;
+    }
+  // Write the payload a block at a time
+  int position = offset + LOG_HEADER_SIZE, fill = 0;
+  for(index=0; success && (index < m_used) && ((next = unpackSetting(m_pActive, index, m_size, setting)) > 0); index = next) {
+    number = lookup(setting.name);
+    if((kind == LOG_DELTA) && ((number < 0) || (m_pStored[number] != NO_SETTING)))
+      continue;
+    if(number >= 0)
+      m_pStored[number] = position + fill;
+    for(int i=index; success && (i < next); i++) {
+      pBlock[fill++] = m_pActive[i];
+      if(fill == LOG_BLOCK_SIZE) {
+        success = m_pStorage->write(sector, position, block, LOG_BLOCK_SIZE);
+        position += LOG_BLOCK_SIZE;
+        fill = 0;
+        }
+      }
+    }
+  for(; (fill & 3) != 0; fill++)
+    pBlock[fill] = 0xFF;
+  if(success && (fill > 0))
+    success = m_pStorage->write(sector, position, block, fill);
+  if(!success) {
+    // The log ends at the partial record so start a new sector next time
+    m_next = sectorSize;
+    if(m_pStored != NULL) {
+      for(int i=0; i<m_count; i++)
+        m_pStored[i] = NO_SETTING;
+      }
+    return false;
+    }
+  m_sector = sector;
+  m_next = offset + LOG_HEADER_SIZE + LOG_ALIGN(length);
+  m_sequence++;
+  return true;
+  }
+
+/** Set where settings are saved
+ *
+ * @param pStorage the storage to use or NULL for none.
+ *
+ * @return true on success, false if the storage sectors are too large.
+ */
+bool Settings::setStorage(SettingsStorage *pStorage) {
+  if((pStorage != NULL) && ((pStorage->getSectors() < 1) || (pStorage->getSectorSize() >= NO_SETTING)))
+    return false;
+  m_pStorage = pStorage;
+  m_sector = -1;
+  m_next = 0;
+  m_sequence = 0;
+  if(m_pStored != NULL) {
+    for(int i=0; i<m_count; i++)
+      m_pStored[i] = NO_SETTING;
+    }
+  return true;
+  }
+
+/** Save the current settings
+ *
+ * Settings that differ from their last record in the log are written as a
+ * delta. A snapshot is written to the next sector instead if the delta does
+ * not fit in the current one (or there is no index to track the records).
  *
  * @return true on success
  */
 bool Settings::save() {
-  return false;
+  if(m_pStorage == NULL)
+    return false;
+  bool success;
+  if((m_sector < 0) || (m_pStored == NULL))
+    success = writeRecord(LOG_SNAPSHOT);
+  else {
+    // Only the changed settings need to be compared with the log
+    SettingDescription setting;
+    int length = 0;
+    for(int i=0; i<m_count; i++) {
+      if((m_pOffsets[i] == NO_SETTING) || ((m_pStored[i] != NO_SETTING) && !getBit(m_pDirty, i)))
+        continue;
+      int size = unpackSetting(m_pActive, m_pOffsets[i], m_size, setting) - m_pOffsets[i];
+      if((m_pStored[i] != NO_SETTING) && matchesLog(m_pOffsets[i], size, m_pStored[i]))
+        continue;
+      m_pStored[i] = NO_SETTING;
+      length += size;
+      }
+    if(length == 0)
+      success = true;
+    else if((m_next + LOG_HEADER_SIZE + LOG_ALIGN(length)) > m_pStorage->getSectorSize())
+      success = writeRecord(LOG_SNAPSHOT);
+    else
+      success = writeRecord(LOG_DELTA);
+    }
+  if(success && (m_pDirty != NULL))
+    memset(m_pDirty, 0, ((m_count + 15) / 16) * sizeof(uint16_t));
+  return success;
   }
 
-/** Load settings from EEPROM
+/** Load saved settings
  *
- * This will load the settings from EEPROM (replacing the currently active
- * settings).
+ * If nothing can be loaded and the constructor did not pack the defaults
+ * they are packed now, so the settings are always usable afterwards.
  *
  * @return true on success
  */
 bool Settings::load() {
+  if(readLog())
+    return true;
+  // Fall back to the defaults if the constructor did not pack them
+  if(m_used == 0)
+    reset();
   return false;
   }
 
+/** Read the newest settings in the log into the active buffer
+ *
+ * The newest sector starting with a valid snapshot is used, the deltas that
+ * follow it are applied in order up to the first record that is not valid.
+ * If the result holds every setting in the defaults table in the same order
+ * and with the same type and modifiers it becomes the active buffer as it
+ * is, otherwise it is merged with the defaults table. New records continue
+ * from the sequence number of the newest valid record.
+ *
+ * @return true on success.
+ */
+bool Settings::readLog() {
+  if(m_pStorage == NULL)
+    return false;
+  m_sector = -1;
+  m_next = 0;
+  if(m_pStored != NULL) {
+    for(int i=0; i<m_count; i++)
+      m_pStored[i] = NO_SETTING;
+    }
+  // Find the newest sector that starts with a valid snapshot. Only records
+  // that pass the CRC check are used, a header cut short by a reset can hold
+  // any sequence number.
+  unsigned char *pLoad = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
+  uint32_t sequence, newest = 0;
+  int kind, sector = -1, last = m_pStorage->getSectors() - 1, used = LOG_INVALID, length;
+  for(int i=0; i<=last; i++) {
+    if(((length = readRecord(i, 0, kind, sequence, pLoad)) < 0) || (kind != LOG_SNAPSHOT))
+      continue;
+    if((sector < 0) || isLater(sequence, newest)) {
+      sector = i;
+      newest = sequence;
+      used = length;
+      }
+    }
+  if(sector < 0)
+    return false;
+  // The sectors read after it overwrote its payload
+  if((sector != last) && (readRecord(sector, 0, kind, sequence, pLoad) != used))
+    return false;
+  m_sequence = newest;
+  // Apply the deltas that follow it (the active buffer holds each payload)
+  SettingDescription setting, current;
+  unsigned char *pScratch = m_pActive;
+  int index, next, number, offset = LOG_HEADER_SIZE;
+  for(index=0; (index < used) && ((next = unpackSetting(pLoad, index, m_size, setting)) > 0); index = next) {
+    if((number = lookup(setting.name)) >= 0)
+      m_pStored[number] = offset + index;
+    }
+  offset += LOG_ALIGN(used);
+  m_next = m_pStorage->getSectorSize();
+  while((length = readRecord(sector, offset, kind, sequence, pScratch)) != LOG_END) {
+    if((length < 0) || (kind != LOG_DELTA))
+      break; // The sector is not usable past here
+    if(isLater(sequence, m_sequence))
+      m_sequence = sequence;
+    for(index=0; (index < length) && ((next = unpackSetting(pScratch, index, m_size, setting)) > 0); index = next) {
+      // Replace the old value (or add it at the end)
+      int at = findSetting(pLoad, used, m_size, setting.name, current);
+      int size = next - index, old = (at < 0) ? 0 : (unpackSetting(pLoad, at, m_size, current) - at);
+      if(at < 0)
+        at = used;
+      if((used - old + size) >= m_size)
+        break;
+      memmove(&pLoad[at + size], &pLoad[at + old], used - at - old);
+      memcpy(&pLoad[at], &pScratch[index], size);
+      used += size - old;
+      if((number = lookup(setting.name)) >= 0)
+        m_pStored[number] = offset + LOG_HEADER_SIZE + index;
+      }
+    offset += LOG_HEADER_SIZE + LOG_ALIGN(length);
+    }
+  if(length == LOG_END)
+    m_next = offset;
+  m_sector = sector;
+  // A log written with the same table holds every setting in order and can
+  // be used as it is
+  int count = 0;
+  for(index=0; (count < m_count) && (index < used) && ((next = unpackSetting(pLoad, index, m_size, current)) > 0); index = next, count++) {
+    if((current.typeAndModifier != m_pDefaults[count].typeAndModifier) || (strcmp(current.name, m_pDefaults[count].name) != 0))
+      break;
+    }
+  if((count == m_count) && (index == used)) {
+    m_pActive = pLoad;
+    m_used = used;
+    updateOffsets();
+    if(m_pDirty != NULL)
+      memset(m_pDirty, 0, ((m_count + 15) / 16) * sizeof(uint16_t));
+    return true;
+    }
+  // Otherwise build the active settings from the defaults and the loaded values
+  int hint = 0;
+  index = 0;
+  for(int i=0; i<m_count; i++) {
+    SettingDescription value = m_pDefaults[i];
+    // Settings are usually in the same order as the defaults
+    int at = -1;
+    if((hint < used) && (unpackSetting(pLoad, hint, m_size, current) > 0) && (strcmp(current.name, value.name) == 0))
+      at = hint;
+    else
+      at = findSetting(pLoad, used, m_size, value.name, current);
+    if((at >= 0) && ((current.typeAndModifier & SETTING_TYPE_MASK) == (value.typeAndModifier & SETTING_TYPE_MASK))) {
+      value.value = current.value;
+      hint = unpackSetting(pLoad, at, m_size, current);
+      }
+    else if(m_pStored != NULL)
+      m_pStored[i] = NO_SETTING;
+    if((index = packSetting(pScratch, index, m_size, value)) <= 0) {
+      reset();
+      return false;
+      }
+    }
+  m_pActive = pScratch;
+  m_used = index;
+  updateOffsets();
+  // Settings that are not in the log need to be saved
+  if(m_pDirty != NULL) {
+    memset(m_pDirty, 0, ((m_count + 15) / 16) * sizeof(uint16_t));
+    for(int i=0; i<m_count; i++) {
+      if(m_pStored[i] == NO_SETTING)
+        setBit(m_pDirty, i);
+      }
+    }
+  return true;
+  }
+
 /** Reset to default values
  *
  * Resets the current settings to default values
@@ -340,7 +1126,82 @@ bool Settings::reset() {
       return false;
       }
     }
+  int used = m_used;
   m_used = index;
+  updateOffsets();
+  replaced(getInactive(m_pBuffer1, m_pBuffer2, m_pActive), used);
+  return true;
+  }
+
+/** Apply a set of changes
+ *
+ * Either all of the changes are made or none of them are. If every new
+ * value is the same size as the current one they are written in place,
+ * otherwise the buffer is copied once with all the changes.
+ *
+ * @param pChanges the names and new values of the settings.
+ * @param count the number of changes.
+ *
+ * @return true on success, false if a setting is missing or of the wrong
+ *         type or the buffer is not large enough.
+ */
+bool Settings::apply(const SettingDescription *pChanges, int count) {
+  SettingDescription current;
+  bool inPlace = true;
+  for(int i=0; i<count; i++) {
+    int offset = locate(pChanges[i].name, current);
+    if ((offset<0)||((current.typeAndModifier & SETTING_TYPE_MASK) != (pChanges[i].typeAndModifier & SETTING_TYPE_MASK)))
+      return false;
+    if (!sameSize(m_pActive, offset, pChanges[i]))
+      inPlace = false;
+    }
+  if (inPlace) {
+    for(int i=0; i<count; i++) {
+      // Subscribers get the old string so it must not be overwritten
+      int number = lookup(pChanges[i].name);
+      if ((number>=0) && isSubscribed(number) && ((pChanges[i].typeAndModifier & SETTING_TYPE_MASK) == StringSetting))
+        inPlace = false;
+      }
+    }
+  if (inPlace) {
+    SettingDescription previous;
+    for(int i=0; i<count; i++) {
+      int offset = locate(pChanges[i].name, previous);
+      if (!lastChange(pChanges, count, i) || sameValue(previous, pChanges[i]))
+        continue;
+      packInPlace(m_pActive, offset, m_size, pChanges[i]);
+      current = previous;
+      current.value = pChanges[i].value;
+      int number = lookup(pChanges[i].name);
+      if (number>=0) {
+        setBit(m_pDirty, number);
+        notify(number, previous, current);
+        }
+      }
+    return true;
+    }
+  unsigned char *pOld = m_pActive;
+  unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
+  int used = m_used;
+  int result = cloneWithChanges(m_pActive, pBackup, m_used, m_size, pChanges, count);
+  if (result<=0)
+    return false;
+  m_pActive = pBackup;
+  m_used = result;
+  updateOffsets();
+  // Report each setting once with its final value
+  SettingDescription previous;
+  for(int i=0; i<count; i++) {
+    int number = lookup(pChanges[i].name);
+    if (number<0)
+      continue;
+    if (!lastChange(pChanges, count, i) || !isSubscribed(number))
+      setBit(m_pDirty, number);
+    else if ((findSetting(pOld, used, m_size, pChanges[i].name, previous)>=0) && (locate(pChanges[i].name, current)>=0) && !sameValue(previous, current)) {
+      setBit(m_pDirty, number);
+      notify(number, previous, current);
+      }
+    }
   return true;
   }
 
@@ -354,7 +1215,7 @@ bool Settings::reset() {
  */
 const char *Settings::getString(const char *cszName, const char *cszAlternate) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  if (locate(cszName, setting)<0)
     return cszAlternate;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != StringSetting)
     return cszAlternate;
@@ -371,7 +1232,7 @@ const char *Settings::getString(const char *cszName, const char *cszAlternate) {
  */
 int Settings::getInteger(const char *cszName, int alternate) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  if (locate(cszName, setting)<0)
     return alternate;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != IntegerSetting)
     return alternate;
@@ -388,7 +1249,7 @@ int Settings::getInteger(const char *cszName, int alternate) {
  */
 double Settings::getNumber(const char *cszName, double alternate) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  if (locate(cszName, setting)<0)
     return alternate;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != NumberSetting)
     return alternate;
@@ -405,7 +1266,7 @@ double Settings::getNumber(const char *cszName, double alternate) {
  */
 bool Settings::getBoolean(const char *cszName, bool alternate) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  if (locate(cszName, setting)<0)
     return alternate;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != BooleanSetting)
     return alternate;
@@ -422,20 +1283,14 @@ bool Settings::getBoolean(const char *cszName, bool alternate) {
  */
 bool Settings::setString(const char *cszName, const char *cszValue) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  int offset = locate(cszName, setting);
+  if (offset<0)
     return false;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != StringSetting)
     return false;
   setting.value.string = cszValue;
   // Now clone with the new value
-  unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
-  int result = cloneWithChange(m_pActive, pBackup, m_size, setting);
-  if (result>0) {
-    m_pActive = pBackup;
-    m_used = result;
-    return true;
-    }
-  return false;
+  return update(offset, setting);
   }
 
 /** Set the value of an integer setting
@@ -448,20 +1303,14 @@ bool Settings::setString(const char *cszName, const char *cszValue) {
  */
 bool Settings::setInteger(const char *cszName, int value) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  int offset = locate(cszName, setting);
+  if (offset<0)
     return false;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != IntegerSetting)
     return false;
   setting.value.integer = value;
   // Now clone with the new value
-  unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
-  int result = cloneWithChange(m_pActive, pBackup, m_size, setting);
-  if (result>0) {
-    m_pActive = pBackup;
-    m_used = result;
-    return true;
-    }
-  return false;
+  return update(offset, setting);
   }
 
 /** Set the value of a numeric (floating point) setting
@@ -474,20 +1323,14 @@ bool Settings::setInteger(const char *cszName, int value) {
  */
 bool Settings::setNumber(const char *cszName, double value) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  int offset = locate(cszName, setting);
+  if (offset<0)
     return false;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != NumberSetting)
     return false;
   setting.value.number = value;
   // Now clone with the new value
-  unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
-  int result = cloneWithChange(m_pActive, pBackup, m_size, setting);
-  if (result>0) {
-    m_pActive = pBackup;
-    m_used = result;
-    return true;
-    }
-  return false;
+  return update(offset, setting);
   }
 
 /** Set the value of a boolean setting
@@ -500,18 +1343,334 @@ bool Settings::setNumber(const char *cszName, double value) {
  */
 bool Settings::setBoolean(const char *cszName, bool value) {
   SettingDescription setting;
-  if (findSetting(m_pActive, m_size, cszName, setting)<0)
+  int offset = locate(cszName, setting);
+  if (offset<0)
     return false;
   if ((setting.typeAndModifier & SETTING_TYPE_MASK) != BooleanSetting)
     return false;
   setting.value.boolean = value;
   // Now clone with the new value
+  return update(offset, setting);
+  }
+
+/** Get the value of a setting by number
+ *
+ * When the index is available the value is read directly from the offset
+ * of the setting without comparing names.
+ *
+ * @param number the position of the setting in the defaults table.
+ *
+ * @return the current value of the setting or the default value if it is
+ *         not present or has the wrong type.
+ */
+SettingValue Settings::getValue(int number) {
+  SettingValue value;
+  if ((number<0)||(number>=m_count)) {
+    memset(&value, 0, sizeof(value));
+    return value;
+    }
+  int type = m_pDefaults[number].typeAndModifier & SETTING_TYPE_MASK;
+  if (m_pSlots != NULL) {
+    int index = m_pOffsets[number];
+    // Skip the type byte and name to get to the value
+    if ((index != NO_SETTING) && ((m_pActive[index] & SETTING_TYPE_MASK) == type)) {
+      index += 1 + m_pActive[index + 1];
+      if (unpackValue(m_pActive, index, m_size, type, value)>0)
+        return value;
+      }
+    }
+  else {
+    SettingDescription setting;
+    if ((findSetting(m_pActive, m_used, m_size, m_pDefaults[number].name, setting)>=0) && ((setting.typeAndModifier & SETTING_TYPE_MASK) == type))
+      return setting.value;
+    }
+  return m_pDefaults[number].value;
+  }
+
+/** Set the value of a setting by number
+ *
+ * @param number the position of the setting in the defaults table.
+ * @param value the new value for the setting (of the type given in the
+ *              defaults table).
+ *
+ * @return true on success, false if the setting is not present or the
+ *         buffer is not large enough to contain the new value.
+ */
+bool Settings::setValue(int number, const SettingValue &value) {
+  if ((number<0)||(number>=m_count))
+    return false;
+  SettingDescription setting;
+  int offset = locate(m_pDefaults[number].name, setting);
+  if ((offset<0)||((setting.typeAndModifier & SETTING_TYPE_MASK) != (m_pDefaults[number].typeAndModifier & SETTING_TYPE_MASK)))
+    return false;
+  setting.value = value;
+  return update(offset, setting);
+  }
+
+/** Add the settings to a JSON object
+ *
+ * Every setting except those marked with HiddenSetting is added to the
+ * current object of the builder.
+ *
+ * @param builder the builder to add the settings to.
+ *
+ * @return true on success, false if the output is full.
+ */
+bool Settings::toJson(JsonBuilder &builder) {
+  SettingDescription setting;
+  int index = 0;
+  while ((index < m_used) && ((index = unpackSetting(m_pActive, index, m_size, setting))>0)) {
+    if (setting.typeAndModifier & HiddenSetting)
+      continue;
+    bool added = false;
+    switch(setting.typeAndModifier & SETTING_TYPE_MASK) {
+      case StringSetting:
+        added = builder.add(setting.name, setting.value.string);
+        break;
+      case IntegerSetting:
+        added = builder.add(setting.name, setting.value.integer);
+        break;
+      case BooleanSetting:
+        added = builder.add(setting.name, setting.value.boolean);
+        break;
+      case NumberSetting:
+        added = builder.add(setting.name, setting.value.number);
+        break;
+      }
+    if (!added)
+      return false;
+    }
+  return true;
+  }
+
+/** Get the value of a JSON token as a setting value
+ *
+ * Strings are not converted (they are unescaped straight into the buffer).
+ *
+ * @param parser the parser containing the token.
+ * @param token the token for the value.
+ * @param type the type of the setting.
+ * @param value receives the value.
+ *
+ * @return true on success, false if the token is of the wrong type or out
+ *         of range.
+ */
+static bool jsonValue(JsonParser &parser, int token, int type, SettingValue &value) {
+  switch(type) {
+    case IntegerSetting: {
+      long integer;
+      if (!parser.getInt(token, integer) || (integer < INT_MIN) || (integer > INT_MAX))
+        return false;
+      value.integer = (int)integer;
+      return true;
+      }
+    case BooleanSetting:
+      return parser.getBool(token, value.boolean);
+    case NumberSetting:
+      return parser.getDouble(token, value.number);
+    }
+  return false;
+  }
+
+/** Change settings to the values in a JSON object
+ *
+ * The object is walked once to match the fields with settings and check the
+ * values, the settings are then copied into the inactive buffer with the
+ * new values (strings are unescaped straight into place) and the buffers
+ * are switched. Settings marked with HiddenSetting can be changed even
+ * though they are not exported by toJson().
+ *
+ * @param parser the parser containing the JSON.
+ * @param object the token for the object.
+ * @param pfnError function to call for each field that is not used (may be
+ *                 NULL). It must not change the settings.
+ * @param pContext a value to pass to the function.
+ *
+ * @return the number of settings changed or -1 if the object is not valid,
+ *         there is no index or the buffer is not large enough (in which
+ *         case no settings are changed).
+ */
+int Settings::fromJson(JsonParser &parser, int object, PFN_SETTING_ERROR pfnError, void *pContext) {
+  int fields = parser.size(object);
+  if ((m_pSlots == NULL) || !parser.isObject(object) || (parser.next(object) < 0))
+    return -1;
+  // The value token for each setting (the last one wins)
+  int *pTokens = (int *)malloc(m_count * sizeof(int));
+  if (pTokens == NULL)
+    return -1;
+  for(int i=0; i<m_count; i++)
+    pTokens[i] = -1;
   unsigned char *pBackup = getInactive(m_pBuffer1, m_pBuffer2, m_pActive);
-  int result = cloneWithChange(m_pActive, pBackup, m_size, setting);
-  if (result>0) {
+  char szName[MAX_SETTING_NAME_LENGTH + 1];
+  SettingDescription current;
+  int key = object + 1;
+  for(int i=0; i<fields; i++, key = parser.next(key)) {
+    if (key < 0) {
+      free(pTokens);
+      return -1;
+      }
+    SettingError error = SettingUnknown;
+    int number = -1;
+    if ((parser.unescape(key, szName, sizeof(szName)) >= 0) && ((number = lookup(szName)) >= 0) && (locate(szName, current) >= 0)) {
+      int type = current.typeAndModifier & SETTING_TYPE_MASK;
+      SettingValue value;
+      if (current.typeAndModifier & ReadOnlySetting)
+        error = SettingReadOnly;
+      else if ((type == StringSetting) ? (parser.isString(key + 1) && (parser.unescape(key + 1, (char *)pBackup, (m_size < 254) ? m_size : 254) >= 0)) : jsonValue(parser, key + 1, type, value)) {
+        pTokens[number] = key + 1;
+        continue;
+        }
+      else
+        error = SettingWrongType;
+      }
+    if (pfnError != NULL)
+      (*pfnError)(parser, key, error, pContext);
+    }
+  // Copy the settings with the new values
+  int src = 0, dst = 0, next, changed = 0;
+  while ((src < m_used) && ((next = unpackSetting(m_pActive, src, m_size, current)) > 0)) {
+    int number = lookup(current.name);
+    int start = dst;
+    if ((number < 0) || (pTokens[number] < 0)) {
+      if ((dst + next - src) >= m_size)
+        break;
+      memcpy(&pBackup[dst], &m_pActive[src], next - src);
+      dst += next - src;
+      }
+    else if ((current.typeAndModifier & SETTING_TYPE_MASK) == StringSetting) {
+      // Type byte and name, then the unescaped value
+      dst += 1 + m_pActive[src + 1];
+      int room = m_size - dst - 2;
+      if (room > 254)
+        room = 254;
+      int len = (room > 0) ? parser.unescape(pTokens[number], (char *)&pBackup[dst + 1], room) : -1;
+      if (len < 0)
+        break;
+      memcpy(&pBackup[start], &m_pActive[src], dst - start);
+      pBackup[dst] = len + 2;
+      dst += len + 2;
+      }
+    else if (!jsonValue(parser, pTokens[number], current.typeAndModifier & SETTING_TYPE_MASK, current.value) || ((dst = packSetting(pBackup, dst, m_size, current)) <= 0))
+      break;
+    if ((number >= 0) && (pTokens[number] >= 0)) {
+      if (((dst - start) == (next - src)) && (memcmp(&pBackup[start], &m_pActive[src], dst - start) == 0))
+        pTokens[number] = -1;
+      else
+        changed++;
+      }
+    src = next;
+    }
+  if (src < m_used) {
+    // Not enough room
+    free(pTokens);
+    return -1;
+    }
+  if (changed > 0) {
+    unsigned char *pOld = m_pActive;
+    int used = m_used;
     m_pActive = pBackup;
-    m_used = result;
-    return true;
+    m_used = dst;
+    updateOffsets();
+    SettingDescription previous;
+    for(int i=0; i<m_count; i++) {
+      if (pTokens[i] < 0)
+        continue;
+      setBit(m_pDirty, i);
+      if (isSubscribed(i) && (findSetting(pOld, used, m_size, m_pDefaults[i].name, previous) >= 0) && (locate(m_pDefaults[i].name, current) >= 0))
+        notify(i, previous, current);
+      }
     }
-  return false;
+  free(pTokens);
+  return changed;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of Settings::Transaction
+//---------------------------------------------------------------------------
+
+/** Start a new set of changes
+ *
+ * @param settings the settings to change.
+ */
+Settings::Transaction::Transaction(Settings &settings) : m_settings(settings) {
+  m_count = 0;
+  }
+
+/** Add a change to the transaction
+ *
+ * @param cszName the name of the setting to modify
+ * @param type the type of the new value
+ * @param value the new value for the setting
+ *
+ * @return true if the change was added, false if the setting does not
+ *         exist, is of the wrong type or the transaction is full.
+ */
+bool Settings::Transaction::stage(const char *cszName, int type, const SettingValue &value) {
+  SettingDescription setting;
+  if ((m_count>=SETTINGS_TRANSACTION_SIZE)||(m_settings.locate(cszName, setting)<0))
+    return false;
+  if ((setting.typeAndModifier & SETTING_TYPE_MASK) != type)
+    return false;
+  m_changes[m_count].name = cszName;
+  m_changes[m_count].typeAndModifier = type;
+  m_changes[m_count].value = value;
+  m_count++;
+  return true;
+  }
+
+/** Set the value of a string setting
+ *
+ * @return true if the change was added, false if the setting is of the wrong
+ *         type or the transaction is full.
+ */
+bool Settings::Transaction::setString(const char *cszName, const char *cszValue) {
+  SettingValue value;
+  value.string = cszValue;
+  return stage(cszName, StringSetting, value);
+  }
+
+/** Set the value of an integer setting
+ *
+ * @return true if the change was added, false if the setting is of the wrong
+ *         type or the transaction is full.
+ */
+bool Settings::Transaction::setInteger(const char *cszName, int value) {
+  SettingValue setting;
+  setting.integer = value;
+  return stage(cszName, IntegerSetting, setting);
+  }
+
+/** Set the value of a numeric (floating point) setting
+ *
+ * @return true if the change was added, false if the setting is of the wrong
+ *         type or the transaction is full.
+ */
+bool Settings::Transaction::setNumber(const char *cszName, double value) {
+  SettingValue setting;
+  setting.number = value;
+  return stage(cszName, NumberSetting, setting);
+  }
+
+/** Set the value of a boolean setting
+ *
+ * @return true if the change was added, false if the setting is of the wrong
+ *         type or the transaction is full.
+ */
+bool Settings::Transaction::setBoolean(const char *cszName, bool value) {
+  SettingValue setting;
+  setting.boolean = value;
+  return stage(cszName, BooleanSetting, setting);
+  }
+
+/** Apply all of the changes
+ *
+ * The transaction is empty afterwards and can be used again.
+ *
+ * @return true on success, false if the buffer is not large enough (in
+ *         which case none of the changes are made).
+ */
+bool Settings::Transaction::commit() {
+  bool result = m_settings.apply(m_changes, m_count);
+  m_count = 0;
+  return result;
   }
@@ -0,0 +1,202 @@
+/*--------------------------------------------------------------------------*
+* Storage for saved settings
+*---------------------------------------------------------------------------*
+* Flash sectors that hold the settings log. The memory implementation
+* simulates a flash chip (counting erases and programming time) so the log
+* can be exercised on the host.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdlib.h>
+#include <string.h>
+#include "Settings.h"
+
+// Programming page size for simulated flash
+#define FLASH_PAGE_SIZE 256
+
+//---------------------------------------------------------------------------
+// Implementation of SettingsStorage
+//---------------------------------------------------------------------------
+
+/** Default constructor
+ */
+SettingsStorage::SettingsStorage() {
+  m_sectorSize = 0;
+  m_sectors = 0;
+  }
+
+/** Destructor
+ */
+SettingsStorage::~SettingsStorage() {
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of SettingsMemoryStorage
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * The default timing is typical for a SPI NOR flash chip.
+ *
+ * @param pMemory the memory to use, this should be erased (all 0xFF) or
+ *                hold the contents of an earlier session.
+ * @param sectorSize the size of each sector in bytes.
+ * @param sectors the number of sectors.
+ */
+SettingsMemoryStorage::SettingsMemoryStorage(void *pMemory, int sectorSize, int sectors) {
+  m_pMemory = (unsigned char *)pMemory;
+  m_pErases = (uint32_t *)calloc(sectors, sizeof(uint32_t));
+  if((m_pMemory != NULL) && (m_pErases != NULL)) {
+    m_sectorSize = sectorSize;
+    m_sectors = sectors;
+    }
+  m_eraseTime = 45000;
+  m_pageTime = 700;
+  m_written = 0;
+  m_elapsed = 0;
+  }
+
+/** Destructor
+ */
+SettingsMemoryStorage::~SettingsMemoryStorage() {
+  free(m_pErases);
+  }
+
+/** Set the timing used to simulate the flash
+ *
+ * @param eraseTime the time to erase a sector (microseconds).
+ * @param pageTime the time to program a 256 byte page (microseconds).
+ */
+void SettingsMemoryStorage::setTiming(uint32_t eraseTime, uint32_t pageTime) {
+  m_eraseTime = eraseTime;
+  m_pageTime = pageTime;
+  }
+
+/** Get the number of times a sector has been erased
+ */
+uint32_t SettingsMemoryStorage::getErases(int sector) const {
+  if((sector < 0) || (sector >= m_sectors))
+    return 0;
+  return m_pErases[sector];
+  }
+
+/** Erase a sector
+ *
+ * @return true on success.
+ */
+bool SettingsMemoryStorage::erase(int sector) {
+  if((sector < 0) || (sector >= m_sectors))
+    return false;
+  memset(&m_pMemory[sector * m_sectorSize], 0xFF, m_sectorSize);
+  m_pErases[sector]++;
+  m_elapsed += m_eraseTime;
+  return true;
+  }
+
+/** Write data to an erased part of a sector
+ *
+ * Like real flash the data is combined with the current contents so bits
+ * can only be cleared.
+ *
+ * @return true on success, false if the write would need to set bits that
+ *         are not erased.
+ */
+bool SettingsMemoryStorage::write(int sector, int offset, const void *pData, int length) {
+  if((sector < 0) || (sector >= m_sectors) || (offset < 0) || ((offset + length) > m_sectorSize))
+    return false;
+  if(((offset & 3) != 0) || ((length & 3) != 0) || ((((uintptr_t)pData) & 3) != 0))
+    return false;
+  unsigned char *pTarget = &m_pMemory[(sector * m_sectorSize) + offset];
+  const unsigned char *pSource = (const unsigned char *)pData;
+  bool success = true;
+  for(int i=0; i<length; i++) {
+    if((pSource[i] & ~pTarget[i]) != 0)
+      success = false;
+    pTarget[i] &= pSource[i];
+    }
+  // Each page touched is programmed separately
+  if(length > 0) {
+    int first = offset / FLASH_PAGE_SIZE, last = (offset + length - 1) / FLASH_PAGE_SIZE;
+    m_elapsed += (uint64_t)(last - first + 1) * m_pageTime;
+    }
+  m_written += length;
+  return success;
+  }
+
+/** Read data from a sector
+ *
+ * @return true on success.
+ */
+bool SettingsMemoryStorage::read(int sector, int offset, void *pData, int length) {
+  if((sector < 0) || (sector >= m_sectors) || (offset < 0) || ((offset + length) > m_sectorSize))
+    return false;
+  memcpy(pData, &m_pMemory[(sector * m_sectorSize) + offset], length);
+  return true;
+  }
+
+#ifdef ARDUINO_ARCH_ESP8266
+
+//---------------------------------------------------------------------------
+// Implementation of SettingsFlashStorage
+//---------------------------------------------------------------------------
+
+/** Constructor
+ *
+ * @param first the number of the first sector in the flash chip.
+ * @param sectors the number of sectors to use.
+ */
+SettingsFlashStorage::SettingsFlashStorage(uint32_t first, int sectors) {
+  m_first = first;
+  m_sectorSize = SPI_FLASH_SEC_SIZE;
+  m_sectors = sectors;
+  }
+
+/** Erase a sector
+ *
+ * @return true on success.
+ */
+bool SettingsFlashStorage::erase(int sector) {
+  if((sector < 0) || (sector >= m_sectors))
+    return false;
+  return ESP.flashEraseSector(m_first + sector);
+  }
+
+/** Write data to an erased part of a sector
+ *
+ * @return true on success.
+ */
+bool SettingsFlashStorage::write(int sector, int offset, const void *pData, int length) {
+  if((sector < 0) || (sector >= m_sectors) || (offset < 0) || ((offset + length) > m_sectorSize))
+    return false;
+  uint32_t address = ((m_first + sector) * SPI_FLASH_SEC_SIZE) + offset;
+  return ESP.flashWrite(address, (uint32_t *)pData, length);
+  }
+
+/** Read data from a sector
+ *
+ * The flash can only be read a word at a time into aligned memory so the
+ * data is copied through a small aligned block.
+ *
+ * @return true on success.
+ */
+bool SettingsFlashStorage::read(int sector, int offset, void *pData, int length) {
+  if((sector < 0) || (sector >= m_sectors) || (offset < 0) || ((offset + length) > m_sectorSize))
+    return false;
+  uint32_t block[16];
+  uint32_t address = ((m_first + sector) * SPI_FLASH_SEC_SIZE) + offset;
+  unsigned char *pTarget = (unsigned char *)pData;
+  while(length > 0) {
+    int skip = address & 3;
+    int count = sizeof(block) - skip;
+    if(count > length)
+      count = length;
+    if(!ESP.flashRead(address - skip, block, (skip + count + 3) & ~3))
+      return false;
+    memcpy(pTarget, &((unsigned char *)block)[skip], count);
+    pTarget += count;
+    address += count;
+    length -= count;
+    }
+  return true;
+  }
+
+#endif /* ARDUINO_ARCH_ESP8266 */
@@ -19,6 +19,54 @@
 #  define DMSG(fmt, ...)
 #endif
 
+// Allow flash resident tables to be used on platforms without PROGMEM
+#ifndef PROGMEM
+#  define PROGMEM
+#endif
+
+#ifndef pgm_read_word
+#  define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#endif
+
+// Define this to use 16 entry (nibble) CRC tables instead of 256 entry ones
+//#define CRC16_NIBBLE_TABLES
+
+/** Compile time generation of CRC16 lookup tables
+ *
+ * Each table entry is the CRC register contribution of a single byte (or
+ * nibble) for the given polynomial. Reflected tables process data LSB first
+ * and use the bit reversed polynomial.
+ */
+template<uint16_t POLYNOMIAL, bool REFLECTED>
+struct Crc16Table {
+  /** Reverse the lower 'bits' bits of a value
+   */
+  static constexpr uint16_t reverse(uint16_t value, int bits) {
+    return (bits == 0) ? 0 : (uint16_t)(((value & 1) << (bits - 1)) | reverse(value >> 1, bits - 1));
+    }
+
+  /** Shift 'bits' zero bits through the CRC register
+   */
+  static constexpr uint16_t shift(uint16_t crc, int bits) {
+    return (bits == 0) ? crc : shift(REFLECTED
+      ? (uint16_t)((crc & 0x0001) ? ((crc >> 1) ^ reverse(POLYNOMIAL, 16)) : (crc >> 1))
+      : (uint16_t)((crc & 0x8000) ? ((crc << 1) ^ POLYNOMIAL) : (crc << 1)),
+      bits - 1);
+    }
+
+  /** Table entry for a byte sized (256 entry) table
+   */
+  static constexpr uint16_t entry(unsigned int index) {
+    return REFLECTED ? shift(index, 8) : shift(index << 8, 8);
+    }
+
+  /** Table entry for a nibble sized (16 entry) table
+   */
+  static constexpr uint16_t nibble(unsigned int index) {
+    return REFLECTED ? shift(index, 4) : shift(index << 12, 4);
+    }
+  };
+
 class Crc16 {
   private:
     uint16_t _msbMask;
@@ -29,7 +77,10 @@ class Crc16 {
     uint8_t _reflectIn;
     uint8_t _reflectOut;
     uint16_t _crc;
-    uint8_t reflect(uint8_t data, uint8_t bits = 32);
+    const uint16_t *_pTable;
+    uint16_t reflect(uint16_t data, uint8_t bits = 16) const;
+    uint16_t multiply(uint16_t a, uint16_t b) const;
+    void prepare();
 
   public:
     inline Crc16() {
@@ -41,6 +92,7 @@ class Crc16 {
       _xorOut = 0x0000;
       _msbMask = 0x8000;
       _mask = 0xFFFF;
+      prepare();
       }
 
     inline Crc16(uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, uint16_t msbMask, uint16_t mask) {
@@ -51,18 +103,133 @@ class Crc16 {
       _xorOut = xorOut;
       _msbMask = msbMask;
       _mask = mask;
+      prepare();
       }
 
     // Forwards
     void clearCrc();
     void updateCrc(uint8_t data);
-    uint16_t getCrc();
-    unsigned int fastCrc(uint8_t data[], uint8_t start, uint16_t length, uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, uint16_t msbMask, uint16_t mask);
+    uint16_t getCrc() const;
+    unsigned int fastCrc(const uint8_t data[], size_t start, size_t length, uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, uint16_t msbMask, uint16_t mask);
+
+    /** Add a block of data to the running crc
+     *
+     * Call clearCrc() to start a new calculation, blocks may be of any size.
+     */
+    void update(const void *pData, size_t length);
+
+    /** Get the final crc for the data added so far
+     *
+     * This does not change the running crc so more data may be added
+     * afterwards.
+     */
+    uint16_t finalize() const;
 
-    inline unsigned int XModemCrc(uint8_t data[], uint8_t start, uint16_t length) {
+    /** Combine the crcs of two consecutive blocks
+     *
+     * @param crc1 the final crc of the first block.
+     * @param crc2 the final crc of the second block.
+     * @param length2 the length of the second block in bytes.
+     *
+     * @return the crc of both blocks together, as if they were calculated
+     *         in a single pass.
+     */
+    uint16_t combine(uint16_t crc1, uint16_t crc2, size_t length2) const;
+
+    inline unsigned int XModemCrc(const uint8_t data[], size_t start, size_t length) {
       //  XModem parameters: poly=0x1021 init=0x0000 refin=false refout=false xorout=0x0000
       return fastCrc(data, start, length, false, false, 0x1021, 0x0000, 0x0000, 0x8000, 0xffff);
       }
+
+    inline unsigned int KermitCrc(const uint8_t data[], size_t start, size_t length) {
+      //  Kermit parameters: poly=0x1021 init=0x0000 refin=true refout=true xorout=0x0000
+      return fastCrc(data, start, length, true, true, 0x1021, 0x0000, 0x0000, 0x8000, 0xffff);
+      }
+
+    inline unsigned int ModbusCrc(const uint8_t data[], size_t start, size_t length) {
+      //  Modbus parameters: poly=0x8005 init=0xffff refin=true refout=true xorout=0x0000
+      return fastCrc(data, start, length, true, true, 0x8005, 0xffff, 0x0000, 0x8000, 0xffff);
+      }
+
+    inline unsigned int CcittFalseCrc(const uint8_t data[], size_t start, size_t length) {
+      //  CCITT-False parameters: poly=0x1021 init=0xffff refin=false refout=false xorout=0x0000
+      return fastCrc(data, start, length, false, false, 0x1021, 0xffff, 0x0000, 0x8000, 0xffff);
+      }
+  };
+
+/** Available kernels for bulk CRC calculation
+ */
+typedef enum {
+  Crc16Slicing8, // Portable slicing-by-8 tables
+  Crc16Clmul     // PCLMULQDQ folding (x86-64 only)
+  } Crc16Kernel;
+
+/** Bulk CRC16 calculation for large buffers
+ *
+ * Intended for host side verification of large numbers of blocks. Supports
+ * any 16 bit polynomial where refin == refout and gives the same results as
+ * Crc16::fastCrc for those parameters. Each instance carries 4K of tables so
+ * it is not suitable for use on the device itself.
+ */
+class Crc16Bulk {
+  private:
+    bool        m_reflected;
+    uint16_t    m_polynomial;
+    uint16_t    m_xorIn;
+    uint16_t    m_xorOut;
+    Crc16Kernel m_kernel;
+    uint16_t    m_slices[8][256];
+    uint64_t    m_fold16[2]; // Folding constants for 16 byte blocks
+    uint64_t    m_fold64[2]; // Folding constants for 64 byte blocks
+
+    uint16_t slicing(uint16_t crc, const uint8_t *pData, size_t length) const;
+    uint16_t clmul(uint16_t crc, const uint8_t *pData, size_t length) const;
+
+  public:
+    /** Set up for the given CRC parameters
+     *
+     * The fastest kernel supported by the CPU is selected.
+     */
+    Crc16Bulk(bool reflected, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut);
+
+    /** Determine if a kernel can be used on this CPU
+     */
+    static bool isSupported(Crc16Kernel kernel);
+
+    /** Select the kernel to use
+     *
+     * @return true if the kernel was selected, false if it is not supported.
+     */
+    bool setKernel(Crc16Kernel kernel);
+
+    /** Get the kernel currently in use
+     */
+    inline Crc16Kernel getKernel() {
+      return m_kernel;
+      }
+
+    /** Update a CRC register value with more data
+     *
+     * The register starts at initial() and is converted to the final CRC
+     * value with finish().
+     */
+    uint16_t update(uint16_t crc, const void *pData, size_t length) const;
+
+    /** Initial register value
+     */
+    uint16_t initial() const;
+
+    /** Convert a register value into the final CRC
+     */
+    inline uint16_t finish(uint16_t crc) const {
+      return crc ^ m_xorOut;
+      }
+
+    /** Calculate the CRC of a single buffer
+     */
+    inline uint16_t compute(const void *pData, size_t length) const {
+      return finish(update(initial(), pData, length));
+      }
   };
 
 #endif /* __TGL_H */
@@ -28,40 +28,220 @@
 #include <Arduino.h>
 #include "TGL.h"
 
+//---------------------------------------------------
+// Lookup tables for the common presets
+//
+// Generated at compile time by Crc16Table and kept in flash. XModem and
+// CCITT-False share the same (unreflected) table.
+//---------------------------------------------------
+#define CRC16_ROW(p, r, i) \
+  CRC16_ENTRY(p, r, i + 0x0), CRC16_ENTRY(p, r, i + 0x1), CRC16_ENTRY(p, r, i + 0x2), CRC16_ENTRY(p, r, i + 0x3), \
+  CRC16_ENTRY(p, r, i + 0x4), CRC16_ENTRY(p, r, i + 0x5), CRC16_ENTRY(p, r, i + 0x6), CRC16_ENTRY(p, r, i + 0x7), \
+  CRC16_ENTRY(p, r, i + 0x8), CRC16_ENTRY(p, r, i + 0x9), CRC16_ENTRY(p, r, i + 0xa), CRC16_ENTRY(p, r, i + 0xb), \
+  CRC16_ENTRY(p, r, i + 0xc), CRC16_ENTRY(p, r, i + 0xd), CRC16_ENTRY(p, r, i + 0xe), CRC16_ENTRY(p, r, i + 0xf)
+
+#ifdef CRC16_NIBBLE_TABLES
+#  define CRC16_TABLE_SIZE 16
+#  define CRC16_ENTRY(p, r, i) Crc16Table<p, r>::nibble(i)
+#  define CRC16_TABLE(p, r) CRC16_ROW(p, r, 0x00)
+#else
+#  define CRC16_TABLE_SIZE 256
+#  define CRC16_ENTRY(p, r, i) Crc16Table<p, r>::entry(i)
+#  define CRC16_TABLE(p, r) \
+     CRC16_ROW(p, r, 0x00), CRC16_ROW(p, r, 0x10), CRC16_ROW(p, r, 0x20), CRC16_ROW(p, r, 0x30), \
+     CRC16_ROW(p, r, 0x40), CRC16_ROW(p, r, 0x50), CRC16_ROW(p, r, 0x60), CRC16_ROW(p, r, 0x70), \
+     CRC16_ROW(p, r, 0x80), CRC16_ROW(p, r, 0x90), CRC16_ROW(p, r, 0xa0), CRC16_ROW(p, r, 0xb0), \
+     CRC16_ROW(p, r, 0xc0), CRC16_ROW(p, r, 0xd0), CRC16_ROW(p, r, 0xe0), CRC16_ROW(p, r, 0xf0)
+#endif
+
+static_assert(Crc16Table<0x1021, false>::entry(0x01) == 0x1021, "Unexpected CRC16 table entry");
+static_assert(Crc16Table<0x1021, true>::entry(0x80) == 0x8408, "Unexpected CRC16 table entry");
+static_assert(Crc16Table<0x8005, true>::entry(0x01) == 0xc0c1, "Unexpected CRC16 table entry");
+
+// poly=0x1021 refin=false refout=false (XModem, CCITT-False)
+static const uint16_t CRC16_TABLE_1021[CRC16_TABLE_SIZE] PROGMEM = { CRC16_TABLE(0x1021, false) };
+
+// poly=0x1021 refin=true refout=true (Kermit)
+static const uint16_t CRC16_TABLE_1021_REFLECTED[CRC16_TABLE_SIZE] PROGMEM = { CRC16_TABLE(0x1021, true) };
+
+// poly=0x8005 refin=true refout=true (Modbus)
+static const uint16_t CRC16_TABLE_8005_REFLECTED[CRC16_TABLE_SIZE] PROGMEM = { CRC16_TABLE(0x8005, true) };
+
+//---------------------------------------------------
+// Find the lookup table for a set of parameters
+//
+// Returns NULL if there is no table for them.
+//---------------------------------------------------
+static const uint16_t *findTable(uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t msbMask, uint16_t mask) {
+  if(((reflectIn != 0) != (reflectOut != 0)) || (msbMask != 0x8000) || (mask != 0xffff))
+    return NULL;
+  if(polynomial == 0x1021)
+    return (reflectIn != 0) ? CRC16_TABLE_1021_REFLECTED : CRC16_TABLE_1021;
+  if((polynomial == 0x8005) && (reflectIn != 0))
+    return CRC16_TABLE_8005_REFLECTED;
+  return NULL;
+  }
+
+//---------------------------------------------------
+// Update the crc register from a lookup table
+//---------------------------------------------------
+static uint16_t tableUpdate(const uint16_t *pTable, bool reflected, uint16_t crc, const uint8_t *pData, size_t length) {
+  const uint8_t *pEnd = pData + length;
+#ifdef CRC16_NIBBLE_TABLES
+  if(reflected) {
+    while(pData < pEnd) {
+      uint8_t c = *pData++;
+      crc = (crc >> 4) ^ pgm_read_word(&pTable[(crc ^ c) & 0x0f]);
+      crc = (crc >> 4) ^ pgm_read_word(&pTable[(crc ^ (c >> 4)) & 0x0f]);
+      }
+    }
+  else {
+    while(pData < pEnd) {
+      uint8_t c = *pData++;
+      crc = (crc << 4) ^ pgm_read_word(&pTable[((crc >> 12) ^ (c >> 4)) & 0x0f]);
+      crc = (crc << 4) ^ pgm_read_word(&pTable[((crc >> 12) ^ c) & 0x0f]);
+      }
+    }
+#else
+  if(reflected) {
+    while(pData < pEnd)
+      crc = (crc >> 8) ^ pgm_read_word(&pTable[(crc ^ *pData++) & 0xff]);
+    }
+  else {
+    while(pData < pEnd)
+      crc = (crc << 8) ^ pgm_read_word(&pTable[((crc >> 8) ^ *pData++) & 0xff]);
+    }
+#endif
+  return crc;
+  }
+
+//---------------------------------------------------
+// Number of bits in a crc given the mask for the MSB
+//---------------------------------------------------
+static uint8_t width(uint16_t msbMask) {
+  uint8_t bits = 0;
+  for(; msbMask != 0; msbMask >>= 1)
+    bits++;
+  return bits;
+  }
+
+//---------------------------------------------------
+// Select the lookup table and initialize
+//---------------------------------------------------
+void Crc16::prepare() {
+  _pTable = findTable(_reflectIn, _reflectOut, _polynomial, _msbMask, _mask);
+  clearCrc();
+  }
+
 //---------------------------------------------------
 // Initialize crc calculation
 //---------------------------------------------------
 void Crc16::clearCrc() {
-  _crc = _xorIn;
+  // Reflected tables keep the register in output bit order
+  if((_pTable != NULL) && (_reflectIn != 0))
+    _crc = reflect(_xorIn);
+  else
+    _crc = _xorIn;
   }
 
 //---------------------------------------------------
 // Update crc with new data
 //---------------------------------------------------
 void Crc16::updateCrc(uint8_t data) {
-  if(_reflectIn != 0)
-    data = (uint8_t) reflect(data, 8);
-  int j = 0x80;
-  while(j > 0) {
-    uint16_t bit = (uint16_t)(_crc & _msbMask);
-    _crc <<= 1;
-    if((data & j) != 0) {
-      bit = (uint16_t)(bit ^ _msbMask);
-      }
-    if(bit != 0) {
-      _crc ^= _polynomial;
+  update(&data, 1);
+  }
+
+//---------------------------------------------------
+// Update crc with a block of data
+//---------------------------------------------------
+void Crc16::update(const void *pData, size_t length) {
+  const uint8_t *pBytes = (const uint8_t *)pData;
+  if(_pTable != NULL) {
+    _crc = tableUpdate(_pTable, _reflectIn != 0, _crc, pBytes, length);
+    return;
+    }
+  for(; length > 0; length--) {
+    uint8_t data = *pBytes++;
+    if(_reflectIn != 0)
+      data = (uint8_t) reflect(data, 8);
+    int j = 0x80;
+    while(j > 0) {
+      uint16_t bit = (uint16_t)(_crc & _msbMask);
+      _crc <<= 1;
+      if((data & j) != 0) {
+        bit = (uint16_t)(bit ^ _msbMask);
+        }
+      if(bit != 0) {
+        _crc ^= _polynomial;
+        }
+      j >>= 1;
       }
-    j >>= 1;
     }
   }
 
 //---------------------------------------------------
 // Get final crc value
 //---------------------------------------------------
-uint16_t Crc16::getCrc() {
+uint16_t Crc16::finalize() const {
+  uint16_t crc = _crc;
+  if((_pTable == NULL) && (_reflectOut != 0))
+    crc = reflect(crc, width(_msbMask));
+  return (crc ^ _xorOut) & _mask;
+  }
+
+//---------------------------------------------------
+// Get final crc value (same as finalize())
+//---------------------------------------------------
+uint16_t Crc16::getCrc() const {
+  return finalize();
+  }
+
+//---------------------------------------------------
+// Multiply two values modulo the polynomial
+//---------------------------------------------------
+uint16_t Crc16::multiply(uint16_t a, uint16_t b) const {
+  uint16_t result = 0;
+  for(uint16_t bit = _msbMask; bit != 0; bit >>= 1) {
+    bool carry = (result & _msbMask) != 0;
+    result = (result << 1) & _mask;
+    if(carry)
+      result ^= _polynomial;
+    if(b & bit)
+      result ^= a;
+    }
+  return result;
+  }
+
+//---------------------------------------------------
+// Combine the crcs of two consecutive blocks
+//
+// Working with unreflected registers the crc of the
+// combined block is (crc1 ^ init) * x^(8 * length2) ^ crc2
+// where the multiplication is modulo the polynomial.
+//---------------------------------------------------
+uint16_t Crc16::combine(uint16_t crc1, uint16_t crc2, size_t length2) const {
+  uint8_t bits = width(_msbMask);
+  // Back to raw register values
+  crc1 = (crc1 ^ _xorOut) & _mask;
+  crc2 = (crc2 ^ _xorOut) & _mask;
+  if(_reflectOut != 0) {
+    crc1 = reflect(crc1, bits);
+    crc2 = reflect(crc2, bits);
+    }
+  // Calculate x^(8 * length2) by squaring, starting with x^8
+  uint16_t shift = 1;
+  for(int i = 0; i < 8; i++)
+    shift = ((shift & _msbMask) ? ((shift << 1) ^ _polynomial) : (shift << 1)) & _mask;
+  uint16_t power = 1;
+  for(; length2 > 0; length2 >>= 1) {
+    if(length2 & 1)
+      power = multiply(power, shift);
+    shift = multiply(shift, shift);
+    }
+  uint16_t crc = multiply(crc1 ^ _xorIn, power) ^ crc2;
   if(_reflectOut != 0)
-    _crc = (unsigned int)((reflect(_crc) ^ _xorOut) & _mask);
-  return _crc;
+    crc = reflect(crc, bits);
+  return (crc ^ _xorOut) & _mask;
   }
 
 //---------------------------------------------------
@@ -71,15 +251,23 @@ uint16_t Crc16::getCrc() {
 // Modbus: 		width=16 poly=0x8005 init=0xffff refin=true  refout=true  xorout=0x0000 check=0x4b37
 // XModem: 		width=16 poly=0x1021 init=0x0000 refin=false refout=false xorout=0x0000 check=0x31c3
 // CCITT-False:	width=16 poly=0x1021 init=0xffff refin=false refout=false xorout=0x0000 check=0x29b1
+//
+// The presets above are calculated a byte (or nibble) at a time with the
+// lookup tables, anything else falls back to the bitwise calculation.
 //---------------------------------------------------
-unsigned int Crc16::fastCrc(uint8_t data[], uint8_t start, uint16_t length, uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, uint16_t msbMask, uint16_t mask) {
+unsigned int Crc16::fastCrc(const uint8_t data[], size_t start, size_t length, uint8_t reflectIn, uint8_t reflectOut, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, uint16_t msbMask, uint16_t mask) {
+  const uint16_t *pTable = findTable(reflectIn, reflectOut, polynomial, msbMask, mask);
+  if(pTable != NULL) {
+    // Reflected tables keep the register in output bit order
+    uint16_t crc = (reflectIn != 0) ? reflect(xorIn) : xorIn;
+    crc = tableUpdate(pTable, reflectIn != 0, crc, &data[start], length);
+    return (crc ^ xorOut) & mask;
+    }
   unsigned int crc = xorIn;
   int j;
   uint8_t c;
   unsigned int bit;
-  if(length == 0)
-    return crc;
-  for(int i = start; i < (start + length); i++) {
+  for(size_t i = start; i < (start + length); i++) {
     c = data[i];
     if(reflectIn != 0)
       c = (uint8_t) reflect(c, 8);
@@ -97,22 +285,22 @@ unsigned int Crc16::fastCrc(uint8_t data[], uint8_t start, uint16_t length, uint
       }
     }
   if(reflectOut != 0)
-    crc = (unsigned int)((reflect(crc) ^ xorOut) & mask);
-  return crc;
+    crc = reflect(crc, width(msbMask));
+  return (crc ^ xorOut) & mask;
   }
 
 //-------------------------------------------------------
-// Reflects bit in a uint8_t
+// Reflects the lower 'bits' bits of a value
 //-------------------------------------------------------
-uint8_t Crc16::reflect(uint8_t data, uint8_t bits) {
-  unsigned long reflection = 0x00000000;
+uint16_t Crc16::reflect(uint16_t data, uint8_t bits) const {
+  uint16_t reflection = 0x0000;
   // Reflect the data about the center bit.
   for (uint8_t bit = 0; bit < bits; bit++) {
     // If the LSB bit is set, set the reflection of it.
     if((data & 0x01) != 0) {
-      reflection |= (unsigned long)(1 << ((bits - 1) - bit));
+      reflection |= (uint16_t)(1 << ((bits - 1) - bit));
       }
-    data = (uint8_t)(data >> 1);
+    data = (uint16_t)(data >> 1);
     }
   return reflection;
   }
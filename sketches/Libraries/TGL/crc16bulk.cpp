@@ -0,0 +1,226 @@
+/*--------------------------------------------------------------------------*
+* Bulk CRC16 calculation for large buffers
+*---------------------------------------------------------------------------*
+* Slicing-by-8 tables for portable builds and carry-less multiply folding on
+* x86-64 CPUs that support PCLMULQDQ. The folding kernel follows the Intel
+* paper "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+* Instruction", the final reduction is done with the slicing tables.
+*--------------------------------------------------------------------------*/
+#include <Arduino.h>
+#include "TGL.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#  include <cpuid.h>
+#  include <immintrin.h>
+#  define CRC16_CLMUL
+#endif
+
+//---------------------------------------------------------------------------
+// Helpers
+//---------------------------------------------------------------------------
+
+/** Reverse the bits in a 16 bit value
+ */
+static uint16_t reverse16(uint16_t value) {
+  uint16_t result = 0;
+  for(int bit = 0; bit < 16; bit++, value >>= 1)
+    result = (result << 1) | (value & 1);
+  return result;
+  }
+
+/** Calculate x^n mod P (unreflected, P has an implicit x^16 term)
+ */
+static uint16_t xpow(uint16_t polynomial, int n) {
+  uint32_t result = 1;
+  while(n-- > 0) {
+    result <<= 1;
+    if(result & 0x10000)
+      result ^= 0x10000 | polynomial;
+    }
+  return (uint16_t)result;
+  }
+
+//---------------------------------------------------------------------------
+// Implementation of Crc16Bulk
+//---------------------------------------------------------------------------
+
+/** Set up for the given CRC parameters
+ *
+ * The fastest kernel supported by the CPU is selected.
+ */
+Crc16Bulk::Crc16Bulk(bool reflected, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut) {
+  m_reflected = reflected;
+  m_polynomial = polynomial;
+  m_xorIn = xorIn;
+  m_xorOut = xorOut;
+  // Base table, one byte at a time
+  uint16_t reversed = reverse16(polynomial);
+  for(int i = 0; i < 256; i++) {
+    uint16_t crc = reflected ? i : (i << 8);
+    for(int bit = 0; bit < 8; bit++) {
+      if(reflected)
+        crc = (crc & 0x0001) ? ((crc >> 1) ^ reversed) : (crc >> 1);
+      else
+        crc = (crc & 0x8000) ? ((crc << 1) ^ polynomial) : (crc << 1);
+      }
+    m_slices[0][i] = crc;
+    }
+  // Each following table is the previous one shifted by a zero byte
+  for(int slice = 1; slice < 8; slice++) {
+    for(int i = 0; i < 256; i++) {
+      uint16_t crc = m_slices[slice - 1][i];
+      if(reflected)
+        m_slices[slice][i] = (crc >> 8) ^ m_slices[0][crc & 0xff];
+      else
+        m_slices[slice][i] = (crc << 8) ^ m_slices[0][crc >> 8];
+      }
+    }
+  // Folding constants, the low half folds the low 64 bits of the
+  // accumulator. Reflected constants are x^(n-1) to allow for the one bit
+  // shift in the product of two reflected values.
+  int distance[2] = { 128, 512 };
+  uint64_t *pFold[2] = { m_fold16, m_fold64 };
+  for(int i = 0; i < 2; i++) {
+    if(reflected) {
+      pFold[i][0] = (uint64_t)reverse16(xpow(polynomial, distance[i] + 63)) << 48;
+      pFold[i][1] = (uint64_t)reverse16(xpow(polynomial, distance[i] - 1)) << 48;
+      }
+    else {
+      pFold[i][0] = xpow(polynomial, distance[i]);
+      pFold[i][1] = xpow(polynomial, distance[i] + 64);
+      }
+    }
+  // Pick the best kernel available
+  m_kernel = isSupported(Crc16Clmul) ? Crc16Clmul : Crc16Slicing8;
+  }
+
+/** Determine if a kernel can be used on this CPU
+ */
+bool Crc16Bulk::isSupported(Crc16Kernel kernel) {
+  if(kernel == Crc16Slicing8)
+    return true;
+#ifdef CRC16_CLMUL
+  unsigned int eax, ebx, ecx, edx;
+  if(kernel == Crc16Clmul && __get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+#endif
+  return false;
+  }
+
+/** Select the kernel to use
+ *
+ * @return true if the kernel was selected, false if it is not supported.
+ */
+bool Crc16Bulk::setKernel(Crc16Kernel kernel) {
+  if(!isSupported(kernel))
+    return false;
+  m_kernel = kernel;
+  return true;
+  }
+
+/** Initial register value
+ */
+uint16_t Crc16Bulk::initial() const {
+  // Reflected registers are kept in output bit order
+  return m_reflected ? reverse16(m_xorIn) : m_xorIn;
+  }
+
+/** Update a CRC register value with more data
+ */
+uint16_t Crc16Bulk::update(uint16_t crc, const void *pData, size_t length) const {
+  const uint8_t *pBytes = (const uint8_t *)pData;
+#ifdef CRC16_CLMUL
+  if((m_kernel == Crc16Clmul) && (length >= 64))
+    return clmul(crc, pBytes, length);
+#endif
+  return slicing(crc, pBytes, length);
+  }
+
+/** Slicing-by-8 kernel
+ */
+uint16_t Crc16Bulk::slicing(uint16_t crc, const uint8_t *pData, size_t length) const {
+  const uint8_t *pEnd = pData + (length & ~(size_t)7);
+  if(m_reflected) {
+    for(; pData < pEnd; pData += 8) {
+      crc ^= pData[0] | (pData[1] << 8);
+      crc = m_slices[7][crc & 0xff] ^ m_slices[6][crc >> 8] ^
+        m_slices[5][pData[2]] ^ m_slices[4][pData[3]] ^ m_slices[3][pData[4]] ^
+        m_slices[2][pData[5]] ^ m_slices[1][pData[6]] ^ m_slices[0][pData[7]];
+      }
+    for(length &= 7; length > 0; length--)
+      crc = (crc >> 8) ^ m_slices[0][(crc ^ *pData++) & 0xff];
+    }
+  else {
+    for(; pData < pEnd; pData += 8) {
+      crc ^= (pData[0] << 8) | pData[1];
+      crc = m_slices[7][crc >> 8] ^ m_slices[6][crc & 0xff] ^
+        m_slices[5][pData[2]] ^ m_slices[4][pData[3]] ^ m_slices[3][pData[4]] ^
+        m_slices[2][pData[5]] ^ m_slices[1][pData[6]] ^ m_slices[0][pData[7]];
+      }
+    for(length &= 7; length > 0; length--)
+      crc = (crc << 8) ^ m_slices[0][((crc >> 8) ^ *pData++) & 0xff];
+    }
+  return crc;
+  }
+
+#ifdef CRC16_CLMUL
+
+/** Fold a 128 bit accumulator forward and add the next block
+ */
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i fold(__m128i acc, __m128i constants, __m128i block) {
+  __m128i lo = _mm_clmulepi64_si128(acc, constants, 0x00);
+  __m128i hi = _mm_clmulepi64_si128(acc, constants, 0x11);
+  return _mm_xor_si128(_mm_xor_si128(lo, hi), block);
+  }
+
+/** Carry-less multiply folding kernel
+ *
+ * Four accumulators are folded 64 bytes at a time, merged and then folded
+ * 16 bytes at a time. What is left in the accumulator is congruent to the
+ * data processed so far so the slicing tables finish the job.
+ */
+__attribute__((target("pclmul,ssse3")))
+uint16_t Crc16Bulk::clmul(uint16_t crc, const uint8_t *pData, size_t length) const {
+  // Unreflected data is processed MSB first so needs the bytes swapped
+  const __m128i swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+  const __m128i k16 = _mm_loadu_si128((const __m128i *)m_fold16);
+  const __m128i k64 = _mm_loadu_si128((const __m128i *)m_fold64);
+  bool reflected = m_reflected;
+  #define CRC16_LOAD(p) (reflected ? _mm_loadu_si128((const __m128i *)(p)) : \
+    _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(p)), swap))
+  // Start with the first 64 bytes, the register is added to the first two
+  __m128i acc0 = CRC16_LOAD(pData);
+  __m128i acc1 = CRC16_LOAD(pData + 16);
+  __m128i acc2 = CRC16_LOAD(pData + 32);
+  __m128i acc3 = CRC16_LOAD(pData + 48);
+  if(reflected)
+    acc0 = _mm_xor_si128(acc0, _mm_cvtsi32_si128(crc));
+  else
+    acc0 = _mm_xor_si128(acc0, _mm_slli_si128(_mm_cvtsi32_si128(crc), 14));
+  pData += 64;
+  length -= 64;
+  // Fold 64 bytes at a time
+  for(; length >= 64; pData += 64, length -= 64) {
+    acc0 = fold(acc0, k64, CRC16_LOAD(pData));
+    acc1 = fold(acc1, k64, CRC16_LOAD(pData + 16));
+    acc2 = fold(acc2, k64, CRC16_LOAD(pData + 32));
+    acc3 = fold(acc3, k64, CRC16_LOAD(pData + 48));
+    }
+  // Merge the accumulators and fold any remaining 16 byte blocks
+  acc0 = fold(acc0, k16, acc1);
+  acc0 = fold(acc0, k16, acc2);
+  acc0 = fold(acc0, k16, acc3);
+  for(; length >= 16; pData += 16, length -= 16)
+    acc0 = fold(acc0, k16, CRC16_LOAD(pData));
+  #undef CRC16_LOAD
+  // Reduce the accumulator and any trailing bytes with the tables
+  uint8_t remainder[16];
+  if(!reflected)
+    acc0 = _mm_shuffle_epi8(acc0, swap);
+  _mm_storeu_si128((__m128i *)remainder, acc0);
+  crc = slicing(0, remainder, sizeof(remainder));
+  return slicing(crc, pData, length);
+  }
+
+#endif /* CRC16_CLMUL */
@@ -0,0 +1,15 @@
+/*--------------------------------------------------------------------------*
+* Arduino compatibility for host builds
+*---------------------------------------------------------------------------*
+* Just enough for the libraries to compile with a native compiler. ARDUINO
+* is not defined so the libraries use their host implementations.
+*--------------------------------------------------------------------------*/
+#ifndef __ARDUINO_H
+#define __ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#endif /* __ARDUINO_H */
@@ -0,0 +1,49 @@
+/*--------------------------------------------------------------------------*
+* Helpers shared by the host benchmarks
+*---------------------------------------------------------------------------*
+* Timing and a small deterministic random number generator so runs can be
+* compared between machines and library versions.
+*--------------------------------------------------------------------------*/
+#ifndef __BENCHMARK_H
+#define __BENCHMARK_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#  define HAVE_CYCLES
+#endif
+
+/** Get the time in seconds from an arbitrary starting point
+ */
+static inline double now() {
+  timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + (t.tv_nsec * 1e-9);
+  }
+
+/** Get the CPU time stamp counter
+ *
+ * @return the number of reference cycles or 0 if there is no counter.
+ */
+static inline uint64_t cycles() {
+#ifdef HAVE_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+  }
+
+/** Get the next value from a xorshift64* generator
+ *
+ * @param state the generator state (must not be zero).
+ */
+static inline uint64_t nextRandom(uint64_t &state) {
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ull;
+  }
+
+#endif /* __BENCHMARK_H */
@@ -0,0 +1,290 @@
+/*--------------------------------------------------------------------------*
+* CBOR and JSON size and throughput benchmark
+*---------------------------------------------------------------------------*
+* Loads JSON documents (documents/config.json and documents/telemetry.json
+* by default) and records the builder calls that produce them. The same
+* calls are made on a JsonBuilder and a CborBuilder to compare the encoded
+* sizes and the time to build each, then the time to parse each encoding
+* and read every value. The CBOR encoding is decoded and compared with the
+* original document first.
+*
+* Usage: cbor_size [document.json ...]
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string>
+#include <vector>
+#include <Json.h>
+#include <Cbor.h>
+#include "benchmark.h"
+
+// Tokens available for a document
+#define MAX_TOKENS 1024
+
+// Largest string value or name
+#define MAX_STRING 256
+
+// Size of the output buffers
+#define OUTPUT_SIZE 16384
+
+// Time spent on each measurement (seconds)
+#define DURATION 0.5
+
+/** Builder calls
+ */
+typedef enum {
+  BeginObject,
+  EndObject,
+  BeginArray,
+  EndArray,
+  AddString,
+  AddInteger,
+  AddNumber,
+  AddBoolean,
+  } Call;
+
+/** A builder call with its arguments
+ */
+typedef struct {
+  Call        call;
+  bool        named;   // Pass the name (for members of objects)
+  std::string name;
+  std::string text;
+  int         integer; // Also used for booleans
+  double      number;
+  } Operation;
+
+/** Record the calls that build a value and anything nested in it
+ *
+ * @param pName the name of the value if it is a member of an object.
+ *
+ * @return true if the value can be built.
+ */
+static bool record(JsonParser &parser, const JsonToken *pTokens, int token, const char *pName, std::vector<Operation> &operations) {
+  Operation operation;
+  char buffer[MAX_STRING];
+  long integer;
+  bool boolean;
+  operation.named = (pName != NULL);
+  operation.name = (pName != NULL) ? pName : "";
+  operation.integer = 0;
+  operation.number = 0;
+  switch(pTokens[token].type) {
+    case JsonObject:
+    case JsonArray: {
+      bool object = pTokens[token].type == JsonObject;
+      // The root object is implied by the builder
+      if(token > 0) {
+        operation.call = object ? BeginObject : BeginArray;
+        operations.push_back(operation);
+        }
+      int child = token + 1;
+      for(int i=0; i<pTokens[token].size; i++, child = parser.next(child)) {
+        if(object) {
+          if((parser.unescape(child, buffer, sizeof(buffer)) < 0) || !record(parser, pTokens, child + 1, buffer, operations))
+            return false;
+          }
+        else if(!record(parser, pTokens, child, NULL, operations))
+          return false;
+        }
+      if(token > 0) {
+        operation.call = object ? EndObject : EndArray;
+        operation.named = false;
+        operations.push_back(operation);
+        }
+      return true;
+      }
+    case JsonString:
+      if(parser.unescape(token, buffer, sizeof(buffer)) < 0)
+        return false;
+      operation.call = AddString;
+      operation.text = buffer;
+      break;
+    default:
+      if(parser.getBool(token, boolean)) {
+        operation.call = AddBoolean;
+        operation.integer = boolean;
+        }
+      else if(parser.getInt(token, integer) && (integer >= INT_MIN) && (integer <= INT_MAX)) {
+        operation.call = AddInteger;
+        operation.integer = (int)integer;
+        }
+      else if(parser.getDouble(token, operation.number))
+        operation.call = AddNumber;
+      else
+        return false; // The builders have no null
+    }
+  operations.push_back(operation);
+  return true;
+  }
+
+/** Make the recorded calls on a builder
+ *
+ * @return the length of the document or 0 on failure.
+ */
+template <class BUILDER> static int build(BUILDER &builder, const std::vector<Operation> &operations) {
+  for(size_t i=0; i<operations.size(); i++) {
+    const Operation &op = operations[i];
+    const char *cszName = op.name.c_str();
+    bool ok;
+    switch(op.call) {
+      case BeginObject: ok = op.named ? builder.beginObject(cszName) : builder.beginObject(); break;
+      case EndObject:   ok = builder.endObject(); break;
+      case BeginArray:  ok = op.named ? builder.beginArray(cszName) : builder.beginArray(); break;
+      case EndArray:    ok = builder.endArray(); break;
+      case AddString:   ok = op.named ? builder.add(cszName, op.text.c_str()) : builder.add(op.text.c_str()); break;
+      case AddInteger:  ok = op.named ? builder.add(cszName, op.integer) : builder.add(op.integer); break;
+      case AddNumber:   ok = op.named ? builder.add(cszName, op.number) : builder.add(op.number); break;
+      default:          ok = op.named ? builder.add(cszName, op.integer != 0) : builder.add(op.integer != 0);
+      }
+    if(!ok)
+      return 0;
+    }
+  return builder.end();
+  }
+
+/** Compare a value in two parsed documents
+ *
+ * @return true if the values (and everything nested in them) are equal.
+ */
+static bool compare(JsonParser &first, const JsonToken *pFirst, int a, JsonParser &second, const JsonToken *pSecond, int b) {
+  char text[2][MAX_STRING];
+  if((pFirst[a].type != pSecond[b].type) || (pFirst[a].size != pSecond[b].size))
+    return false;
+  if((pFirst[a].type == JsonObject) || (pFirst[a].type == JsonArray)) {
+    int child[2] = { a + 1, b + 1 };
+    for(int i=0; i<pFirst[a].size; i++) {
+      if(!compare(first, pFirst, child[0], second, pSecond, child[1]))
+        return false;
+      if((pFirst[a].type == JsonObject) && !compare(first, pFirst, child[0] + 1, second, pSecond, child[1] + 1))
+        return false;
+      child[0] = first.next(child[0]);
+      child[1] = second.next(child[1]);
+      }
+    return true;
+    }
+  if(pFirst[a].type == JsonString) {
+    return (first.unescape(a, text[0], MAX_STRING) >= 0) && (second.unescape(b, text[1], MAX_STRING) >= 0) && (strcmp(text[0], text[1]) == 0);
+    }
+  bool boolean[2];
+  double number[2];
+  if(first.getBool(a, boolean[0]))
+    return second.getBool(b, boolean[1]) && (boolean[0] == boolean[1]);
+  return first.getDouble(a, number[0]) && second.getDouble(b, number[1]) && (number[0] == number[1]);
+  }
+
+/** Read every value in a parsed document
+ */
+static double visit(JsonParser &parser, const JsonToken *pTokens, int count) {
+  double sum = 0, number;
+  long integer;
+  bool boolean;
+  for(int i=0; i<count; i++) {
+    if(pTokens[i].type == JsonString)
+      sum += parser.len(i);
+    else if(pTokens[i].type != JsonPrimitive)
+      continue;
+    else if(parser.getInt(i, integer))
+      sum += integer;
+    else if(parser.getDouble(i, number))
+      sum += number;
+    else if(parser.getBool(i, boolean))
+      sum += boolean;
+    }
+  return sum;
+  }
+
+/** Get the time for one run of a function, repeating it for a while
+ */
+template <class FUNCTION> static double measure(FUNCTION function) {
+  long runs = 0;
+  double start = now(), elapsed;
+  do {
+    for(int i=0; i<100; i++)
+      function();
+    runs += 100;
+    elapsed = now() - start;
+    } while(elapsed < DURATION);
+  return elapsed / runs;
+  }
+
+/** Compare the encodings of a document
+ *
+ * @return true if the document could be encoded and decoded.
+ */
+static bool benchmark(const char *cszFile) {
+  FILE *pFile = fopen(cszFile, "r");
+  if(pFile == NULL) {
+    printf("%s: could not open\n", cszFile);
+    return false;
+    }
+  std::string source;
+  char block[4096];
+  for(size_t length; (length = fread(block, 1, sizeof(block), pFile)) > 0; )
+    source.append(block, length);
+  fclose(pFile);
+  static JsonToken tokens[MAX_TOKENS], decoded[MAX_TOKENS];
+  JsonParser original(tokens, MAX_TOKENS);
+  std::vector<Operation> operations;
+  int count = original.parse(source.c_str());
+  if((count <= 0) || (tokens[0].type != JsonObject) || !record(original, tokens, 0, NULL, operations)) {
+    printf("%s: not a document the builders can produce\n", cszFile);
+    return false;
+    }
+  // Encode both ways
+  static char jsonBuffer[OUTPUT_SIZE], cborBuffer[OUTPUT_SIZE];
+  JsonFixedOutput jsonOutput(jsonBuffer, sizeof(jsonBuffer)), cborOutput(cborBuffer, sizeof(cborBuffer));
+  JsonBuilder json(jsonOutput);
+  CborBuilder cbor(cborOutput);
+  int jsonLength = build(json, operations), cborLength = build(cbor, operations);
+  // The CBOR must decode to the original document
+  CborParser cborParser(decoded, MAX_TOKENS);
+  int cborCount = cborParser.parse((const uint8_t *)cborBuffer, cborLength);
+  if((jsonLength <= 0) || (cborLength <= 0) || (cborCount != count) || !compare(original, tokens, 0, cborParser, decoded, 0)) {
+    printf("%s: the CBOR encoding does not match the document\n", cszFile);
+    return false;
+    }
+  // Build and parse times
+  double buildTime[2], parseTime[2];
+  volatile double sink = 0;
+  buildTime[0] = measure([&]() {
+    JsonFixedOutput output(jsonBuffer, sizeof(jsonBuffer));
+    JsonBuilder builder(output);
+    sink += build(builder, operations);
+    });
+  buildTime[1] = measure([&]() {
+    JsonFixedOutput output(cborBuffer, sizeof(cborBuffer));
+    CborBuilder builder(output);
+    sink += build(builder, operations);
+    });
+  JsonParser jsonParser(decoded, MAX_TOKENS);
+  parseTime[0] = measure([&]() {
+    sink += visit(jsonParser, decoded, jsonParser.parse(jsonBuffer, jsonLength));
+    });
+  parseTime[1] = measure([&]() {
+    sink += visit(cborParser, decoded, cborParser.parse((const uint8_t *)cborBuffer, cborLength));
+    });
+  printf("%s: %d tokens\n", cszFile, count);
+  printf("  Size         JSON %6d bytes   CBOR %6d bytes  (%.0f%%)\n", jsonLength, cborLength, (100.0 * cborLength) / jsonLength);
+  printf("  Build        JSON %6.0f MB/s    CBOR %6.0f MB/s   %7.0f ns against %.0f ns\n",
+    jsonLength / (buildTime[0] * 1e6), cborLength / (buildTime[1] * 1e6), buildTime[0] * 1e9, buildTime[1] * 1e9);
+  printf("  Parse, read  JSON %6.0f MB/s    CBOR %6.0f MB/s   %7.0f ns against %.0f ns\n",
+    jsonLength / (parseTime[0] * 1e6), cborLength / (parseTime[1] * 1e6), parseTime[0] * 1e9, parseTime[1] * 1e9);
+  return true;
+  }
+
+int main(int argc, char *argv[]) {
+  static const char *DEFAULTS[] = { "documents/config.json", "documents/telemetry.json" };
+  bool success = true;
+  if(argc > 1) {
+    for(int i=1; i<argc; i++)
+      success = benchmark(argv[i]) && success;
+    }
+  else {
+    for(size_t i=0; i<(sizeof(DEFAULTS) / sizeof(DEFAULTS[0])); i++)
+      success = benchmark(DEFAULTS[i]) && success;
+    }
+  return success ? 0 : 1;
+  }
@@ -0,0 +1,122 @@
+/*--------------------------------------------------------------------------*
+* Bulk CRC16 benchmark
+*---------------------------------------------------------------------------*
+* Checks both Crc16Bulk kernels bit for bit against a bitwise reference and
+* Crc16::fastCrc, then measures throughput on buffers from 16 bytes to
+* 64 MB.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <TGL.h>
+#include "benchmark.h"
+
+// Largest buffer to measure
+#define MAX_BUFFER (64u << 20)
+
+// Amount of data to process for each measurement
+#define BYTES_PER_SIZE (256u << 20)
+
+/** Reverse the order of the lowest bits of a value
+ */
+static uint16_t reflect(uint16_t data, int bits) {
+  uint16_t result = 0;
+  for(int i=0; i<bits; i++, data >>= 1)
+    result = (result << 1) | (data & 1);
+  return result;
+  }
+
+/** Bit at a time CRC for any parameters with refin == refout
+ */
+static uint16_t bitwiseCrc(bool reflected, uint16_t polynomial, uint16_t xorIn, uint16_t xorOut, const uint8_t *pData, size_t length) {
+  uint16_t crc = xorIn;
+  for(size_t i=0; i<length; i++) {
+    uint8_t c = reflected ? (uint8_t)reflect(pData[i], 8) : pData[i];
+    crc ^= c << 8;
+    for(int bit=0; bit<8; bit++)
+      crc = (crc & 0x8000) ? ((crc << 1) ^ polynomial) : (crc << 1);
+    }
+  return (reflected ? reflect(crc, 16) : crc) ^ xorOut;
+  }
+
+/** Check the kernels against the reference
+ *
+ * Standard and random parameter sets are used with random lengths and
+ * alignments. Each buffer is also processed in two parts to check that
+ * update() can be continued.
+ *
+ * @return the number of mismatches.
+ */
+static int verify(int &tests) {
+  static uint8_t buffer[5000];
+  uint64_t state = 3;
+  for(size_t i=0; i<sizeof(buffer); i++)
+    buffer[i] = (uint8_t)nextRandom(state);
+  int failed = 0;
+  tests = 0;
+  for(int p=0; p<40; p++) {
+    bool reflected = (p & 1) != 0;
+    uint16_t polynomial = (p < 4) ? 0x1021 : (p < 8) ? 0x8005 : (uint16_t)(nextRandom(state) | 1);
+    uint16_t xorIn = (uint16_t)nextRandom(state), xorOut = (uint16_t)nextRandom(state);
+    Crc16Bulk bulk(reflected, polynomial, xorIn, xorOut);
+    for(int kernel=Crc16Slicing8; kernel<=Crc16Clmul; kernel++) {
+      if(!bulk.setKernel((Crc16Kernel)kernel))
+        continue;
+      for(int i=0; i<200; i++, tests++) {
+        size_t length = nextRandom(state) % 3000, offset = nextRandom(state) % 100;
+        size_t split = (length > 0) ? (nextRandom(state) % length) : 0;
+        uint16_t expected = bitwiseCrc(reflected, polynomial, xorIn, xorOut, &buffer[offset], length);
+        uint16_t crc = bulk.update(bulk.initial(), &buffer[offset], split);
+        crc = bulk.finish(bulk.update(crc, &buffer[offset + split], length - split));
+        if((bulk.compute(&buffer[offset], length) != expected) || (crc != expected))
+          failed++;
+        }
+      }
+    }
+  // Same results as the Crc16 presets
+  Crc16 crc;
+  Crc16Bulk xmodem(false, 0x1021, 0x0000, 0x0000), kermit(true, 0x1021, 0x0000, 0x0000);
+  Crc16Bulk modbus(true, 0x8005, 0xFFFF, 0x0000), ccitt(false, 0x1021, 0xFFFF, 0x0000);
+  for(int i=0; i<1000; i++, tests++) {
+    size_t length = nextRandom(state) % 3000;
+    if((xmodem.compute(buffer, length) != crc.XModemCrc(buffer, 0, length)) ||
+       (kermit.compute(buffer, length) != crc.KermitCrc(buffer, 0, length)) ||
+       (modbus.compute(buffer, length) != crc.ModbusCrc(buffer, 0, length)) ||
+       (ccitt.compute(buffer, length) != crc.CcittFalseCrc(buffer, 0, length)))
+      failed++;
+    }
+  return failed;
+  }
+
+int main() {
+  int tests, failed = verify(tests);
+  printf("Checked %d buffers against the bitwise reference: %d mismatches\n", tests, failed);
+  if(!Crc16Bulk::isSupported(Crc16Clmul))
+    printf("PCLMULQDQ is not available, the clmul kernel is not measured\n");
+  uint8_t *pBuffer = (uint8_t *)malloc(MAX_BUFFER);
+  if(pBuffer == NULL)
+    return 1;
+  memset(pBuffer, 0x5a, MAX_BUFFER);
+  Crc16Bulk bulk(false, 0x1021, 0x0000, 0x0000);
+  Crc16 crc;
+  volatile unsigned int sink = 0;
+  printf("%9s %14s %14s %14s\n", "Size", "Crc16 table", "Slicing-by-8", "PCLMULQDQ");
+  for(size_t size=16; size<=MAX_BUFFER; size *= 4) {
+    size_t passes = BYTES_PER_SIZE / size;
+    double rate[3];
+    for(int method=0; method<3; method++) {
+      rate[method] = 0;
+      if((method == 2) && !bulk.setKernel(Crc16Clmul))
+        continue;
+      if(method == 1)
+        bulk.setKernel(Crc16Slicing8);
+      double start = now();
+      for(size_t i=0; i<passes; i++)
+        sink += (method == 0) ? crc.XModemCrc(pBuffer, 0, size) : bulk.compute(pBuffer, size);
+      rate[method] = ((double)size * passes) / ((now() - start) * 1e6);
+      }
+    printf("%9zu %9.0f MB/s %9.0f MB/s %9.0f MB/s\n", size, rate[0], rate[1], rate[2]);
+    }
+  free(pBuffer);
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,137 @@
+/*--------------------------------------------------------------------------*
+* Table driven CRC16 benchmark
+*---------------------------------------------------------------------------*
+* Compares Crc16 with the original bit at a time calculation for the preset
+* parameter sets. Every preset is checked against the standard check value
+* and against the bitwise calculation on random buffers before it is timed.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <TGL.h>
+#include "benchmark.h"
+
+// Size of the buffer used for timing (about the size of WIFI_CONFIG)
+#define BUFFER_SIZE 256
+
+// Number of passes over the buffer for each measurement
+#define PASSES 20000
+
+/** Parameters for one of the Crc16 presets
+ */
+typedef struct {
+  const char *name;
+  bool        reflected;
+  uint16_t    polynomial;
+  uint16_t    xorIn;
+  uint16_t    check;     // CRC of "123456789"
+  } Preset;
+
+static const Preset PRESETS[] = {
+  { "XModem",      false, 0x1021, 0x0000, 0x31C3 },
+  { "Kermit",      true,  0x1021, 0x0000, 0x2189 },
+  { "Modbus",      true,  0x8005, 0xFFFF, 0x4B37 },
+  { "CCITT-False", false, 0x1021, 0xFFFF, 0x29B1 },
+  };
+
+#define PRESET_COUNT (sizeof(PRESETS) / sizeof(PRESETS[0]))
+
+// Results are per cycle where there is a cycle counter
+#ifdef HAVE_CYCLES
+#  define UNIT "cycle"
+#else
+#  define UNIT "ns"
+#endif
+
+/** Get a time stamp in the units used for the results
+ */
+static double stamp() {
+#ifdef HAVE_CYCLES
+  return (double)cycles();
+#else
+  return now() * 1e9;
+#endif
+  }
+
+/** Reverse the order of the lowest bits of a value
+ */
+static uint16_t reflect(uint16_t data, int bits) {
+  uint16_t result = 0;
+  for(int i=0; i<bits; i++, data >>= 1)
+    result = (result << 1) | (data & 1);
+  return result;
+  }
+
+/** The original bit at a time CRC (Crc16::fastCrc before the tables)
+ */
+static uint16_t bitwiseCrc(const Preset &preset, const uint8_t *pData, size_t length) {
+  uint16_t crc = preset.xorIn;
+  for(size_t i=0; i<length; i++) {
+    uint8_t c = preset.reflected ? (uint8_t)reflect(pData[i], 8) : pData[i];
+    for(int j=0x80; j>0; j >>= 1) {
+      uint16_t bit = crc & 0x8000;
+      crc <<= 1;
+      if((c & j) != 0)
+        bit ^= 0x8000;
+      if(bit != 0)
+        crc ^= preset.polynomial;
+      }
+    }
+  return preset.reflected ? reflect(crc, 16) : crc;
+  }
+
+/** Calculate a CRC with the matching Crc16 preset
+ */
+static uint16_t tableCrc(Crc16 &crc, int preset, const uint8_t *pData, size_t length) {
+  switch(preset) {
+    case 0: return crc.XModemCrc(pData, 0, length);
+    case 1: return crc.KermitCrc(pData, 0, length);
+    case 2: return crc.ModbusCrc(pData, 0, length);
+    }
+  return crc.CcittFalseCrc(pData, 0, length);
+  }
+
+/** Check the table driven results against the bitwise calculation
+ *
+ * @return the number of mismatches.
+ */
+static int verify() {
+  static uint8_t buffer[1024];
+  uint64_t state = 1;
+  Crc16 crc;
+  int failed = 0;
+  for(size_t p=0; p<PRESET_COUNT; p++) {
+    if((tableCrc(crc, p, (const uint8_t *)"123456789", 9) != PRESETS[p].check) || (bitwiseCrc(PRESETS[p], (const uint8_t *)"123456789", 9) != PRESETS[p].check)) {
+      printf("%s: wrong check value\n", PRESETS[p].name);
+      failed++;
+      }
+    for(int i=0; i<10000; i++) {
+      size_t length = nextRandom(state) % sizeof(buffer);
+      for(size_t j=0; j<length; j++)
+        buffer[j] = (uint8_t)nextRandom(state);
+      if(tableCrc(crc, p, buffer, length) != bitwiseCrc(PRESETS[p], buffer, length))
+        failed++;
+      }
+    }
+  return failed;
+  }
+
+int main() {
+  int failed = verify();
+  printf("Verified %d presets against the bitwise calculation: %d mismatches\n", (int)PRESET_COUNT, failed);
+  static uint8_t buffer[BUFFER_SIZE];
+  for(int i=0; i<BUFFER_SIZE; i++)
+    buffer[i] = (uint8_t)(i * 7);
+  Crc16 crc;
+  volatile unsigned int sink = 0;
+  for(size_t p=0; p<PRESET_COUNT; p++) {
+    double rate[2];
+    for(int method=0; method<2; method++) {
+      double start = stamp();
+      for(int i=0; i<PASSES; i++)
+        sink += (method == 0) ? bitwiseCrc(PRESETS[p], buffer, BUFFER_SIZE) : tableCrc(crc, p, buffer, BUFFER_SIZE);
+      rate[method] = ((double)BUFFER_SIZE * PASSES) / (stamp() - start);
+      }
+    printf("%-12s bitwise %6.3f bytes/" UNIT ", table %6.3f bytes/" UNIT " (%.1fx)\n", PRESETS[p].name, rate[0], rate[1], rate[1] / rate[0]);
+    }
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,137 @@
+/*--------------------------------------------------------------------------*
+* JSON string escaping benchmark
+*---------------------------------------------------------------------------*
+* Checks the strings written by JsonBuilder against a simple per character
+* escaper on 200000 random strings (with quotes, backslashes, control and
+* UTF-8 characters at random alignments), then compares the time to add
+* realistic names and values with writing them a character at a time.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <Json.h>
+#include "benchmark.h"
+
+// Passes over each payload for each measurement
+#define PASSES 1000000
+
+/** Get the escape sequence for a character
+ *
+ * @return the length of the sequence or 0 if the character is not escaped.
+ */
+static int escapeSequence(char ch, char *buffer) {
+  switch(ch) {
+    case '\"': strcpy(buffer, "\\\""); return 2;
+    case '\\': strcpy(buffer, "\\\\"); return 2;
+    case '\b': strcpy(buffer, "\\b"); return 2;
+    case '\f': strcpy(buffer, "\\f"); return 2;
+    case '\n': strcpy(buffer, "\\n"); return 2;
+    case '\r': strcpy(buffer, "\\r"); return 2;
+    case '\t': strcpy(buffer, "\\t"); return 2;
+    }
+  if((unsigned char)ch < 0x20)
+    return snprintf(buffer, 7, "\\u%04x", ch);
+  return 0;
+  }
+
+/** Quote and escape a string a character at a time
+ */
+static std::string reference(const char *cszString) {
+  std::string result = "\"";
+  char buffer[8];
+  for(; *cszString != '\0'; cszString++) {
+    if(escapeSequence(*cszString, buffer) > 0)
+      result += buffer;
+    else
+      result += *cszString;
+    }
+  return result + "\"";
+  }
+
+/** Write a quoted string a character at a time, the naive way
+ */
+static bool naiveString(JsonOutput &output, const char *cszString) {
+  if(!output.write('\"'))
+    return false;
+  char buffer[8];
+  for(; *cszString != '\0'; cszString++) {
+    int length = escapeSequence(*cszString, buffer);
+    if(!((length > 0) ? output.write(buffer, length) : output.write(*cszString)))
+      return false;
+    }
+  return output.write('\"');
+  }
+
+/** Compare the builder with the reference on random strings
+ *
+ * @return the number of strings that differ.
+ */
+static int verify() {
+  static const char SPECIAL[] = "\"\\\b\f\n\r\t\x01\x1f\x7f\xc3\xa9 /";
+  static char buffer[256];
+  uint64_t state = 1;
+  int failed = 0;
+  for(int i=0; i<200000; i++) {
+    // Random offsets so the strings start and end anywhere in a word
+    char *pValue = buffer + (nextRandom(state) % 32), *pName = buffer + 160 + (nextRandom(state) % 32);
+    int valueLength = nextRandom(state) % 120, nameLength = nextRandom(state) % 8;
+    for(int j=0; j<valueLength; j++) {
+      uint64_t r = nextRandom(state);
+      pValue[j] = ((r & 3) != 0) ? (char)('a' + ((r >> 8) % 26)) : SPECIAL[(r >> 8) % (sizeof(SPECIAL) - 1)];
+      }
+    pValue[valueLength] = '\0';
+    for(int j=0; j<nameLength; j++)
+      pName[j] = SPECIAL[nextRandom(state) % (sizeof(SPECIAL) - 1)];
+    pName[nameLength] = '\0';
+    JsonBuilder builder;
+    builder.add(pName, pValue);
+    builder.beginArray("a");
+    builder.add(pValue);
+    builder.endArray();
+    builder.end();
+    std::string expected = "{" + reference(pName) + ":" + reference(pValue) + ",\"a\":[" + reference(pValue) + "]}";
+    if(expected != builder.getResult())
+      failed++;
+    }
+  return failed;
+  }
+
+int main() {
+  int failed = verify();
+  printf("Compared 200000 random strings with the reference: %d differ\n", failed);
+  static const char *PAYLOADS[][2] = {
+    { "ssid",   "HomeNetwork-5G" },
+    { "topic",  "home/garden/sensor-node-01/temperature" },
+    { "log",    "2024-01-01 12:00:00 INFO connected to access point, got address 192.168.1.42 after 3 attempts (rssi -67 dBm)" },
+    { "quoted", "say \"hello\" to C:\\path\\file and\tthen\nmore text follows here without any escapes at all" },
+    };
+  char buffer[512];
+  volatile size_t sink = 0;
+  for(size_t p=0; p<(sizeof(PAYLOADS) / sizeof(PAYLOADS[0])); p++) {
+    const char *cszName = PAYLOADS[p][0], *cszValue = PAYLOADS[p][1];
+    double elapsed[3];
+    for(int method=0; method<3; method++) {
+      double start = now();
+      for(int i=0; i<PASSES; i++) {
+        JsonFixedOutput output(buffer, sizeof(buffer));
+        if(method == 0) {
+          naiveString(output, cszName);
+          output.write(':');
+          naiveString(output, cszValue);
+          }
+        else {
+          // Method 2 is the cost of an empty builder to subtract
+          JsonBuilder builder(output);
+          if(method == 1)
+            builder.add(cszName, cszValue);
+          }
+        sink += output.length();
+        }
+      elapsed[method] = ((now() - start) * 1e9) / PASSES;
+      }
+    double added = elapsed[1] - elapsed[2];
+    printf("%-7s %3d bytes: per character %6.1f ns, builder %6.1f ns (%.1fx)\n", cszName, (int)strlen(cszValue), elapsed[0], added, elapsed[0] / added);
+    }
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,171 @@
+/*--------------------------------------------------------------------------*
+* In place JSON parsing benchmark
+*---------------------------------------------------------------------------*
+* Parses every line of a memory mapped NDJSON file where it lies, with
+* parse(pData, length), and again by copying each line into a NUL terminated
+* buffer first as was needed before. The file is mapped read only and has
+* no NUL characters so the in place parse cannot write to or read past the
+* data. Both ways must give the same tokens for every line.
+*
+* Usage: json_inplace [file [megabytes]]
+*
+* The file (telemetry.ndjson by default) is generated with the given size
+* (256 MB by default) if it does not exist or a size is given. Use a size
+* larger than the memory of the machine to include the cost of paging.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <Json.h>
+#include "benchmark.h"
+
+// Tokens available for each line
+#define MAX_TOKENS 64
+
+/** Write a file of generated telemetry records, one per line
+ *
+ * @return true if the file was written.
+ */
+static bool generate(const char *cszFile, size_t megabytes) {
+  FILE *pFile = fopen(cszFile, "w");
+  if(pFile == NULL)
+    return false;
+  static const char *NODES[] = { "kitchen", "garage", "office \\\"upstairs\\\"", "hall\\u00e9" };
+  uint64_t state = 7;
+  size_t written = 0;
+  for(unsigned long i=0; written<(megabytes << 20); i++) {
+    uint64_t r = nextRandom(state);
+    int length = fprintf(pFile, "{\"seq\":%lu,\"node\":\"%s\",\"temp\":%.2f,\"rssi\":%d,\"on\":%s,\"tags\":[\"a\",\"b\",%d],\"extra\":null}\n",
+      i, NODES[r & 3], ((r >> 8) % 4000) / 100.0, -(int)((r >> 20) % 90), ((r >> 30) & 1) ? "true" : "false", (int)((r >> 32) % 1000));
+    if(length < 0)
+      break;
+    written += length;
+    }
+  return fclose(pFile) == 0;
+  }
+
+/** Check that two parses of the same line gave the same tokens
+ */
+static bool sameTokens(const JsonToken *pFirst, const JsonToken *pSecond, int count) {
+  for(int i=0; i<count; i++) {
+    if((pFirst[i].type != pSecond[i].type) || (pFirst[i].start != pSecond[i].start) || (pFirst[i].end != pSecond[i].end) ||
+        (pFirst[i].size != pSecond[i].size) || (pFirst[i].next != pSecond[i].next))
+      return false;
+    }
+  return true;
+  }
+
+/** Parse every line of the data
+ *
+ * @param copy true to copy each line to a NUL terminated buffer first.
+ * @param lines receives the number of lines.
+ *
+ * @return the total number of tokens or -1 if a line did not parse.
+ */
+static long parseLines(const char *pData, size_t size, bool copy, size_t &lines) {
+  JsonToken tokens[MAX_TOKENS];
+  JsonParser parser(tokens, MAX_TOKENS);
+  size_t capacity = 256;
+  char *pBuffer = (char *)malloc(capacity);
+  long total = 0;
+  lines = 0;
+  if(pBuffer == NULL)
+    return -1;
+  for(const char *pLine = pData, *pEnd = pData + size; pLine < pEnd; ) {
+    const char *pNext = (const char *)memchr(pLine, '\n', pEnd - pLine);
+    size_t length = (pNext == NULL) ? (pEnd - pLine) : (pNext - pLine);
+    int count;
+    if(copy) {
+      if((length + 1) > capacity) {
+        free(pBuffer);
+        capacity = length + 1;
+        pBuffer = (char *)malloc(capacity);
+        if(pBuffer == NULL)
+          return -1;
+        }
+      memcpy(pBuffer, pLine, length);
+      pBuffer[length] = '\0';
+      count = parser.parse(pBuffer);
+      }
+    else
+      count = parser.parse(pLine, length);
+    if(count <= 0)
+      total = -1;
+    else if(total >= 0)
+      total += count;
+    lines++;
+    pLine += length + 1;
+    }
+  free(pBuffer);
+  return total;
+  }
+
+/** Parse every line both ways and compare the tokens
+ *
+ * @return the number of lines that differ.
+ */
+static size_t verify(const char *pData, size_t size) {
+  JsonToken inPlace[MAX_TOKENS], copied[MAX_TOKENS];
+  JsonParser parser(inPlace, MAX_TOKENS), check(copied, MAX_TOKENS);
+  char buffer[1024];
+  size_t failed = 0;
+  for(const char *pLine = pData, *pEnd = pData + size; pLine < pEnd; ) {
+    const char *pNext = (const char *)memchr(pLine, '\n', pEnd - pLine);
+    size_t length = (pNext == NULL) ? (pEnd - pLine) : (pNext - pLine);
+    if(length >= sizeof(buffer))
+      failed++;
+    else {
+      memcpy(buffer, pLine, length);
+      buffer[length] = '\0';
+      int count = parser.parse(pLine, length);
+      if((count <= 0) || (count != check.parse(buffer)) || !sameTokens(inPlace, copied, count))
+        failed++;
+      }
+    pLine += length + 1;
+    }
+  return failed;
+  }
+
+int main(int argc, char *argv[]) {
+  const char *cszFile = (argc > 1) ? argv[1] : "telemetry.ndjson";
+  struct stat info;
+  if((argc > 2) || (stat(cszFile, &info) != 0)) {
+    size_t megabytes = (argc > 2) ? strtoul(argv[2], NULL, 10) : 256;
+    printf("Writing %zu MB to %s\n", megabytes, cszFile);
+    if(!generate(cszFile, megabytes) || (stat(cszFile, &info) != 0)) {
+      printf("Could not write %s\n", cszFile);
+      return 1;
+      }
+    }
+  int fd = open(cszFile, O_RDONLY);
+  if((fd < 0) || (info.st_size == 0)) {
+    printf("Could not open %s\n", cszFile);
+    return 1;
+    }
+  size_t size = info.st_size;
+  const char *pData = (const char *)mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(pData == MAP_FAILED) {
+    printf("Could not map %s\n", cszFile);
+    return 1;
+    }
+  madvise((void *)pData, size, MADV_SEQUENTIAL);
+  size_t failed = verify(pData, size);
+  printf("Compared the tokens of every line: %zu mismatches\n", failed);
+  for(int copy=1; copy>=0; copy--) {
+    size_t lines;
+    double start = now();
+    long tokens = parseLines(pData, size, copy != 0, lines);
+    double elapsed = now() - start;
+    printf("%-15s %9zu lines %10ld tokens %7.0f MB/s %6.0f ns/line\n", copy ? "Copy and parse" : "Parse in place",
+      lines, tokens, (size / elapsed) / 1e6, (elapsed * 1e9) / lines);
+    if(tokens < 0)
+      failed++;
+    }
+  munmap((void *)pData, size);
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,81 @@
+/*--------------------------------------------------------------------------*
+* JSON container closing benchmark
+*---------------------------------------------------------------------------*
+* Parses arrays of 1250 to 20000 small objects and reports the time per
+* element. With JSON_PARENT_LINKS the time per element stays the same as
+* the array grows, without it every separator and closing bracket scans
+* back through the tokens so the time grows with the size of the array.
+* Build once with and once without -DJSON_PARENT_LINKS to compare.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <Json.h>
+#include "benchmark.h"
+
+// Tokens used by each element: the object, two keys, two values and the
+// two array elements
+#define TOKENS_PER_ELEMENT 7
+
+/** Build an array of small objects
+ */
+static std::string buildArray(int elements) {
+  std::string json = "[";
+  char element[64];
+  for(int i=0; i<elements; i++) {
+    snprintf(element, sizeof(element), "%s{\"id\":%d,\"v\":[1,2]}", (i == 0) ? "" : ",", i);
+    json += element;
+    }
+  return json + "]";
+  }
+
+/** Check the structure of the parsed array
+ *
+ * @return true if the tokens describe the array that was built.
+ */
+static bool verify(JsonParser &parser, const JsonToken *pTokens, int count, int elements) {
+  if((count != (1 + (elements * TOKENS_PER_ELEMENT))) || (parser.size(0) != elements))
+    return false;
+  int element = 1;
+  for(int i=0; i<elements; i++, element = parser.next(element)) {
+    long id;
+    if((parser.size(element) != 2) || !parser.getInt(parser.find(element, "id"), id) || (id != i))
+      return false;
+#ifdef JSON_PARENT_LINKS
+    if((pTokens[element].parent != 0) || (pTokens[element + 1].parent != element))
+      return false;
+#else
+    (void)pTokens;
+#endif
+    }
+  return element == count;
+  }
+
+int main() {
+#ifdef JSON_PARENT_LINKS
+  printf("Parent links enabled\n");
+#else
+  printf("Parent links disabled\n");
+#endif
+  bool success = true;
+  for(int elements=1250; elements<=20000; elements *= 2) {
+    std::string json = buildArray(elements);
+    int tokens = 1 + (elements * TOKENS_PER_ELEMENT);
+    JsonToken *pTokens = (JsonToken *)malloc(tokens * sizeof(JsonToken));
+    JsonParser parser(pTokens, tokens);
+    int count = parser.parse(json.c_str());
+    if(!verify(parser, pTokens, count, elements)) {
+      printf("%6d elements: wrong tokens\n", elements);
+      success = false;
+      }
+    const int passes = 10;
+    double start = now();
+    for(int i=0; i<passes; i++)
+      count = parser.parse(json.c_str());
+    double elapsed = (now() - start) / passes;
+    printf("%6d elements %7d tokens %9.0f us %7.1f ns/element\n", elements, count, elapsed * 1e6, (elapsed * 1e9) / elements);
+    free(pTokens);
+    }
+  return success ? 0 : 1;
+  }
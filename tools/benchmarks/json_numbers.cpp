@@ -0,0 +1,135 @@
+/*--------------------------------------------------------------------------*
+* JSON number formatting benchmark
+*---------------------------------------------------------------------------*
+* Checks that JsonFormat::number() always converts back to the same double
+* (and how often it uses more digits than the shortest representation) and
+* that JsonFormat::integer() matches printf(). It then compares both with
+* the snprintf() calls the builder used before on sensor readings.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <Json.h>
+#include "benchmark.h"
+
+// Number of values to format for each measurement
+#define VALUES 10000
+
+// Passes over the values for each measurement
+#define PASSES 100
+
+/** Count the significant digits of a formatted number
+ */
+static int significantDigits(const char *cszNumber) {
+  const char *pFirst = NULL, *pLast = NULL;
+  for(const char *pChar = cszNumber; (*pChar != '\0') && (*pChar != 'e') && (*pChar != 'E'); pChar++) {
+    if((*pChar >= '1') && (*pChar <= '9')) {
+      if(pFirst == NULL)
+        pFirst = pChar;
+      pLast = pChar;
+      }
+    }
+  if(pFirst == NULL)
+    return 1;
+  int digits = 0;
+  for(const char *pChar = pFirst; pChar <= pLast; pChar++) {
+    if(*pChar != '.')
+      digits++;
+    }
+  return digits;
+  }
+
+/** Get the fewest significant digits that convert back to a value
+ */
+static int shortestDigits(double value) {
+  char buffer[40];
+  for(int precision=1; precision<17; precision++) {
+    snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+    if(strtod(buffer, NULL) == value)
+      return precision;
+    }
+  return 17;
+  }
+
+/** Check the formatting of random values
+ *
+ * @param longer receives the number of doubles formatted with more digits
+ *               than needed.
+ *
+ * @return the number of failures.
+ */
+static long verify(long &tests, long &longer) {
+  uint64_t state = 9;
+  char buffer[JSON_NUMBER_SIZE], expected[JSON_INTEGER_SIZE];
+  long failed = 0;
+  tests = longer = 0;
+  // Any bit pattern, sensor readings and values around the exponent limits
+  for(long i=0; i<1000000; i++) {
+    uint64_t r = nextRandom(state);
+    double value;
+    if((i % 3) == 0)
+      memcpy(&value, &r, sizeof(value));
+    else if((i % 3) == 1)
+      value = (double)((int64_t)(r % 2000000) - 1000000) / 100.0;
+    else
+      value = ldexp((double)(r >> 11), (int)((r >> 3) % 2100) - 1100);
+    if(isnan(value) || isinf(value))
+      continue;
+    tests++;
+    int length = JsonFormat::number(buffer, value);
+    double back = strtod(buffer, NULL);
+    if((length != (int)strlen(buffer)) || (length >= JSON_NUMBER_SIZE) || (memcmp(&back, &value, sizeof(value)) != 0))
+      failed++;
+    else if(significantDigits(buffer) > shortestDigits(value))
+      longer++;
+    }
+  static const double SPECIAL[] = { NAN, INFINITY, -INFINITY };
+  for(size_t i=0; i<(sizeof(SPECIAL) / sizeof(SPECIAL[0])); i++, tests++) {
+    if((JsonFormat::number(buffer, SPECIAL[i]) != 4) || (strcmp(buffer, "null") != 0))
+      failed++;
+    }
+  // Integers of every length
+  static const long LIMITS[] = { 0, -1, 9, 10, 99, 100, -100, LONG_MAX, LONG_MIN };
+  for(long i=0; i<1000000 + (long)(sizeof(LIMITS) / sizeof(LIMITS[0])); i++, tests++) {
+    uint64_t r = nextRandom(state);
+    long value = (i < (long)(sizeof(LIMITS) / sizeof(LIMITS[0]))) ? LIMITS[i] : ((long)(r >> (r % 64)) * ((i & 1) ? 1 : -1));
+    int length = JsonFormat::integer(buffer, value);
+    snprintf(expected, sizeof(expected), "%ld", value);
+    if((length != (int)strlen(expected)) || (strcmp(buffer, expected) != 0))
+      failed++;
+    }
+  return failed;
+  }
+
+int main() {
+  long tests, longer, failed = verify(tests, longer);
+  printf("Checked %ld values: %ld failures, %ld doubles longer than the shortest form\n", tests, failed, longer);
+  static double readings[VALUES];
+  static long integers[VALUES];
+  uint64_t state = 17;
+  for(int i=0; i<VALUES; i++) {
+    readings[i] = (double)((int)(nextRandom(state) % 100000) - 20000) / 100.0;
+    integers[i] = (long)(nextRandom(state) % 2000000) - 1000000;
+    }
+  static const char *METHODS[] = { "snprintf %ld", "JsonFormat::integer", "snprintf %g", "snprintf %.17g", "JsonFormat::number" };
+  char buffer[40];
+  volatile int sink = 0;
+  for(int method=0; method<5; method++) {
+    double start = now();
+    for(int pass=0; pass<PASSES; pass++) {
+      for(int i=0; i<VALUES; i++) {
+        switch(method) {
+          case 0: sink += snprintf(buffer, sizeof(buffer), "%ld", integers[i]); break;
+          case 1: sink += JsonFormat::integer(buffer, integers[i]); break;
+          case 2: sink += snprintf(buffer, sizeof(buffer), "%g", readings[i]); break;
+          case 3: sink += snprintf(buffer, sizeof(buffer), "%.17g", readings[i]); break;
+          default: sink += JsonFormat::number(buffer, readings[i]);
+          }
+        }
+      }
+    printf("%-20s %6.1f ns/value\n", METHODS[method], ((now() - start) * 1e9) / ((double)PASSES * VALUES));
+    }
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,257 @@
+/*--------------------------------------------------------------------------*
+* Streamed JsonBuilder output check
+*---------------------------------------------------------------------------*
+* Builds random documents with the default in memory output and through a
+* JsonStreamOutput with a small window sending to a mock sink, with and
+* without chunked transfer encoding. The streamed data (after removing the
+* chunk framing) must be identical to the in memory result. It then reports
+* the peak heap used by each way of building telemetry documents of
+* increasing size.
+*
+* The heap is measured by wrapping malloc(), realloc() and free() so it
+* must be linked with -Wl,--wrap=malloc,--wrap=realloc,--wrap=free. Only
+* the calls made by the library and this program are counted, the memory
+* used by the mock sink to collect the output is not.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <Json.h>
+#include "benchmark.h"
+
+// Size of the window used for the telemetry documents
+#define WINDOW_SIZE 256
+
+// Space before each allocation to record its size (keeps the alignment)
+#define HEADER_SIZE 16
+
+static size_t g_heapUsed = 0;
+static size_t g_heapPeak = 0;
+
+extern "C" {
+  void *__real_malloc(size_t size);
+  void *__real_realloc(void *pBlock, size_t size);
+  void __real_free(void *pBlock);
+
+  void *__wrap_malloc(size_t size) {
+    char *pBlock = (char *)__real_malloc(size + HEADER_SIZE);
+    if(pBlock == NULL)
+      return NULL;
+    *(size_t *)pBlock = size;
+    g_heapUsed += size;
+    if(g_heapUsed > g_heapPeak)
+      g_heapPeak = g_heapUsed;
+    return pBlock + HEADER_SIZE;
+    }
+
+  void __wrap_free(void *pBlock) {
+    if(pBlock == NULL)
+      return;
+    char *pHeader = (char *)pBlock - HEADER_SIZE;
+    g_heapUsed -= *(size_t *)pHeader;
+    __real_free(pHeader);
+    }
+
+  void *__wrap_realloc(void *pBlock, size_t size) {
+    if(pBlock == NULL)
+      return __wrap_malloc(size);
+    char *pHeader = (char *)pBlock - HEADER_SIZE;
+    size_t old = *(size_t *)pHeader;
+    pHeader = (char *)__real_realloc(pHeader, size + HEADER_SIZE);
+    if(pHeader == NULL)
+      return NULL;
+    *(size_t *)pHeader = size;
+    g_heapUsed = g_heapUsed - old + size;
+    if(g_heapUsed > g_heapPeak)
+      g_heapPeak = g_heapUsed;
+    return pHeader + HEADER_SIZE;
+    }
+  }
+
+/** Stream output that collects the data, like a network client would
+ */
+class MockOutput : public JsonStreamOutput {
+  protected:
+    virtual bool send(const char *pData, size_t length) {
+      if((m_data.size() + length) > m_limit)
+        return false;
+      m_data.append(pData, length);
+      return true;
+      }
+
+  public:
+    std::string m_data;  // Everything sent so far
+    size_t      m_limit; // Fail any send that would go past this
+
+    MockOutput(char *buffer, size_t size, bool chunked) : JsonStreamOutput(buffer, size, chunked), m_limit((size_t)-1) {
+      }
+  };
+
+/** Remove HTTP chunked transfer encoding
+ *
+ * @param valid set to true if the framing was correct and ended with the
+ *              final chunk.
+ */
+static std::string dechunk(const std::string &data, bool &valid) {
+  std::string result;
+  size_t position = 0;
+  valid = false;
+  while(position < data.size()) {
+    size_t end = data.find("\r\n", position);
+    if(end == std::string::npos)
+      break;
+    size_t length = strtoul(data.substr(position, end - position).c_str(), NULL, 16);
+    position = end + 2;
+    if(length == 0) {
+      valid = data.compare(position, std::string::npos, "\r\n") == 0;
+      break;
+      }
+    if(data.compare(position + length, 2, "\r\n") != 0)
+      break;
+    result.append(data, position, length);
+    position += length + 2;
+    }
+  return result;
+  }
+
+/** Apply one builder operation
+ *
+ * Invalid sequences (closing the wrong container, adding names in an
+ * array) are included on purpose, both builders must reject them alike.
+ */
+static bool apply(JsonBuilder &builder, int operation, int value) {
+  char name[8];
+  snprintf(name, sizeof(name), "k%d", value % 50);
+  switch(operation) {
+    case 0:  return builder.add(name, "a \"quoted\" string\n");
+    case 1:  return builder.add(name, (value & 1) != 0);
+    case 2:  return builder.add(name, value);
+    case 3:  return builder.add(name, value / 7.0);
+    case 4:  return builder.beginObject(name);
+    case 5:  return builder.beginObject();
+    case 6:  return builder.endObject();
+    case 7:  return builder.beginArray(name);
+    case 8:  return builder.beginArray();
+    case 9:  return builder.endArray();
+    case 10: return builder.add("value");
+    case 11: return builder.add((value & 1) != 0);
+    case 12: return builder.add(value);
+    }
+  return builder.add(value / 3.0);
+  }
+
+/** Compare random documents built in memory and streamed
+ *
+ * @return the number of documents that differ.
+ */
+static int verify(int &tests) {
+  uint64_t state = 11;
+  int failed = 0;
+  for(tests=0; tests<20000; tests++) {
+    uint64_t operations = nextRandom(state);
+    size_t size = 2 + (nextRandom(state) % 64);
+    bool chunked = (nextRandom(state) & 1) != 0;
+    char window[66];
+    MockOutput output(window, size, chunked);
+    JsonBuilder memory, streamed(output);
+    bool same = true;
+    for(int i=(int)(nextRandom(operations) % 300); i>0; i--) {
+      int operation = nextRandom(operations) % 14, value = nextRandom(operations) % 1000;
+      if(apply(memory, operation, value) != apply(streamed, operation, value))
+        same = false;
+      }
+    bool valid = true;
+    int length = memory.end();
+    if(streamed.end() != length)
+      same = false;
+    std::string data = chunked ? dechunk(output.m_data, valid) : output.m_data;
+    if(!same || !valid || (data != memory.getResult()))
+      failed++;
+    }
+  // Output to a file descriptor
+  char window[16];
+  FILE *pFile = tmpfile();
+  if(pFile == NULL)
+    return failed + 1;
+  JsonFileOutput file(fileno(pFile), window, sizeof(window), true);
+  JsonBuilder memory, streamed(file);
+  for(int i=0; i<100; i++) {
+    apply(memory, 2, i);
+    apply(streamed, 2, i);
+    }
+  int length = memory.end();
+  bool same = streamed.end() == length;
+  std::string data(4096, '\0');
+  bool valid = false;
+  rewind(pFile);
+  data.resize(fread(&data[0], 1, data.size(), pFile));
+  fclose(pFile);
+  tests++;
+  if(!same || (dechunk(data, valid) != memory.getResult()) || !valid)
+    failed++;
+  // A failed send fails everything after it
+  MockOutput broken(window, sizeof(window), false);
+  JsonBuilder builder(broken);
+  broken.m_limit = 20;
+  bool added = true;
+  for(int i=0; i<20; i++)
+    added = builder.add("key", i);
+  tests++;
+  if(added || (builder.end() != 0) || (broken.m_data.size() > 20))
+    failed++;
+  return failed;
+  }
+
+/** Build a telemetry document
+ *
+ * @return the length of the document.
+ */
+static int buildTelemetry(JsonBuilder &builder, int readings) {
+  builder.add("device", "greenhouse-2");
+  builder.beginArray("readings");
+  for(int i=0; i<readings; i++) {
+    builder.beginObject();
+    builder.add("t", 15 + (i % 2000) / 100.0);
+    builder.add("h", (i % 1000) / 10.0);
+    builder.add("v", i % 4096);
+    builder.add("ok", (i & 1) != 0);
+    builder.endObject();
+    }
+  builder.endArray();
+  return builder.end();
+  }
+
+int main() {
+  int tests, failed = verify(tests);
+  printf("Compared %d streamed documents with the in memory result: %d differ\n", tests, failed);
+  printf("%9s %9s %19s %19s\n", "Readings", "Length", "In memory (heap)", "Streamed (heap)");
+  for(int readings=10; readings<=10000; readings *= 10) {
+    size_t peak[2];
+    int length[2];
+    std::string data;
+    for(int streamed=0; streamed<2; streamed++) {
+      g_heapPeak = g_heapUsed;
+      size_t base = g_heapUsed;
+      if(streamed) {
+        char window[WINDOW_SIZE];
+        MockOutput output(window, sizeof(window), false);
+        JsonBuilder builder(output);
+        length[streamed] = buildTelemetry(builder, readings);
+        if(output.m_data != data)
+          failed++;
+        }
+      else {
+        JsonBuilder builder;
+        length[streamed] = buildTelemetry(builder, readings);
+        data = builder.getResult();
+        }
+      peak[streamed] = g_heapPeak - base;
+      }
+    if(length[0] != length[1])
+      failed++;
+    printf("%9d %9d %13zu bytes %13zu bytes + %d byte window\n", readings, length[0], peak[0], peak[1], WINDOW_SIZE);
+    }
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,202 @@
+/*--------------------------------------------------------------------------*
+* JSON value accessor benchmark
+*---------------------------------------------------------------------------*
+* Checks the JsonParser typed accessors against the C library and then
+* compares them with copying each token out and calling atof() or atol(),
+* as IotConfig did before, on a telemetry document of 200 readings.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <errno.h>
+#include <string>
+#include <Json.h>
+#include "benchmark.h"
+
+// Tokens available for the telemetry document
+#define MAX_TOKENS 4000
+
+// Passes over the telemetry document for each measurement
+#define PASSES 2000
+
+/** Parse a single value wrapped in an array
+ *
+ * @return true if the document parsed, the value is token 1.
+ */
+static bool parseValue(JsonParser &parser, std::string &json, const char *cszValue) {
+  json = std::string("[") + cszValue + "]";
+  return parser.parse(json.data(), json.size()) == 2;
+  }
+
+/** Check getDouble() against strtod() for a number
+ *
+ * @return true if the results are identical.
+ */
+static bool checkDouble(const char *cszNumber) {
+  JsonToken tokens[4];
+  JsonParser parser(tokens, 4);
+  std::string json;
+  double value, expected = strtod(cszNumber, NULL);
+  return parseValue(parser, json, cszNumber) && parser.getDouble(1, value) && (memcmp(&value, &expected, sizeof(value)) == 0);
+  }
+
+/** Check getInt() against strtol() for a number
+ *
+ * @return true if both accept the number with the same value or both
+ *         reject it.
+ */
+static bool checkInt(const char *cszNumber) {
+  JsonToken tokens[4];
+  JsonParser parser(tokens, 4);
+  std::string json;
+  char *pEnd;
+  errno = 0;
+  long value, expected = strtol(cszNumber, &pEnd, 10);
+  bool valid = (*cszNumber != '\0') && (*pEnd == '\0') && (errno == 0);
+  if(!parseValue(parser, json, cszNumber))
+    return false;
+  bool ok = parser.getInt(1, value);
+  return (ok == valid) && (!ok || (value == expected));
+  }
+
+/** Check the accessors on random and edge case values
+ *
+ * @return the number of failures.
+ */
+static int verify(int &tests) {
+  uint64_t state = 3;
+  int failed = 0;
+  char number[256];
+  tests = 0;
+  // Numbers in the forms used by printf and sensors, and very long ones
+  for(int i=0; i<1000000; i++, tests++) {
+    uint64_t r = nextRandom(state), mantissa = nextRandom(state) >> 11;
+    switch(r % 5) {
+      case 0:
+        snprintf(number, sizeof(number), "%.*g", (int)((r >> 8) % 17) + 1, ldexp((double)mantissa, (int)((r >> 16) % 200) - 100));
+        break;
+      case 1:
+        snprintf(number, sizeof(number), "%lld", (long long)(nextRandom(state) >> ((r >> 8) % 64)) * (((r >> 16) & 1) ? 1 : -1));
+        break;
+      case 2:
+        snprintf(number, sizeof(number), "%d.%0*d", (int)((r >> 8) % 100000) - 50000, (int)((r >> 32) % 8) + 1, (int)(mantissa % 10000000));
+        break;
+      case 3:
+        snprintf(number, sizeof(number), "%.17e", ldexp((double)mantissa, (int)((r >> 8) % 1900) - 1000));
+        break;
+      default: {
+        int length = ((r >> 8) % 180) + 1, point = (r >> 16) % (length + 1);
+        char *pChar = number;
+        if((r >> 32) & 1)
+          *pChar++ = '-';
+        for(int j=0; j<length; j++) {
+          if((j == point) && (j > 0))
+            *pChar++ = '.';
+          *pChar++ = '0' + (((j == 0) ? (1 + nextRandom(state) % 9) : nextRandom(state)) % 10);
+          }
+        snprintf(pChar, number + sizeof(number) - pChar, "e%d", (int)((r >> 40) % 800) - 400);
+        }
+      }
+    if(!checkDouble(number) || !checkInt(number))
+      failed++;
+    }
+  // Invalid numbers and integer limits
+  static const char *INVALID[] = { "-", "1.", "1e", ".5", "1e+", "--1", "1x", "tru", "0x10" };
+  for(size_t i=0; i<(sizeof(INVALID) / sizeof(INVALID[0])); i++, tests++) {
+    JsonToken tokens[4];
+    JsonParser parser(tokens, 4);
+    std::string json;
+    double value;
+    if(parseValue(parser, json, INVALID[i]) && parser.getDouble(1, value))
+      failed++;
+    }
+  static const char *LIMITS[] = { "0", "-0", "9223372036854775807", "-9223372036854775808", "9223372036854775808", "-9223372036854775809", "1.0", "12a" };
+  for(size_t i=0; i<(sizeof(LIMITS) / sizeof(LIMITS[0])); i++, tests++) {
+    if((sizeof(long) == 8) && !checkInt(LIMITS[i]))
+      failed++;
+    }
+  // Literals and escaped strings
+  JsonToken tokens[8];
+  JsonParser parser(tokens, 8);
+  parser.parse("[true,false,null,nul,\"true\",\"a\\\"b\\\\c\\/d\\n\\u00e9\\u20ac\\ud83d\\ude00\"]");
+  bool first = false, second = true, literal;
+  char buffer[64];
+  tests += 2;
+  if(!parser.getBool(1, first) || !first || !parser.getBool(2, second) || second || !parser.isNull(3) || parser.isNull(4) || parser.getBool(5, literal))
+    failed++;
+  if((parser.unescape(6, buffer, sizeof(buffer)) != 17) || (strcmp(buffer, "a\"b\\c/d\n\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80") != 0) || (parser.unescape(6, buffer, 17) != -1))
+    failed++;
+  return failed;
+  }
+
+/** Build a telemetry document with 200 readings
+ */
+static std::string buildTelemetry() {
+  uint64_t state = 5;
+  std::string json = "{\"readings\":[";
+  for(int i=0; i<200; i++) {
+    char reading[160];
+    uint64_t r = nextRandom(state);
+    snprintf(reading, sizeof(reading), "%s{\"t\":%.2f,\"h\":%.1f,\"p\":%.3f,\"v\":%d,\"ts\":%lld}", (i == 0) ? "" : ",",
+      15 + (r % 2000) / 100.0, ((r >> 12) % 1000) / 10.0, 990 + ((r >> 24) % 50000) / 1000.0, (int)((r >> 40) % 4096), 1700000000000LL + i);
+    json += reading;
+    }
+  return json + "]}";
+  }
+
+int main() {
+  int tests, failed = verify(tests);
+  printf("Checked the accessors on %d values: %d failures\n", tests, failed);
+  std::string json = buildTelemetry();
+  static JsonToken tokens[MAX_TOKENS];
+  JsonParser parser(tokens, MAX_TOKENS);
+  int count = parser.parse(json.c_str());
+  // Every number, then just the integers
+  static int numbers[MAX_TOKENS], integers[MAX_TOKENS];
+  int numberCount = 0, integerCount = 0;
+  for(int i=0; i<count; i++) {
+    long value;
+    if(tokens[i].type == JsonPrimitive)
+      numbers[numberCount++] = i;
+    if(parser.getInt(i, value))
+      integers[integerCount++] = i;
+    }
+  for(int integer=0; integer<2; integer++) {
+    const int *pIndex = integer ? integers : numbers;
+    int values = integer ? integerCount : numberCount;
+    double elapsed[2], sum[2];
+    for(int method=0; method<2; method++) {
+      sum[method] = 0;
+      double start = now();
+      for(int pass=0; pass<PASSES; pass++) {
+        for(int i=0; i<values; i++) {
+          int token = pIndex[i];
+          if(method == 0) {
+            char buffer[32];
+            int length = parser.len(token);
+            memset(buffer, 0, sizeof(buffer));
+            strncpy(buffer, parser.str(token), (length < 31) ? length : 31);
+            sum[method] += integer ? atol(buffer) : atof(buffer);
+            }
+          else if(integer) {
+            long value = 0;
+            parser.getInt(token, value);
+            sum[method] += value;
+            }
+          else {
+            double value = 0;
+            parser.getDouble(token, value);
+            sum[method] += value;
+            }
+          }
+        }
+      elapsed[method] = ((now() - start) * 1e9) / ((double)PASSES * values);
+      }
+    if(sum[0] != sum[1])
+      failed++;
+    printf("%-7s copy+%s %6.1f ns/number, %-9s %6.1f ns/number (%.1fx)\n", integer ? "Integer" : "Double", integer ? "atol" : "atof",
+      elapsed[0], integer ? "getInt" : "getDouble", elapsed[1], elapsed[0] / elapsed[1]);
+    }
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,135 @@
+/*--------------------------------------------------------------------------*
+* Settings lookup benchmark
+*---------------------------------------------------------------------------*
+* Compares the hashed index used by the Settings getters and setters with
+* the search through the packed buffer that is used when there is no memory
+* for the index, for tables of 50, 100 and 200 settings. Both are checked
+* to give the same values before they are timed.
+*
+* The index allocation is made to fail by wrapping malloc() so it must be
+* linked with -Wl,--wrap=malloc.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <Settings.h>
+#include "benchmark.h"
+
+// Size of the buffer given to Settings (half is used for the settings)
+#define BUFFER_SIZE 32768
+
+// Number of calls for each measurement
+#define CALLS 200000
+
+static bool g_failMalloc = false;
+
+extern "C" {
+  void *__real_malloc(size_t size);
+
+  void *__wrap_malloc(size_t size) {
+    return g_failMalloc ? NULL : __real_malloc(size);
+    }
+  }
+
+/** Build a settings table of a given size
+ *
+ * Names are similar in length to those in the sketches. Every fourth
+ * setting is a string, then an integer, a boolean and a number.
+ */
+static void buildTable(int count, std::vector<std::string> &names, std::vector<SettingDescription> &table) {
+  static const char *GROUPS[] = { "wifi", "mqtt", "sensor", "display" };
+  char name[32];
+  names.clear();
+  for(int i=0; i<count; i++) {
+    snprintf(name, sizeof(name), "%s.option%03d", GROUPS[i % 4], i);
+    names.push_back(name);
+    }
+  table.assign(count + 1, SettingDescription());
+  for(int i=0; i<count; i++) {
+    table[i].name = names[i].c_str();
+    switch(i % 4) {
+      case 0:  table[i].typeAndModifier = StringSetting;  table[i].value.string = "default"; break;
+      case 1:  table[i].typeAndModifier = IntegerSetting; table[i].value.integer = i; break;
+      case 2:  table[i].typeAndModifier = BooleanSetting; table[i].value.boolean = (i & 1) != 0; break;
+      default: table[i].typeAndModifier = NumberSetting;  table[i].value.number = i * 0.5;
+      }
+    }
+  table[count].name = "";
+  table[count].typeAndModifier = EndOfSettings;
+  }
+
+/** Check that both instances hold the same values as the table
+ *
+ * @return the number of differences.
+ */
+static int compare(Settings &indexed, Settings &linear, const std::vector<std::string> &names, const std::vector<SettingDescription> &table) {
+  int failed = 0;
+  for(size_t i=0; i<names.size(); i++) {
+    const char *cszName = names[i].c_str();
+    switch(table[i].typeAndModifier & SETTING_TYPE_MASK) {
+      case StringSetting:
+        failed += strcmp(indexed.getString(cszName, ""), linear.getString(cszName, "-")) != 0;
+        break;
+      case IntegerSetting:
+        failed += indexed.getInteger(cszName, -1) != linear.getInteger(cszName, -2);
+        break;
+      case BooleanSetting:
+        failed += indexed.getBoolean(cszName, false) != linear.getBoolean(cszName, true);
+        break;
+      default:
+        failed += indexed.getNumber(cszName, -1) != linear.getNumber(cszName, -2);
+      }
+    }
+  // Missing names and the wrong type give the alternate
+  failed += (indexed.getInteger("missing", -7) != -7) || (linear.getInteger("missing", -7) != -7);
+  failed += (indexed.getInteger(names[0].c_str(), -7) != -7) || (linear.getInteger(names[0].c_str(), -7) != -7);
+  return failed;
+  }
+
+int main() {
+  static unsigned char buffers[2][BUFFER_SIZE];
+  int failed = 0;
+  printf("%9s %21s %21s\n", "Settings", "get (index / search)", "set (index / search)");
+  for(int count=50; count<=200; count *= 2) {
+    std::vector<std::string> names;
+    std::vector<SettingDescription> table;
+    buildTable(count, names, table);
+    Settings indexed(table.data(), buffers[0], BUFFER_SIZE);
+    g_failMalloc = true;
+    Settings linear(table.data(), buffers[1], BUFFER_SIZE);
+    g_failMalloc = false;
+    // Same values after changes that move the settings that follow
+    failed += compare(indexed, linear, names, table);
+    for(int i=0; i<count; i+=4) {
+      indexed.setString(names[i].c_str(), "a much longer value than the default");
+      linear.setString(names[i].c_str(), "a much longer value than the default");
+      indexed.setInteger(names[i + 1].c_str(), -i);
+      linear.setInteger(names[i + 1].c_str(), -i);
+      }
+    failed += compare(indexed, linear, names, table);
+    if(indexed.getInteger(names[5].c_str(), 0) != -4)
+      failed++;
+    // Random reads of integers, then writes of the same size
+    double get[2], set[2];
+    volatile long sink = 0;
+    for(int method=0; method<2; method++) {
+      Settings &settings = (method == 0) ? indexed : linear;
+      uint64_t state = 5;
+      double start = now();
+      for(int i=0; i<CALLS; i++)
+        sink += settings.getInteger(names[1 + 4 * (nextRandom(state) % (count / 4))].c_str(), 0);
+      get[method] = ((now() - start) * 1e9) / CALLS;
+      start = now();
+      for(int i=0; i<CALLS; i++)
+        sink += settings.setInteger(names[1 + 4 * (nextRandom(state) % (count / 4))].c_str(), i);
+      set[method] = ((now() - start) * 1e9) / CALLS;
+      }
+    failed += compare(indexed, linear, names, table);
+    printf("%9d %7.0f / %6.0f ns %7.0f / %6.0f ns\n", count, get[0], get[1], set[0], set[1]);
+    }
+  if(failed != 0)
+    printf("%d values differ between the index and the search\n", failed);
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,233 @@
+/*--------------------------------------------------------------------------*
+* Settings power loss check
+*---------------------------------------------------------------------------*
+* Cuts the power at every word of a save, snapshots and deltas alike, then
+* checks that loading gives the values from before the save and that the
+* log carries on correctly from there. Each following save is loaded back
+* until the log has moved through the sectors, a sequence number taken from
+* a torn header would make a later snapshot lose to an older one.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <Settings.h>
+#include "benchmark.h"
+
+// Simulated flash layout
+#define SECTOR_SIZE 2048
+#define SECTORS     4
+
+// Size of the buffer given to Settings
+#define BUFFER_SIZE 2048
+
+// Number of settings in the table
+#define SETTING_COUNT 16
+
+// Number of saves to test the power loss on
+#define TRIALS 150
+
+// Saves made after each power loss (enough to use every sector again)
+#define FOLLOWING 40
+
+/** Simulated flash that loses power after a number of bytes
+ *
+ * Flash is programmed a word at a time so the write in progress keeps the
+ * words before the cut.
+ */
+class PowerLossStorage : public SettingsMemoryStorage {
+  private:
+    long m_budget; // Bytes that can be written before the power goes
+
+  public:
+    PowerLossStorage(void *pMemory) : SettingsMemoryStorage(pMemory, SECTOR_SIZE, SECTORS), m_budget(-1) {
+      }
+
+    /** Lose power after a number of bytes (or -1 never)
+     */
+    void setBudget(long budget) {
+      m_budget = budget;
+      }
+
+    virtual bool erase(int sector) {
+      return (m_budget != 0) && SettingsMemoryStorage::erase(sector);
+      }
+
+    virtual bool write(int sector, int offset, const void *pData, int length) {
+      if((m_budget >= 0) && (m_budget < length)) {
+        int part = m_budget & ~3;
+        if(part > 0)
+          SettingsMemoryStorage::write(sector, offset, pData, part);
+        m_budget = 0;
+        return false;
+        }
+      if(m_budget >= 0)
+        m_budget -= length;
+      return SettingsMemoryStorage::write(sector, offset, pData, length);
+      }
+  };
+
+/** Values expected for every setting
+ */
+class Model {
+  public:
+    std::string strings[SETTING_COUNT];
+    int         integers[SETTING_COUNT];
+
+    /** Change a setting in the model and the settings
+     *
+     * Some strings change length so the settings are copied as well.
+     */
+    void change(Settings &settings, const std::vector<std::string> &names, int number, int value) {
+      if((number % 2) == 0) {
+        char text[32];
+        snprintf(text, sizeof(text), "v%d%s", value, ((value % 3) == 0) ? "-longer" : "");
+        strings[number] = text;
+        settings.setString(names[number].c_str(), text);
+        }
+      else {
+        integers[number] = value;
+        settings.setInteger(names[number].c_str(), value);
+        }
+      }
+
+    /** Count the settings that do not have the expected value
+     */
+    int differences(Settings &settings, const std::vector<std::string> &names) const {
+      int count = 0;
+      for(int i=0; i<SETTING_COUNT; i++) {
+        if((i % 2) == 0)
+          count += strings[i] != settings.getString(names[i].c_str(), "?");
+        else
+          count += integers[i] != settings.getInteger(names[i].c_str(), -1);
+        }
+      return count;
+      }
+  };
+
+static std::vector<std::string> g_names;
+static std::vector<SettingDescription> g_table;
+static unsigned char g_buffer[BUFFER_SIZE];
+
+/** Count the sector erases so far
+ */
+static uint32_t totalErases(PowerLossStorage &storage) {
+  uint32_t erases = 0;
+  for(int i=0; i<storage.getSectors(); i++)
+    erases += storage.getErases(i);
+  return erases;
+  }
+
+/** Load the settings from the storage into a new instance and compare them
+ *
+ * @return the number of differences or -1 if nothing was loaded.
+ */
+static int loadAndCompare(PowerLossStorage &storage, const Model &model) {
+  Settings settings(g_table.data(), g_buffer, sizeof(g_buffer), false);
+  settings.setStorage(&storage);
+  return settings.load() ? model.differences(settings, g_names) : -1;
+  }
+
+/** Make a few changes and save them
+ *
+ * @return true if the save succeeded.
+ */
+static bool changeAndSave(Settings &settings, Model &model, uint64_t &state, int changes) {
+  for(int i=0; i<changes; i++)
+    model.change(settings, g_names, nextRandom(state) % SETTING_COUNT, nextRandom(state) % 100000);
+  return settings.save();
+  }
+
+int main() {
+  char name[32];
+  for(int i=0; i<SETTING_COUNT; i++) {
+    snprintf(name, sizeof(name), "app.setting%02d", i);
+    g_names.push_back(name);
+    }
+  g_table.assign(SETTING_COUNT + 1, SettingDescription());
+  Model defaults;
+  for(int i=0; i<SETTING_COUNT; i++) {
+    g_table[i].name = g_names[i].c_str();
+    g_table[i].typeAndModifier = ((i % 2) == 0) ? StringSetting : IntegerSetting;
+    if((i % 2) == 0)
+      g_table[i].value.string = "default";
+    else
+      g_table[i].value.integer = i;
+    defaults.strings[i] = "default";
+    defaults.integers[i] = i;
+    }
+  g_table[SETTING_COUNT].name = "";
+  g_table[SETTING_COUNT].typeAndModifier = EndOfSettings;
+  static unsigned char flash[SECTOR_SIZE * SECTORS], saved[SECTOR_SIZE * SECTORS];
+  memset(flash, 0xFF, sizeof(flash));
+  PowerLossStorage storage(flash);
+  static unsigned char buffer[BUFFER_SIZE];
+  // Start with the defaults in the log
+  Model model = defaults;
+  Settings first(g_table.data(), buffer, sizeof(buffer));
+  first.setStorage(&storage);
+  if(!first.save() || (loadAndCompare(storage, model) != 0)) {
+    printf("Could not save the defaults\n");
+    return 1;
+    }
+  uint64_t state = 1;
+  int failed = 0, cuts = 0, snapshots = 0;
+  for(int trial=0; trial<TRIALS; trial++) {
+    // The same save is repeated with the power cut at every word
+    memcpy(saved, flash, sizeof(flash));
+    uint64_t changes = state;
+    Model before = model, after;
+    int size = 0;
+    for(long budget=-1; ; budget=(budget < 0) ? 0 : (budget + 4)) {
+      memcpy(flash, saved, sizeof(flash));
+      Settings settings(g_table.data(), buffer, sizeof(buffer), false);
+      settings.setStorage(&storage);
+      settings.load();
+      after = before;
+      state = changes;
+      uint32_t written = storage.getWritten(), erases = totalErases(storage);
+      storage.setBudget(budget);
+      bool success = changeAndSave(settings, after, state, 1 + (trial % 3));
+      storage.setBudget(-1);
+      if(budget < 0) {
+        // Measure the save without a power loss first
+        size = storage.getWritten() - written;
+        if(totalErases(storage) != erases)
+          snapshots++;
+        if(!success)
+          failed++;
+        continue;
+        }
+      if(success || (budget >= size))
+        break;
+      cuts++;
+      // The save failed so the old values must still be there
+      if(loadAndCompare(storage, before) != 0) {
+        printf("Trial %d: power lost after %ld of %d bytes, the values changed\n", trial, budget, size);
+        failed++;
+        continue;
+        }
+      // Carry on from there until every sector has been used again, each save
+      // must load back (it would not if a new snapshot was numbered below the old)
+      Settings following(g_table.data(), buffer, sizeof(buffer), false);
+      following.setStorage(&storage);
+      following.load();
+      Model current = before;
+      uint64_t more = changes ^ (uint64_t)budget;
+      for(int i=0; i<FOLLOWING; i++) {
+        if(!changeAndSave(following, current, more, 3) || (loadAndCompare(storage, current) != 0)) {
+          printf("Trial %d: power lost after %ld of %d bytes, save %d after it was lost\n", trial, budget, size, i + 1);
+          failed++;
+          break;
+          }
+        }
+      }
+    // Keep the complete save and check it
+    model = after;
+    if(loadAndCompare(storage, model) != 0)
+      failed++;
+    }
+  printf("Cut the power at %d points in %d saves (%d snapshots): %d failures\n", cuts, TRIALS, snapshots, failed);
+  return (failed == 0) ? 0 : 1;
+  }
@@ -0,0 +1,17 @@
+/*--------------------------------------------------------------------------*
+* Example settings table for the image tool
+*---------------------------------------------------------------------------*
+* Replace this with the header that defines the table for your sketch (or
+* build with -DSETTINGS_TABLE=\"path/to/table.h\"). The table must be
+* called DEFAULTS.
+*--------------------------------------------------------------------------*/
+BEGIN_SETTINGS(DEFAULTS)
+  SETTING_STRING("ssid", NoModifier, "")
+  SETTING_STRING("password", HiddenSetting, "")
+  SETTING_STRING("node", NoModifier, "")
+  SETTING_STRING("serial", ReadOnlySetting, "")
+  SETTING_STRING("mqtt", NoModifier, "")
+  SETTING_INTEGER("port", NoModifier, 1883)
+  SETTING_BOOLEAN("tls", NoModifier, false)
+  SETTING_NUMBER("interval", NoModifier, 60.0)
+END_SETTINGS
@@ -0,0 +1,488 @@
+/*--------------------------------------------------------------------------*
+* Settings image compiler and validator
+*---------------------------------------------------------------------------*
+* Host tool that builds ready to flash settings images from the settings
+* table of a sketch and a JSON file of values, and checks, compares and
+* prints images read back from devices. It uses the same Settings library
+* as the device so the images are always in the format load() expects.
+*--------------------------------------------------------------------------*/
+#include "Arduino.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <TGL.h>
+#include <Json.h>
+#include <Settings.h>
+
+// The settings table (must define DEFAULTS)
+#ifndef SETTINGS_TABLE
+#  define SETTINGS_TABLE "example.h"
+#endif
+#include SETTINGS_TABLE
+
+// Default flash layout (ESP8266 sectors)
+#define DEFAULT_SECTOR_SIZE 4096
+#define DEFAULT_SECTORS     4
+#define DEFAULT_BUFFER_SIZE 1024
+
+// Maximum number of read only values in a JSON file
+#define MAX_READONLY 32
+
+// Exit codes
+#define EXIT_DIFFERENT 1
+#define EXIT_INVALID   2
+
+/** Options from the command line
+ */
+typedef struct {
+  int         sectorSize;
+  int         sectors;
+  int         bufferSize;
+  const char *cszOutput;
+  } Options;
+
+/** Read only values found while importing JSON
+ */
+typedef struct {
+  const char *cszFile;
+  int         keys[MAX_READONLY];
+  int         count;
+  bool        failed;
+  } ImportState;
+
+//---------------------------------------------------------------------------
+// Helper functions
+//---------------------------------------------------------------------------
+
+/** Read an entire file into memory
+ *
+ * @param cszFile the name of the file.
+ * @param length receives the size of the file.
+ *
+ * @return a NUL terminated copy of the file (free with free()) or NULL if
+ *         it could not be read.
+ */
+static char *readFile(const char *cszFile, long &length) {
+  FILE *fp = fopen(cszFile, "rb");
+  if (fp == NULL)
+    return NULL;
+  char *pData = NULL;
+  if ((fseek(fp, 0, SEEK_END) == 0) && ((length = ftell(fp)) >= 0) && (fseek(fp, 0, SEEK_SET) == 0)) {
+    pData = (char *)malloc(length + 1);
+    if ((pData != NULL) && (fread(pData, 1, length, fp) != (size_t)length)) {
+      free(pData);
+      pData = NULL;
+      }
+    else if (pData != NULL)
+      pData[length] = '\0';
+    }
+  fclose(fp);
+  return pData;
+  }
+
+/** Find the position of a setting in the table
+ *
+ * @return the number of the setting or -1 if it is not in the table.
+ */
+static int findDefault(const char *cszName) {
+  for(int i=0; DEFAULTS[i].typeAndModifier != EndOfSettings; i++) {
+    if (strcmp(DEFAULTS[i].name, cszName) == 0)
+      return i;
+    }
+  return -1;
+  }
+
+/** Print a string as a quoted, escaped JSON string
+ */
+static void printString(const char *cszValue) {
+  putchar('"');
+  for(; *cszValue; cszValue++) {
+    unsigned char ch = (unsigned char)*cszValue;
+    if ((ch == '"') || (ch == '\\'))
+      printf("\\%c", ch);
+    else if (ch < 0x20)
+      printf("\\u%04x", ch);
+    else
+      putchar(ch);
+    }
+  putchar('"');
+  }
+
+/** Print the value of a setting
+ *
+ * @param type the type of the setting.
+ * @param value the value to print.
+ */
+static void printValue(int type, const SettingValue &value) {
+  char buffer[JSON_NUMBER_SIZE];
+  switch(type) {
+    case StringSetting:
+      printString(value.string);
+      break;
+    case IntegerSetting:
+      printf("%d", value.integer);
+      break;
+    case BooleanSetting:
+      printf("%s", value.boolean ? "true" : "false");
+      break;
+    case NumberSetting:
+      JsonFormat::number(buffer, value.number);
+      printf("%s", buffer);
+      break;
+    }
+  }
+
+/** Determine if two values of the same type are equal
+ */
+static bool sameValue(int type, const SettingValue &value1, const SettingValue &value2) {
+  switch(type) {
+    case StringSetting:
+      return strcmp(value1.string, value2.string) == 0;
+    case IntegerSetting:
+      return value1.integer == value2.integer;
+    case BooleanSetting:
+      return value1.boolean == value2.boolean;
+    case NumberSetting:
+      return value1.number == value2.number;
+    }
+  return false;
+  }
+
+/** Get the name of a setting type
+ */
+static const char *typeName(int type) {
+  switch(type) {
+    case StringSetting:  return "string";
+    case IntegerSetting: return "integer";
+    case BooleanSetting: return "boolean";
+    case NumberSetting:  return "number";
+    }
+  return "unknown";
+  }
+
+/** Report fields from a JSON file that could not be imported
+ *
+ * Read only settings are collected so they can be set afterwards, the
+ * factory is where they get their values.
+ */
+static void onImportError(JsonParser &parser, int key, SettingError error, void *pContext) {
+  ImportState *pState = (ImportState *)pContext;
+  if ((error == SettingReadOnly) && (pState->count < MAX_READONLY)) {
+    pState->keys[pState->count++] = key;
+    return;
+    }
+  fprintf(stderr, "%s: '%.*s': %s\n", pState->cszFile, parser.len(key), parser.str(key),
+    (error == SettingUnknown) ? "not a setting" : (error == SettingWrongType) ? "wrong type or out of range" : "too many read only values");
+  pState->failed = true;
+  }
+
+/** Apply the values from a JSON file
+ *
+ * @param settings the settings to change.
+ * @param cszFile the name of the file.
+ *
+ * @return true if every field was applied.
+ */
+static bool importJson(Settings &settings, const char *cszFile) {
+  long length;
+  char *pJson = readFile(cszFile, length);
+  if (pJson == NULL) {
+    fprintf(stderr, "%s: cannot read file\n", cszFile);
+    return false;
+    }
+  // There can never be more tokens than characters
+  JsonToken *pTokens = (JsonToken *)malloc((length + 1) * sizeof(JsonToken));
+  JsonParser parser(pTokens, length + 1);
+  ImportState state;
+  state.cszFile = cszFile;
+  state.count = 0;
+  state.failed = false;
+  bool success = false;
+  if ((pTokens == NULL) || (parser.parse(pJson, length) <= 0) || !parser.isObject(0))
+    fprintf(stderr, "%s: not a valid JSON object\n", cszFile);
+  else if (settings.fromJson(parser, 0, onImportError, &state) < 0)
+    fprintf(stderr, "%s: the settings do not fit in the buffer\n", cszFile);
+  else {
+    success = !state.failed;
+    // Now set the read only values
+    char szName[MAX_SETTING_NAME_LENGTH + 1], szValue[254];
+    for(int i=0; i<state.count; i++) {
+      int key = state.keys[i];
+      long integer;
+      SettingValue value;
+      parser.unescape(key, szName, sizeof(szName));
+      int number = findDefault(szName);
+      int type = DEFAULTS[number].typeAndModifier & SETTING_TYPE_MASK;
+      bool valid = false;
+      switch(type) {
+        case StringSetting:
+          value.string = szValue;
+          valid = parser.isString(key + 1) && (parser.unescape(key + 1, szValue, sizeof(szValue)) >= 0);
+          break;
+        case IntegerSetting:
+          valid = parser.getInt(key + 1, integer) && (integer == (int)integer);
+          value.integer = (int)integer;
+          break;
+        case BooleanSetting:
+          valid = parser.getBool(key + 1, value.boolean);
+          break;
+        case NumberSetting:
+          valid = parser.getDouble(key + 1, value.number);
+          break;
+        }
+      if (!valid)
+        fprintf(stderr, "%s: '%s': wrong type or out of range\n", cszFile, szName);
+      else if (!settings.setValue(number, value))
+        fprintf(stderr, "%s: the settings do not fit in the buffer\n", cszFile);
+      else
+        continue;
+      success = false;
+      }
+    }
+  free(pTokens);
+  free(pJson);
+  return success;
+  }
+
+/** Settings loaded from an image file
+ */
+class SettingsImage {
+  private:
+    unsigned char         *m_pImage;
+    unsigned char         *m_pBuffer;
+    SettingsMemoryStorage *m_pStorage;
+    Settings              *m_pSettings;
+
+  public:
+    SettingsImage() {
+      m_pImage = NULL;
+      m_pBuffer = NULL;
+      m_pStorage = NULL;
+      m_pSettings = NULL;
+      }
+
+    ~SettingsImage() {
+      delete m_pSettings;
+      delete m_pStorage;
+      free(m_pBuffer);
+      free(m_pImage);
+      }
+
+    /** Read and load an image
+     *
+     * @param cszFile the name of the image file.
+     * @param options the flash layout and buffer size.
+     *
+     * @return true if the image contains valid settings.
+     */
+    bool load(const char *cszFile, const Options &options) {
+      long length;
+      m_pImage = (unsigned char *)readFile(cszFile, length);
+      if (m_pImage == NULL) {
+        fprintf(stderr, "%s: cannot read file\n", cszFile);
+        return false;
+        }
+      if ((length == 0) || ((length % options.sectorSize) != 0)) {
+        fprintf(stderr, "%s: size is not a multiple of the sector size (%d)\n", cszFile, options.sectorSize);
+        return false;
+        }
+      m_pBuffer = (unsigned char *)malloc(options.bufferSize);
+      if (m_pBuffer == NULL) {
+        fprintf(stderr, "Not enough memory\n");
+        return false;
+        }
+      m_pStorage = new SettingsMemoryStorage(m_pImage, options.sectorSize, length / options.sectorSize);
+      m_pSettings = new Settings(DEFAULTS, m_pBuffer, options.bufferSize, false);
+      if (!m_pSettings->setStorage(m_pStorage)) {
+        fprintf(stderr, "%s: cannot use this layout\n", cszFile);
+        return false;
+        }
+      if (!m_pSettings->load()) {
+        fprintf(stderr, "%s: no valid settings snapshot\n", cszFile);
+        return false;
+        }
+      return true;
+      }
+
+    /** Get the loaded settings
+     */
+    Settings &settings() {
+      return *m_pSettings;
+      }
+  };
+
+//---------------------------------------------------------------------------
+// Commands
+//---------------------------------------------------------------------------
+
+/** Print every setting
+ *
+ * Settings that are not in the image (so the default is used) are marked.
+ */
+static int printSettings(Settings &settings, bool image) {
+  for(int i=0; DEFAULTS[i].typeAndModifier != EndOfSettings; i++) {
+    int type = DEFAULTS[i].typeAndModifier & SETTING_TYPE_MASK;
+    printf("%-*s %-8s ", MAX_SETTING_NAME_LENGTH, DEFAULTS[i].name, typeName(type));
+    printValue(type, settings.getValue(i));
+    if (DEFAULTS[i].typeAndModifier & HiddenSetting)
+      printf(" (hidden)");
+    if (DEFAULTS[i].typeAndModifier & ReadOnlySetting)
+      printf(" (read only)");
+    if (image && settings.isDirty(DEFAULTS[i].name))
+      printf(" (default)");
+    printf("\n");
+    }
+  return 0;
+  }
+
+/** Build an image from the table and optional JSON files
+ *
+ * Later files override earlier ones.
+ */
+static int buildImage(const Options &options, int files, char *pszFiles[]) {
+  unsigned char *pBuffer = (unsigned char *)malloc(options.bufferSize);
+  unsigned char *pImage = (unsigned char *)malloc(options.sectors * options.sectorSize);
+  if ((pBuffer == NULL) || (pImage == NULL)) {
+    fprintf(stderr, "Not enough memory\n");
+    return EXIT_INVALID;
+    }
+  memset(pImage, 0xFF, options.sectors * options.sectorSize);
+  int result = 0;
+  Settings settings(DEFAULTS, pBuffer, options.bufferSize);
+  SettingsMemoryStorage storage(pImage, options.sectorSize, options.sectors);
+  for(int i=0; (result == 0) && (i<files); i++) {
+    if (!importJson(settings, pszFiles[i]))
+      result = EXIT_INVALID;
+    }
+  if ((result == 0) && (!settings.setStorage(&storage) || !settings.save())) {
+    fprintf(stderr, "The settings do not fit in a sector\n");
+    result = EXIT_INVALID;
+    }
+  if (result == 0) {
+    FILE *fp = fopen(options.cszOutput, "wb");
+    if ((fp == NULL) || (fwrite(pImage, options.sectorSize, options.sectors, fp) != (size_t)options.sectors) || (fclose(fp) != 0)) {
+      fprintf(stderr, "%s: cannot write file\n", options.cszOutput);
+      result = EXIT_INVALID;
+      }
+    }
+  free(pImage);
+  free(pBuffer);
+  return result;
+  }
+
+/** Check an image
+ *
+ * The image must have a valid snapshot, settings missing from it are
+ * reported (the device will use the defaults).
+ */
+static int checkImage(const Options &options, const char *cszFile) {
+  SettingsImage image;
+  if (!image.load(cszFile, options))
+    return EXIT_INVALID;
+  int missing = 0;
+  for(int i=0; DEFAULTS[i].typeAndModifier != EndOfSettings; i++) {
+    if (image.settings().isDirty(DEFAULTS[i].name)) {
+      printf("%s: '%s' is not in the image, the default will be used\n", cszFile, DEFAULTS[i].name);
+      missing++;
+      }
+    }
+  printf("%s: valid, %d settings missing\n", cszFile, missing);
+  return 0;
+  }
+
+/** Show the differences between two images
+ */
+static int diffImages(const Options &options, const char *cszFile1, const char *cszFile2) {
+  SettingsImage image1, image2;
+  if (!image1.load(cszFile1, options) || !image2.load(cszFile2, options))
+    return EXIT_INVALID;
+  int result = 0;
+  for(int i=0; DEFAULTS[i].typeAndModifier != EndOfSettings; i++) {
+    int type = DEFAULTS[i].typeAndModifier & SETTING_TYPE_MASK;
+    SettingValue value1 = image1.settings().getValue(i), value2 = image2.settings().getValue(i);
+    if (sameValue(type, value1, value2))
+      continue;
+    printf("%s: ", DEFAULTS[i].name);
+    printValue(type, value1);
+    printf(" -> ");
+    printValue(type, value2);
+    printf("\n");
+    result = EXIT_DIFFERENT;
+    }
+  return result;
+  }
+
+/** Show how to use the tool
+ */
+static int usage() {
+  fprintf(stderr,
+    "Usage: settings-image [options] command [files]\n"
+    "\n"
+    "Commands:\n"
+    "  build [values.json ...]  build an image from the table and values\n"
+    "  check image              check an image read from a device\n"
+    "  print image              show the settings in an image\n"
+    "  diff image1 image2       show the settings that differ\n"
+    "  table                    show the settings table\n"
+    "\n"
+    "Options:\n"
+    "  -o file   output file for build (default settings.bin)\n"
+    "  -n count  number of sectors (default %d)\n"
+    "  -z size   sector size in bytes (default %d)\n"
+    "  -b size   settings buffer size of the sketch (default %d)\n",
+    DEFAULT_SECTORS, DEFAULT_SECTOR_SIZE, DEFAULT_BUFFER_SIZE);
+  return EXIT_INVALID;
+  }
+
+//---------------------------------------------------------------------------
+// Main program
+//---------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+  Options options;
+  options.sectorSize = DEFAULT_SECTOR_SIZE;
+  options.sectors = DEFAULT_SECTORS;
+  options.bufferSize = DEFAULT_BUFFER_SIZE;
+  options.cszOutput = "settings.bin";
+  int arg = 1;
+  for(; (arg < argc) && (argv[arg][0] == '-'); arg += 2) {
+    if ((arg + 1) >= argc)
+      return usage();
+    if (strcmp(argv[arg], "-o") == 0)
+      options.cszOutput = argv[arg + 1];
+    else if (strcmp(argv[arg], "-n") == 0)
+      options.sectors = atoi(argv[arg + 1]);
+    else if (strcmp(argv[arg], "-z") == 0)
+      options.sectorSize = atoi(argv[arg + 1]);
+    else if (strcmp(argv[arg], "-b") == 0)
+      options.bufferSize = atoi(argv[arg + 1]);
+    else
+      return usage();
+    }
+  if ((arg >= argc) || (options.sectors < 1) || (options.sectorSize < 64) || ((options.sectorSize & 3) != 0) || (options.bufferSize < 16))
+    return usage();
+  const char *cszCommand = argv[arg++];
+  int files = argc - arg;
+  if (strcmp(cszCommand, "build") == 0)
+    return buildImage(options, files, &argv[arg]);
+  if ((strcmp(cszCommand, "check") == 0) && (files == 1))
+    return checkImage(options, argv[arg]);
+  if ((strcmp(cszCommand, "print") == 0) && (files == 1)) {
+    SettingsImage image;
+    return image.load(argv[arg], options) ? printSettings(image.settings(), true) : EXIT_INVALID;
+    }
+  if ((strcmp(cszCommand, "diff") == 0) && (files == 2))
+    return diffImages(options, argv[arg], argv[arg + 1]);
+  if ((strcmp(cszCommand, "table") == 0) && (files == 0)) {
+    unsigned char *pBuffer = (unsigned char *)malloc(options.bufferSize);
+    if (pBuffer == NULL) {
+      fprintf(stderr, "Not enough memory\n");
+      return EXIT_INVALID;
+      }
+    Settings settings(DEFAULTS, pBuffer, options.bufferSize);
+    int result = printSettings(settings, false);
+    free(pBuffer);
+    return result;
+    }
+  return usage();
+  }